@@ -171,14 +171,23 @@ list(APPEND MICROPY_SOURCE_EXTMOD
     ${TULIP_SHARED_DIR}/display.c
     ${TULIP_SHARED_DIR}/bresenham.c
     ${TULIP_SHARED_DIR}/tulip_helpers.c
+    ${TULIP_SHARED_DIR}/async_load.c
     ${TULIP_SHARED_DIR}/editor.c
+    ${TULIP_SHARED_DIR}/editor_text.c
+    ${TULIP_SHARED_DIR}/editor_search.c
     ${TULIP_SHARED_DIR}/keyscan.c
     ${TULIP_SHARED_DIR}/help.c
     ${TULIP_SHARED_DIR}/alles.c
+    ${TULIP_SHARED_DIR}/alles_wire.c
+    ${TULIP_SHARED_DIR}/alles_sync.c
+    ${TULIP_SHARED_DIR}/alles_peers.c
+    ${TULIP_SHARED_DIR}/alles_reliable.c
     ${TULIP_SHARED_DIR}/ui.c
     ${TULIP_SHARED_DIR}/midi.c
     ${TULIP_SHARED_DIR}/sounds.c
     ${TULIP_SHARED_DIR}/tsequencer.c
+    ${TULIP_SHARED_DIR}/audio_stats.c
+    ${TULIP_SHARED_DIR}/render_split.c
     ${TULIP_SHARED_DIR}/lodepng.c
     ${TULIP_SHARED_DIR}/lvgl_u8g2.c
     ${TULIP_SHARED_DIR}/u8fontdata.c
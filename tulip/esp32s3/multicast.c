@@ -17,6 +17,7 @@
 #include "lwip/netdb.h"
 #include "esp_timer.h"
 #include "alles.h"
+#include "alles_wire.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
 
@@ -28,11 +29,12 @@ static const char *V4TAG = "mcast-ipv4";
 int sock= -1;
 
 extern void deserialize_event(char * message, uint16_t length);
-char udp_message[MAX_RECEIVE_LEN];
+char udp_message[ALLES_WIRE_MAX_LEN];
 extern char *message_start_pointer;
 extern int16_t message_length;
 extern void delay_ms(uint32_t ms);
 uint32_t udp_message_counter = 0;
+struct sockaddr_in mcast_dest; // resolved once when the socket is created
 
 
 
@@ -121,40 +123,39 @@ void create_multicast_ipv4_socket(void) {
     // group for listening...
     err = socket_add_ipv4_multicast_group(true);
 
+    memset(&mcast_dest, 0, sizeof(mcast_dest));
+    mcast_dest.sin_family = AF_INET;
+    mcast_dest.sin_port = htons(UDP_PORT);
+    inet_aton(MULTICAST_IPV4_ADDR, &mcast_dest.sin_addr.s_addr);
+
     // All set, socket is configured for sending and receiving
 }
 
 // Send a multicast message 
 void mcast_send(char * message, uint16_t len) {
-    char addrbuf[32] = { 0 };
-    struct addrinfo hints = {
-        .ai_flags = AI_PASSIVE,
-        .ai_socktype = SOCK_DGRAM,
-    };
-    struct addrinfo *res;
-
-
-    hints.ai_family = AF_INET; // For an IPv4 socket
-    int err = getaddrinfo(MULTICAST_IPV4_ADDR, NULL, &hints, &res);
-    if (err < 0) {
-        ESP_LOGE(TAG, "getaddrinfo() failed for IPV4 destination address. error: %d", err);
-    }
-    if (res == 0) {
-        ESP_LOGE(TAG, "getaddrinfo() did not return any addresses");
-    }
-    ((struct sockaddr_in *)res->ai_addr)->sin_port = htons(UDP_PORT);
-    inet_ntoa_r(((struct sockaddr_in *)res->ai_addr)->sin_addr, addrbuf, sizeof(addrbuf)-1);
-    //ESP_LOGI(TAG, "Sending to IPV4 multicast address %s:%d...",  addrbuf, UDP_PORT);
-    //printf("sending message %s\n", message);
-    err = sendto(sock, message, len, 0, res->ai_addr, res->ai_addrlen);
-    freeaddrinfo(res);
+    int err = sendto(sock, message, len, 0, (struct sockaddr *)&mcast_dest, sizeof(mcast_dest));
     if (err < 0) {
         ESP_LOGE(TAG, "IPV4 sendto failed. errno: %d", errno);
     }
 }
 
+// lwIP has no sendmmsg, so a batch is just back to back sends
+void mcast_send_batch(char ** messages, uint16_t * lens, uint8_t count) {
+    for(uint8_t i=0;i<count;i++) mcast_send(messages[i], lens[i]);
+}
+
 
 
+static void handle_message(char * message, uint16_t length) {
+    udp_message_counter++;
+    message_start_pointer = message;
+    message_length = length;
+    // tell the parse task, time to parse this message into deltas and add to the queue
+    xTaskNotifyGive(alles_parse_handle);
+    // And wait for it to come back
+    ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+}
+
 void mcast_listen_task(void *pvParameters) {
     struct timeval tv = {
         .tv_sec =  1,
@@ -199,21 +200,7 @@ void mcast_listen_task(void *pvParameters) {
                         break;
                     }
                     udp_message[full_message_length] = 0;
-                    uint16_t start = 0;
-                    // Break the packet up into messages (delimited by Z.)
-                    for(uint16_t i=0;i<full_message_length;i++) {
-                        if(udp_message[i] == 'Z') {
-                            udp_message[i] = 0;
-                            udp_message_counter++;
-                            message_start_pointer = udp_message + start;
-                            message_length = i - start;
-                            // tell the parse task, time to parse this message into deltas and add to the queue
-                            xTaskNotifyGive(alles_parse_handle);
-                            // And wait for it to come back
-                            ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
-                            start = i+1;
-                        }
-                    }
+                    alles_wire_split(udp_message, full_message_length, handle_message);
                 }
             }
             // Tulip does not ping other nodes.
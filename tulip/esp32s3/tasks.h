@@ -18,6 +18,8 @@
 #define TULIP_MP_TASK_PRIORITY (ESP_TASK_PRIO_MIN + 1)
 
 #define MIDI_TASK_PRIORITY (ESP_TASK_PRIO_MAX - 2)
+// Below MicroPython, so loading never holds up the REPL
+#define ASYNC_LOAD_TASK_PRIORITY (ESP_TASK_PRIO_MIN)
 
 //#define ALLES_TASK_PRIORITY (ESP_TASK_PRIO_MIN + 2)
 
@@ -33,6 +35,7 @@
 #define TULIP_MP_TASK_COREID (1)
 #define SEQUENCER_TASK_COREID (0)
 #define MIDI_TASK_COREID (0)
+#define ASYNC_LOAD_TASK_COREID (1)
 #define ALLES_TASK_COREID (1)
 #define ALLES_PARSE_TASK_COREID (0)
 #define ALLES_RECEIVE_TASK_COREID (1)
@@ -45,6 +48,7 @@
 #define TULIP_MP_TASK_STACK_SIZE      (32 * 1024)
 #define SEQUENCER_TASK_STACK_SIZE (2 * 1024)
 #define MIDI_TASK_STACK_SIZE (4 * 1024)
+#define ASYNC_LOAD_TASK_STACK_SIZE (8 * 1024)
 #define ALLES_TASK_STACK_SIZE    (4 * 1024) 
 #define ALLES_PARSE_TASK_STACK_SIZE (8 * 1024)
 #define ALLES_RECEIVE_TASK_STACK_SIZE (4 * 1024)
@@ -59,6 +63,7 @@
 #define SEQUENCER_TASK_NAME         "seq_task"
 #define TULIP_MP_TASK_NAME          "tulip_mp_task"
 #define MIDI_TASK_NAME              "midi_task"
+#define ASYNC_LOAD_TASK_NAME        "async_task"
 #define ALLES_TASK_NAME             "alles_task"
 #define ALLES_PARSE_TASK_NAME       "alles_par_task"
 #define ALLES_RECEIVE_TASK_NAME     "alles_rec_task"
@@ -73,6 +78,7 @@ extern TaskHandle_t sequencer_handle;
 extern TaskHandle_t touchscreen_handle;
 extern TaskHandle_t tulip_mp_handle;
 extern TaskHandle_t midi_handle;
+extern TaskHandle_t async_load_handle;
 extern TaskHandle_t alles_handle;
 extern TaskHandle_t alles_parse_handle;
 extern TaskHandle_t alles_receive_handle;
@@ -128,18 +128,18 @@ void run_tdeck_display(void) {
     gpio_set_level(TDECK_LCD_BK_LIGHT_GPIO, 1);
 
     // If you don't clear the screen it'll still show what was left there after reboots. 
-    uint8_t * clear = malloc_caps(H_RES*V_RES*2, MALLOC_CAP_DMA);
+    uint8_t * clear = malloc_caps_tag(H_RES*V_RES*2, MALLOC_CAP_DMA, MEM_TAG_DISPLAY);
     memset(clear, 0, H_RES*V_RES*2 );
     esp_lcd_panel_draw_bitmap(panel_handle, 0, 0, H_RES, V_RES, clear);
-    free(clear);
+    free_caps(clear);
 
     brightness = DEFAULT_BRIGHTNESS;
 
     // Time the frame sync and stay running forever 
     int64_t tic0 = esp_timer_get_time();
     uint16_t loop_count =0;
-    uint8_t *frame_bb =(uint8_t*) malloc_caps(H_RES*FONT_HEIGHT, MALLOC_CAP_DMA);
-    uint16_t *bb565 = (uint16_t*) malloc_caps(H_RES*FONT_HEIGHT*2, MALLOC_CAP_DMA);
+    uint8_t *frame_bb =(uint8_t*) malloc_caps_tag(H_RES*FONT_HEIGHT, MALLOC_CAP_DMA, MEM_TAG_DISPLAY);
+    uint16_t *bb565 = (uint16_t*) malloc_caps_tag(H_RES*FONT_HEIGHT*2, MALLOC_CAP_DMA, MEM_TAG_DISPLAY);
     while(1)  { 
         if(loop_count++ >= 100) {
             float reported_fps = 1000000.0 / ((esp_timer_get_time() - tic0) / loop_count);
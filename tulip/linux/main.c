@@ -479,8 +479,7 @@ static void sys_set_excecutable(char *argv0) {
 #endif
 
 
-extern int16_t amy_playback_device_id;
-extern int16_t amy_capture_device_id;
+#include "unix_audio.h"
 extern void setup_lvgl();
 
 /*
@@ -864,13 +863,24 @@ extern int8_t unix_display_flag;
 #include "lvgl.h"
 #include "tsequencer.h"
 
+// A whole number from min to max, or a usage error
+static long option_number(int opt, const char *arg, long min, long max) {
+    char *end;
+    long v = strtol(arg, &end, 10);
+    if(end == arg || *end != 0 || v < min || v > max) {
+        fprintf(stderr, "-%c takes a number from %ld to %ld, not %s\n", opt, min, max, arg);
+        exit(1);
+    }
+    return v;
+}
+
 int main(int argc, char **argv) {
     // Get the resources folder loc
     // So thread out alles and then micropython tasks
 
     // Display has to run on main thread on macos
     int opt;
-    while((opt = getopt(argc, argv, ":d:c:lh")) != -1) 
+    while((opt = getopt(argc, argv, ":d:c:lLPb:a:t:h")) != -1) 
     { 
         switch(opt) 
         { 
@@ -884,11 +894,31 @@ int main(int argc, char **argv) {
                 amy_print_devices();
                 exit(0);
                 break;
+            case 'L':
+                unix_audio_set_mode(UNIX_AUDIO_MODE_LOW_LATENCY);
+                break;
+            case 'P':
+                unix_audio_set_mode(UNIX_AUDIO_MODE_HIGH_POLYPHONY);
+                break;
+            case 'b':
+                unix_audio_period_frames = option_number(opt, optarg, 0, UINT16_MAX);
+                break;
+            case 'a':
+                unix_audio_lookahead = option_number(opt, optarg, 0, UNIX_AUDIO_MAX_LOOKAHEAD);
+                break;
+            case 't':
+                unix_audio_set_threads(option_number(opt, optarg, 0, UNIX_AUDIO_MAX_THREADS));
+                break;
             case 'h':
                 fprintf(stderr,"usage: tulip\n");
                 fprintf(stderr,"\t[-d sound device id, use -l to list, default, autodetect]\n");
                 fprintf(stderr,"\t[-c capture sound device id, use -l to list, default, autodetect]\n");
                 fprintf(stderr,"\t[-l list all sound devices and exit]\n");
+                fprintf(stderr,"\t[-L low latency audio: small blocks, realtime priority]\n");
+                fprintf(stderr,"\t[-P high polyphony audio: bigger blocks rendered ahead on all render threads]\n");
+                fprintf(stderr,"\t[-b audio callback size in frames, default, autodetect]\n");
+                fprintf(stderr,"\t[-a AMY blocks to render ahead of the audio device, 0-%d, default 0]\n", UNIX_AUDIO_MAX_LOOKAHEAD);
+                fprintf(stderr,"\t[-t audio render threads, up to %d, default 0 for one per CPU]\n", UNIX_AUDIO_MAX_THREADS);
                 fprintf(stderr,"\t[-h show this help and exit]\n");
                 exit(0);
                 break;
@@ -3,6 +3,12 @@
 // brian@variogr.am
 
 #include "alles.h"
+#include "audio_stats.h"
+#include "render_split.h"
+#include "alles_wire.h"
+#include "alles_peers.h"
+#include "alles_reliable.h"
+#include "polyfills.h"
 
 uint8_t board_level;
 uint8_t status;
@@ -35,17 +41,13 @@ char * alles_local_ip;
 //extern uint8_t battery_mask;
 extern uint8_t ipv4_quartet;
 extern char githash[8];
-int32_t clocks[255];
-int32_t ping_times[255];
-uint8_t alive = 1;
+// What we send with: the lowest version every live node understands, if the user asked for binary
+uint8_t mesh_wire_version = 0;
+uint8_t mesh_wire_wanted = 0;
 extern int32_t last_ping_time;
 
 uint8_t mesh_flag = 0;
 
-amy_err_t sync_init() {
-    for(uint8_t i=0;i<255;i++) { clocks[i] = 0; ping_times[i] = 0; }
-    return AMY_OK;
-}
 
 
 
@@ -61,7 +63,10 @@ extern void mcast_listen_task(void *pvParameters);
 void esp_render_task( void * pvParameters) {
     while(1) {
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        amy_render(0, AMY_OSCS/2, 1);
+        audio_stats_render_start(1);
+        render_split_part_start();
+        amy_render(render_split_bounds[0], render_split_bounds[1], 1);
+        audio_stats_render_stop(1);
         xTaskNotifyGive(alles_fill_buffer_handle);
     }
 }
@@ -70,18 +75,25 @@ void esp_render_task( void * pvParameters) {
 void esp_fill_audio_buffer_task() {
     while(1) {
         AMY_PROFILE_START(AMY_ESP_FILL_BUFFER)
+        audio_stats_block_start();
 
         // Get ready to render
         amy_prepare_buffer();
         // Tell the other core to start rendering
         xTaskNotifyGive(amy_render_handle);
         // Render me
-        amy_render(AMY_OSCS/2, AMY_OSCS, 0);
+        audio_stats_render_start(0);
+        render_split_part_start();
+        amy_render(render_split_bounds[1], render_split_bounds[2], 0);
+        audio_stats_render_stop(0);
         // Wait for the other core to finish
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Rebalance the oscillators between cores for the next block
+        render_split_update();
 
         // Write to i2s
         int16_t *block = amy_fill_buffer();
+        audio_stats_block_stop();
         AMY_PROFILE_STOP(AMY_ESP_FILL_BUFFER)
 
         // We turn off writing to i2s on r10 when doing on chip debugging because of pins
@@ -89,6 +101,7 @@ void esp_fill_audio_buffer_task() {
         size_t written = 0;
         i2s_channel_write(tx_handle, block, AMY_BLOCK_SIZE * AMY_BYTES_PER_SAMPLE * AMY_NCHANS, &written, portMAX_DELAY);
         if(written != AMY_BLOCK_SIZE * AMY_BYTES_PER_SAMPLE * AMY_NCHANS) {
+            audio_stats_underrun();
             fprintf(stderr,"i2s underrun: %d vs %d\n", written, AMY_BLOCK_SIZE * AMY_BYTES_PER_SAMPLE * AMY_NCHANS);
         }
         #endif
@@ -98,7 +111,8 @@ void esp_fill_audio_buffer_task() {
 }
 
 #else
-void *mcast_listen_task(void *vargp);
+extern void mcast_listen_start();
+extern void mcast_listen_stop();
 #endif
 
 
@@ -111,10 +125,121 @@ void alles_send_message(char * message, uint16_t len) {
     alles_parse_message(message, len);
 }
 
+// Mesh send queue. Messages are packed back to back into datagrams (receivers already split on 'Z')
+// and sent together by alles_mesh_flush. Python queues, and the sequencer hook flushes every tick,
+// so the queue is locked. It's a mutex rather than a spinlock as flushing sends on the socket.
+// The hook only ever tries the lock, so the sequencer never waits on Python.
+#if defined ESP_PLATFORM
+static SemaphoreHandle_t mesh_mutex = NULL;
+// Made by alles_init_multicast, nothing is sent to the mesh before that
+#define MESH_LOCK() do { if(mesh_mutex) xSemaphoreTake(mesh_mutex, portMAX_DELAY); } while(0)
+#define MESH_TRY_LOCK() (mesh_mutex == NULL || xSemaphoreTake(mesh_mutex, 0) == pdTRUE)
+#define MESH_UNLOCK() do { if(mesh_mutex) xSemaphoreGive(mesh_mutex); } while(0)
+#else
+#include <pthread.h>
+static pthread_mutex_t mesh_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define MESH_LOCK() pthread_mutex_lock(&mesh_mutex)
+#define MESH_TRY_LOCK() (pthread_mutex_trylock(&mesh_mutex) == 0)
+#define MESH_UNLOCK() pthread_mutex_unlock(&mesh_mutex)
+#endif
+char mesh_queue[MESH_QUEUE_DATAGRAMS][MAX_RECEIVE_LEN];
+uint16_t mesh_queue_lens[MESH_QUEUE_DATAGRAMS];
+uint8_t mesh_queue_count = 0;
+
+// Binary datagrams, allocated the first time the mesh agrees on a wire version
+uint8_t (*mesh_wire_queue)[ALLES_WIRE_MAX_LEN] = NULL;
+
+static void mesh_flush_binary() {
+    if(mesh_wire_queue == NULL) {
+        mesh_wire_queue = malloc_caps_tag(MESH_QUEUE_DATAGRAMS * ALLES_WIRE_MAX_LEN, MALLOC_CAP_SPIRAM, MEM_TAG_ALLES);
+        if(mesh_wire_queue == NULL) { mesh_wire_version = 0; return; }
+    }
+    char * datagrams[MESH_QUEUE_DATAGRAMS];
+    uint16_t lens[MESH_QUEUE_DATAGRAMS];
+    uint8_t count = 0;
+    lens[0] = 0;
+    for(uint8_t d=0;d<mesh_queue_count;d++) {
+        uint16_t start = 0;
+        for(uint16_t i=0;i<mesh_queue_lens[d];i++) {
+            if(mesh_queue[d][i] != 'Z') continue;
+            char * message = mesh_queue[d] + start;
+            uint16_t len = i - start;
+            start = i + 1;
+            uint16_t n = alles_wire_encode(message, len, mesh_wire_queue[count], lens[count], ALLES_WIRE_MAX_LEN);
+            if(n == 0 && lens[count]) {
+                // Full, move on to the next datagram (sending the batch if we're out of them)
+                if(++count == MESH_QUEUE_DATAGRAMS) {
+                    for(uint8_t j=0;j<count;j++) datagrams[j] = (char*)mesh_wire_queue[j];
+                    mcast_send_batch(datagrams, lens, count);
+                    count = 0;
+                }
+                lens[count] = 0;
+                n = alles_wire_encode(message, len, mesh_wire_queue[count], 0, ALLES_WIRE_MAX_LEN);
+            }
+            if(n == 0) {
+                // Can't be encoded, every node still reads ASCII (the 'Z' is still there)
+                mcast_send(message, len + 1);
+            } else {
+                lens[count] = n;
+            }
+        }
+    }
+    if(lens[count]) count++;
+    for(uint8_t j=0;j<count;j++) datagrams[j] = (char*)mesh_wire_queue[j];
+    if(count) mcast_send_batch(datagrams, lens, count);
+}
+
+// With the lock held
+static void mesh_flush() {
+    if(!mesh_queue_count) return;
+    if(mesh_wire_version) {
+        mesh_flush_binary();
+    } else {
+        char * messages[MESH_QUEUE_DATAGRAMS];
+        for(uint8_t i=0;i<mesh_queue_count;i++) messages[i] = mesh_queue[i];
+        mcast_send_batch(messages, mesh_queue_lens, mesh_queue_count);
+    }
+    mesh_queue_count = 0;
+}
+
+void alles_mesh_flush() {
+    MESH_LOCK();
+    mesh_flush();
+    MESH_UNLOCK();
+}
+
+void alles_mesh_try_flush() {
+    // Checked without the lock first, as the hook calls this every tick. If Python is queueing
+    // or flushing right now, the next tick picks the messages up.
+    if(!mesh_queue_count) return;
+    if(!MESH_TRY_LOCK()) return;
+    mesh_flush();
+    MESH_UNLOCK();
+}
+
+void alles_mesh_queue(char * message, uint16_t len) {
+    MESH_LOCK();
+    // Leave room for the receiver's terminating 0
+    if(len >= MAX_RECEIVE_LEN) {
+        mesh_flush();
+        mcast_send(message, len);
+    } else {
+        if(mesh_queue_count == 0 || mesh_queue_lens[mesh_queue_count-1] + len >= MAX_RECEIVE_LEN) {
+            if(mesh_queue_count == MESH_QUEUE_DATAGRAMS) mesh_flush();
+            mesh_queue_lens[mesh_queue_count++] = 0;
+        }
+        uint8_t d = mesh_queue_count - 1;
+        memcpy(mesh_queue[d] + mesh_queue_lens[d], message, len);
+        mesh_queue_lens[d] += len;
+    }
+    MESH_UNLOCK();
+}
+
 #ifdef ESP_PLATFORM
 // init AMY from the esp. wraps some amy funcs in a task to do multicore rendering on the ESP32 
 amy_err_t esp_amy_init() {
-    sync_init();
+    audio_stats_init(2);
+    render_split_init(2);
     amy_start(2,1,1,1);
     // We create a mutex for changing the event queue and pointers as two tasks do it at once
     xQueueSemaphore = xSemaphoreCreateMutex();
@@ -132,10 +257,23 @@ amy_err_t esp_amy_init() {
 #else
 
 extern void *miniaudio_run(void *vargp);
+extern uint8_t unix_audio_threads;
+extern void unix_audio_pick_threads();
 #include <pthread.h>
+
+// Only here to count rendered oscillators for audio_stats, nothing is rendered externally on desktop
+uint8_t stats_render_hook(uint16_t osc, SAMPLE * buf, uint16_t len) {
+    audio_stats_voice();
+    render_split_osc(osc);
+    return 0;
+}
+
 amy_err_t unix_amy_init() {
-    sync_init();
-    amy_start(1,1,1,1);
+    unix_audio_pick_threads();
+    audio_stats_init(unix_audio_threads);
+    render_split_init(unix_audio_threads);
+    amy_external_render_hook = stats_render_hook;
+    amy_start(unix_audio_threads,1,1,1);
     pthread_t thread_id;
     pthread_create(&thread_id, NULL, miniaudio_run, NULL);
     return AMY_OK;
@@ -187,6 +325,8 @@ amy_err_t setup_i2s(void) {
 
 // An AMY hook to send values out to a CV DAC over i2c, only on ESP 
 uint8_t external_cv_render(uint16_t osc, SAMPLE * buf, uint16_t len) {
+    audio_stats_voice();
+    render_split_osc(osc);
     if(external_map[osc]>0) {
         float volts = S2F(buf[0])*2.5f + 2.5f;
         // do the thing
@@ -259,11 +399,17 @@ void esp_parse_task() {
 #endif
 
 #ifndef ESP_PLATFORM
-    pthread_t thread_id;
+#include "alles_sim.h"
 #endif
 
 void alles_init_multicast() {
     if(!mesh_flag) {
+    #ifdef ESP_PLATFORM
+        if(mesh_mutex == NULL) mesh_mutex = xSemaphoreCreateMutex();
+    #endif
+        alles_peers_init();
+        alles_sync_init();
+        alles_reliable_init();
     #ifdef ESP_PLATFORM
         fprintf(stderr, "creating socket\n");
         create_multicast_ipv4_socket();
@@ -274,16 +420,34 @@ void alles_init_multicast() {
         fprintf(stderr, "creating parse task\n");
         xTaskCreatePinnedToCore(&esp_parse_task, ALLES_PARSE_TASK_NAME, ALLES_PARSE_TASK_STACK_SIZE, NULL, ALLES_PARSE_TASK_PRIORITY, &alles_parse_handle, ALLES_PARSE_TASK_COREID);
     #else
-        if(alles_local_ip[0]==0) {
+        if(alles_sim_config.nodes) {
+            // tulip.alles_sim() asked for virtual nodes instead of the network. They answer on loopback,
+            // and the listen task's socket attaches to them.
+            if(!alles_sim_start()) return;
+        } else if(alles_local_ip[0]==0) {
             get_first_ip_address(alles_local_ip);
         }
         fprintf(stderr, "creating mcast task\n");
-        pthread_create(&thread_id, NULL, mcast_listen_task, NULL);
+        mcast_listen_start();
     #endif
         mesh_flag = 1;
     }
 }
 
+#ifndef ESP_PLATFORM
+// Leaves the mesh: anything still queued is dropped, the listen task closes its socket and the simulator,
+// if running, shuts down. alles_init_multicast can start it all again.
+void alles_stop_multicast() {
+    if(!mesh_flag) return;
+    mesh_flag = 0;
+    MESH_LOCK();
+    mesh_queue_count = 0;
+    MESH_UNLOCK();
+    mcast_listen_stop();
+    if(alles_sim_running) alles_sim_stop();
+}
+#endif
+
 
 
 
@@ -300,6 +464,7 @@ void alles_parse_message(char *message, uint16_t length) {
     uint16_t start = 0;
     uint16_t c = 0;
     uint8_t sync_response = 0;
+    uint8_t wire = 0;
 
     // Parse the AMY stuff out of the message first
     struct event e = amy_parse_message(message);
@@ -317,6 +482,7 @@ void alles_parse_message(char *message, uint16_t length) {
                 if(mode=='U') sync = atol(message + start); 
                 if(mode=='W') external_map[e.osc] = atoi(message+start);
                 if(sync_response) if(mode=='r') ipv4=atoi(message + start);
+                if(sync_response) if(mode=='w') wire=atoi(message + start);
                 if(mode=='i') sync_index = atoi(message + start);
                 mode = b;
                 start = c + 1;
@@ -327,7 +493,8 @@ void alles_parse_message(char *message, uint16_t length) {
     if(sync_response) {
         // If this is a sync response, let's update our local map of who is booted
         //fprintf(stderr, "sync response message was %s\n", message);
-        update_map(client, ipv4, sync);
+        update_map(client, ipv4, sync, wire);
+        alles_sync_response(ipv4, sync, sync_index);
         length = 0; // don't need to do the rest
     } else {
         // Note, we DO NOT do anything with computed_delta in Tulip. Tulip cannot receive alles mesh messages for playback.
@@ -347,33 +514,24 @@ void alles_parse_message(char *message, uint16_t length) {
     }
 }
 
-void update_map(uint8_t client, uint8_t ipv4, int32_t time) {
+void update_map(uint8_t client, uint8_t ipv4, int32_t time, uint8_t wire) {
     // I'm called when I get a sync response or a regular ping packet
     // I update a map of booted devices.
     //fprintf(stderr,"Got a sync response client %d ipv4 %d time %"PRIu32"\n",  client , ipv4, time);
-    clocks[ipv4] = time;
-    int32_t my_sysclock = amy_sysclock();
-    ping_times[ipv4] = my_sysclock;
-
-    uint8_t last_alive = alive;
-    alive = 0;
-    for(uint8_t i=0;i<255;i++) {
-        if(clocks[i] > 0) { 
-            if(my_sysclock < (ping_times[i] + (PING_TIME_MS * 2))) { // alive
-                alive++;
-            } else {
-                clocks[i] = 0;
-                ping_times[i] = 0;
-            }
-        }
-    }
-    if(last_alive != alive) {
-        fprintf(stderr,"[alles] %d alive\n", alive);
+    uint8_t last_alive = alles_peer_count;
+    alles_peers_expire(amy_sysclock());
+    alles_peers_seen(ipv4, client, time, wire);
+    // One old node on the mesh and everyone gets ASCII, multicast can't pick and choose
+    uint8_t agreed = alles_peers_wire_version();
+    mesh_wire_version = mesh_wire_wanted ? (agreed > ALLES_WIRE_BINARY ? ALLES_WIRE_BINARY : agreed) : 0;
+    if(last_alive != alles_peer_count) {
+        fprintf(stderr,"[alles] %d alive\n", alles_peer_count);
     }
 }
 
 void handle_sync(int32_t time, int8_t index) {
     // Tulip doesn't respond to alles sync messages ever, as it does not boot as an alles node (it can control them only)
+    // Nodes answer with ALLES_SYNC_RESPONSE_FMT, which is how Tulip learns their wire version.
 }
 
 
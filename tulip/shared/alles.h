@@ -52,6 +52,7 @@ typedef int16_t i2s_sample_type;
 #define MULTICAST_IPV4_ADDR "232.10.11.12"
 #define PING_TIME_MS 10000   // ms between boards pinging each other
 #define MAX_RECEIVE_LEN 255
+#define MESH_QUEUE_DATAGRAMS 16 // datagrams of coalesced messages held before a flush
 
 // enums
 #define DEVBOARD 0
@@ -74,13 +75,14 @@ extern void wifi_tone();
 extern void scale(uint8_t wave);
 
 void alles_parse_message(char *message, uint16_t length);
-void update_map(uint8_t client, uint8_t ipv4, int32_t time);
+void update_map(uint8_t client, uint8_t ipv4, int32_t time, uint8_t wire);
 void handle_sync(int32_t time, int8_t index);
 void ping(int32_t sysclock);
 
 
 // multicast
 extern void mcast_send(char*, uint16_t len);
+extern void mcast_send_batch(char ** messages, uint16_t * lens, uint8_t count);
 extern void create_multicast_ipv4_socket();
 
 void alles_init_multicast();
@@ -88,6 +90,11 @@ void alles_stop_multicast();
 
 void esp_show_debug(uint8_t type);
 void alles_send_message(char * message, uint16_t len);
+// Queued messages go out together on the next sequencer tick (or an alles_mesh_flush)
+void alles_mesh_queue(char * message, uint16_t len);
+void alles_mesh_flush();
+// For the sequencer hook: flushes unless someone else holds the queue, never waits
+void alles_mesh_try_flush();
 
 #ifdef ESP_PLATFORM
 void run_alles();
@@ -0,0 +1,194 @@
+// alles_peers.c
+// Peers live in fixed slots (so pointers and wheel links stay put), found by ipv4 through a 256 byte index.
+// Live slots are also kept in peer_order, sorted by uptime, so the map is always ready to hand out.
+// Each peer sits in the expiry wheel bucket for the second it times out in; expiring walks only the
+// buckets that have passed since last time, so nothing scans the whole address space.
+
+#include "alles_peers.h"
+#include "alles_wire.h"
+#include <string.h>
+
+// Pings arrive on the network task while Python reads the map from the MP task.
+#if defined ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+static portMUX_TYPE peers_mux = portMUX_INITIALIZER_UNLOCKED;
+#define PEERS_LOCK() portENTER_CRITICAL_SAFE(&peers_mux)
+#define PEERS_UNLOCK() portEXIT_CRITICAL_SAFE(&peers_mux)
+#else
+#include <pthread.h>
+static pthread_mutex_t peers_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define PEERS_LOCK() pthread_mutex_lock(&peers_mutex)
+#define PEERS_UNLOCK() pthread_mutex_unlock(&peers_mutex)
+#endif
+
+alles_peer_t * peers = NULL;
+uint8_t peer_index[256];              // ipv4 -> slot, or ALLES_NO_PEER
+uint8_t peer_order[ALLES_MAX_PEERS];  // live slots, most uptime first
+uint8_t alles_peer_count = 0;
+uint8_t peer_free[ALLES_MAX_PEERS];   // stack of free slots
+uint8_t peer_free_count = 0;
+uint8_t wheel[ALLES_WHEEL_SLOTS];     // first slot in each bucket
+int32_t wheel_done = 0;               // buckets up to this second have been expired
+uint8_t wire_counts[ALLES_WIRE_VERSION + 1];
+
+void alles_peers_lock() { PEERS_LOCK(); }
+void alles_peers_unlock() { PEERS_UNLOCK(); }
+
+void alles_peers_init() {
+    if(peers == NULL) {
+        peers = malloc_caps_tag(sizeof(alles_peer_t) * ALLES_MAX_PEERS, MALLOC_CAP_SPIRAM, MEM_TAG_ALLES);
+        if(peers == NULL) return;
+    }
+    PEERS_LOCK();
+    memset(peer_index, ALLES_NO_PEER, sizeof(peer_index));
+    memset(wheel, ALLES_NO_PEER, sizeof(wheel));
+    memset(wire_counts, 0, sizeof(wire_counts));
+    alles_peer_count = 0;
+    peer_free_count = ALLES_MAX_PEERS;
+    for(uint8_t i=0;i<ALLES_MAX_PEERS;i++) peer_free[i] = ALLES_MAX_PEERS - 1 - i;
+    wheel_done = amy_sysclock() / ALLES_WHEEL_SLOT_MS;
+    PEERS_UNLOCK();
+}
+
+// The order key: the node's clock minus ours, which doesn't move between pings. Bigger booted earlier.
+static int32_t uptime_key(alles_peer_t *p) {
+    return p->clock - p->ping_time;
+}
+
+static uint8_t wheel_bucket(alles_peer_t *p) {
+    return ((p->ping_time + ALLES_PEER_TIMEOUT_MS) / ALLES_WHEEL_SLOT_MS) & (ALLES_WHEEL_SLOTS - 1);
+}
+
+static void wheel_unlink(uint8_t slot) {
+    alles_peer_t *p = &peers[slot];
+    if(p->wheel_prev != ALLES_NO_PEER) peers[p->wheel_prev].wheel_next = p->wheel_next;
+    else wheel[wheel_bucket(p)] = p->wheel_next;
+    if(p->wheel_next != ALLES_NO_PEER) peers[p->wheel_next].wheel_prev = p->wheel_prev;
+}
+
+static void wheel_link(uint8_t slot) {
+    alles_peer_t *p = &peers[slot];
+    uint8_t b = wheel_bucket(p);
+    p->wheel_prev = ALLES_NO_PEER;
+    p->wheel_next = wheel[b];
+    if(wheel[b] != ALLES_NO_PEER) peers[wheel[b]].wheel_prev = slot;
+    wheel[b] = slot;
+}
+
+static uint8_t order_position(uint8_t slot) {
+    for(uint8_t i=0;i<alles_peer_count;i++) if(peer_order[i] == slot) return i;
+    return ALLES_NO_PEER;
+}
+
+// Moves the peer at position i up or down until peer_order is sorted again
+static void order_settle(uint8_t i) {
+    int32_t key = uptime_key(&peers[peer_order[i]]);
+    while(i > 0 && uptime_key(&peers[peer_order[i-1]]) < key) {
+        uint8_t t = peer_order[i-1]; peer_order[i-1] = peer_order[i]; peer_order[i] = t;
+        i--;
+    }
+    while(i + 1 < alles_peer_count && uptime_key(&peers[peer_order[i+1]]) > key) {
+        uint8_t t = peer_order[i+1]; peer_order[i+1] = peer_order[i]; peer_order[i] = t;
+        i++;
+    }
+}
+
+static void peer_remove(uint8_t slot) {
+    alles_peer_t *p = &peers[slot];
+    wheel_unlink(slot);
+    uint8_t i = order_position(slot);
+    if(i != ALLES_NO_PEER) {
+        memmove(peer_order + i, peer_order + i + 1, alles_peer_count - i - 1);
+        alles_peer_count--;
+    }
+    wire_counts[p->wire]--;
+    peer_index[p->ipv4] = ALLES_NO_PEER;
+    peer_free[peer_free_count++] = slot;
+}
+
+uint8_t alles_peers_seen(uint8_t ipv4, int16_t client, int32_t clock, uint8_t wire) {
+    if(peers == NULL) return 0;
+    if(wire > ALLES_WIRE_VERSION) wire = ALLES_WIRE_VERSION;
+    int32_t now = amy_sysclock();
+    uint8_t added = 0;
+    PEERS_LOCK();
+    uint8_t slot = peer_index[ipv4];
+    alles_peer_t *p;
+    if(slot == ALLES_NO_PEER) {
+        if(!peer_free_count) { PEERS_UNLOCK(); return 0; }
+        slot = peer_free[--peer_free_count];
+        p = &peers[slot];
+        memset(p, 0, sizeof(alles_peer_t));
+        p->ipv4 = ipv4;
+        peer_index[ipv4] = slot;
+        peer_order[alles_peer_count++] = slot;
+        added = 1;
+    } else {
+        p = &peers[slot];
+        wheel_unlink(slot);
+        wire_counts[p->wire]--;
+    }
+    p->client = client;
+    p->clock = clock;
+    p->ping_time = now;
+    p->wire = wire;
+    wire_counts[wire]++;
+    wheel_link(slot);
+    order_settle(added ? alles_peer_count - 1 : order_position(slot));
+    PEERS_UNLOCK();
+    return added;
+}
+
+void alles_peers_expire(int32_t now) {
+    if(peers == NULL) return;
+    int32_t now_slot = now / ALLES_WHEEL_SLOT_MS;
+    PEERS_LOCK();
+    // Only buckets whose whole second has passed, and never more than one lap
+    if(now_slot - wheel_done > ALLES_WHEEL_SLOTS) wheel_done = now_slot - ALLES_WHEEL_SLOTS;
+    while(wheel_done + 1 < now_slot) {
+        wheel_done++;
+        uint8_t slot = wheel[wheel_done & (ALLES_WHEEL_SLOTS - 1)];
+        while(slot != ALLES_NO_PEER) {
+            uint8_t next = peers[slot].wheel_next;
+            if(now - peers[slot].ping_time >= ALLES_PEER_TIMEOUT_MS) peer_remove(slot);
+            slot = next;
+        }
+    }
+    PEERS_UNLOCK();
+}
+
+alles_peer_t * alles_peer_find(uint8_t ipv4) {
+    if(peers == NULL || peer_index[ipv4] == ALLES_NO_PEER) return NULL;
+    return &peers[peer_index[ipv4]];
+}
+
+alles_peer_t * alles_peer_live(uint8_t i) {
+    return &peers[peer_order[i]];
+}
+
+uint8_t alles_peers_wire_version() {
+    if(!alles_peer_count) return 0;
+    for(uint8_t v=0;v<ALLES_WIRE_VERSION;v++) if(wire_counts[v]) return v;
+    return ALLES_WIRE_VERSION;
+}
+
+uint8_t alles_peers_snapshot(alles_peer_info_t * out, uint8_t max) {
+    if(peers == NULL) return 0;
+    PEERS_LOCK();
+    uint8_t n = alles_peer_count < max ? alles_peer_count : max;
+    for(uint8_t i=0;i<n;i++) {
+        alles_peer_t *p = &peers[peer_order[i]];
+        out[i].ipv4 = p->ipv4;
+        out[i].client = p->client;
+        out[i].wire = p->wire;
+        out[i].clock = p->clock;
+        out[i].ping_time = p->ping_time;
+        out[i].offset_ms = p->sync.offset_ms;
+        out[i].drift = p->sync.drift;
+        out[i].rtt_ms = p->sync.rtt_ms;
+        out[i].jitter_ms = p->sync.jitter_ms;
+        out[i].samples = p->sync.samples;
+    }
+    PEERS_UNLOCK();
+    return n;
+}
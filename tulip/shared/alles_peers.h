@@ -0,0 +1,64 @@
+// alles_peers.h
+// Live Alles nodes, keyed by the last quartet of their IPv4 address
+#ifndef ALLES_PEERS_H
+#define ALLES_PEERS_H
+
+#include "polyfills.h"
+#include "alles.h"
+#include "alles_sync.h"
+
+#define ALLES_MAX_PEERS 255
+#define ALLES_NO_PEER 0xFF
+// A node that hasn't pinged in this long is gone
+#define ALLES_PEER_TIMEOUT_MS (PING_TIME_MS * 2)
+// Expiry wheel: one bucket per second, enough buckets that a timeout never laps the wheel
+#define ALLES_WHEEL_SLOT_MS 1000
+#define ALLES_WHEEL_SLOTS 32
+
+typedef struct {
+    uint8_t ipv4;
+    int16_t client;
+    uint8_t wire;        // binary wire version it advertised, 0 for ASCII only
+    int32_t clock;       // its sysclock when it last pinged
+    int32_t ping_time;   // our sysclock when that ping arrived
+    alles_clock_t sync;
+    uint16_t rel_acked;  // last reliable seq it acked from us, if rel_acked_valid
+    uint8_t rel_acked_valid;
+    // expiry wheel bucket links, by slot
+    uint8_t wheel_prev;
+    uint8_t wheel_next;
+} alles_peer_t;
+
+// A copy of one peer, as handed out by alles_peers_snapshot
+typedef struct {
+    uint8_t ipv4;
+    int16_t client;
+    uint8_t wire;
+    int32_t clock;
+    int32_t ping_time;
+    float offset_ms;
+    float drift;
+    float rtt_ms;
+    float jitter_ms;
+    uint16_t samples;
+} alles_peer_info_t;
+
+// Number of live peers, kept up to date as they come and go
+extern uint8_t alles_peer_count;
+
+void alles_peers_init();
+void alles_peers_lock();
+void alles_peers_unlock();
+// Called for every ping / sync response. Returns 1 if this node is new.
+uint8_t alles_peers_seen(uint8_t ipv4, int16_t client, int32_t clock, uint8_t wire);
+// Drops every peer whose timeout has passed
+void alles_peers_expire(int32_t now);
+// These two need the lock held. Pointers are only good until it's released.
+alles_peer_t * alles_peer_find(uint8_t ipv4);
+alles_peer_t * alles_peer_live(uint8_t i); // i < alles_peer_count, oldest node (client 0) first
+// Lowest wire version every live peer understands
+uint8_t alles_peers_wire_version();
+// Copies up to max live peers to out, oldest node (most uptime) first. Returns how many.
+uint8_t alles_peers_snapshot(alles_peer_info_t * out, uint8_t max);
+
+#endif
@@ -0,0 +1,197 @@
+// alles_reliable.c
+// Go-back-N over the mesh socket. We number reliable messages, every node that can (wire version 2)
+// acks the highest seq it has taken in order, and anything not acked by every such live node within an
+// rto gets sent again, up to its tries. Receivers drop repeats and anything out of order; their ack
+// doubles as a NACK for what's missing. That needs every live node to advertise wire version 2, which
+// today means alles_sim nodes only (see ALLES_SYNC_RESPONSE_FMT). If any live node predates this it
+// can't ack or drop repeats, so a message goes out once, or tries times spaced an rto apart if the
+// caller says running it more than once is harmless.
+// Sending and retiring happen on the MicroPython thread. Acks land in the peer table under its lock.
+
+#include "alles_reliable.h"
+#include "alles_peers.h"
+#include "alles_wire.h"
+#include <string.h>
+
+extern uint8_t ipv4_quartet;
+
+typedef struct {
+    uint16_t seq;
+    uint8_t tries_left;
+    uint8_t blind;       // old nodes around, no acks to wait for, repeats are for idempotent messages
+    int32_t sent_at;
+    uint16_t len;        // of frame
+    char frame[ALLES_RELIABLE_HEADER + MAX_RECEIVE_LEN];
+} reliable_msg_t;
+
+reliable_msg_t * reliable_window = NULL;
+uint8_t reliable_head = 0;
+uint8_t reliable_count = 0;
+uint16_t reliable_next_seq = 0;
+uint8_t reliable_epoch = 0;
+uint32_t alles_reliable_retransmits = 0;
+uint32_t alles_reliable_failures = 0;
+
+// What we've taken in order from every other sender
+uint8_t rx_valid[256];
+uint8_t rx_epoch[256];
+uint16_t rx_expected[256];
+
+static int16_t seq_diff(uint16_t a, uint16_t b) {
+    return (int16_t)(a - b);
+}
+
+void alles_reliable_init() {
+    if(reliable_window == NULL) {
+        reliable_window = malloc_caps_tag(sizeof(reliable_msg_t) * ALLES_RELIABLE_WINDOW, MALLOC_CAP_SPIRAM, MEM_TAG_ALLES);
+    }
+    reliable_head = reliable_count = 0;
+    // A new epoch tells receivers our seqs started over
+    reliable_epoch = rand_uint8();
+    reliable_next_seq = 0;
+    memset(rx_valid, 0, sizeof(rx_valid));
+}
+
+uint8_t alles_reliable_pending() {
+    return reliable_count;
+}
+
+// Twice the worst round trip we've measured, so a slow node isn't hammered with repeats
+static uint32_t reliable_rto_ms() {
+    float rtt = 0;
+    alles_peers_lock();
+    for(uint8_t i=0;i<alles_peer_count;i++) {
+        alles_clock_t *c = &alles_peer_live(i)->sync;
+        if(c->samples && c->rtt_ms > rtt) rtt = c->rtt_ms;
+    }
+    alles_peers_unlock();
+    uint32_t rto = (uint32_t)(rtt * 2.0f);
+    return rto < ALLES_RELIABLE_MIN_RTO_MS ? ALLES_RELIABLE_MIN_RTO_MS : rto;
+}
+
+static void write_header(char * frame, uint8_t type, uint16_t seq) {
+    frame[0] = type;
+    frame[1] = ipv4_quartet;
+    frame[2] = reliable_epoch;
+    frame[3] = seq & 0xFF;
+    frame[4] = seq >> 8;
+}
+
+int8_t alles_reliable_send(char * message, uint16_t len, uint8_t tries, uint8_t idempotent) {
+    if(len > MAX_RECEIVE_LEN) return -1;
+    uint8_t blind = alles_peers_wire_version() < ALLES_WIRE_RELIABLE;
+    if(blind && !idempotent) {
+        // Old nodes would run every repeat (a second reset, another note on), so it goes once
+        mcast_send(message, len);
+        return 0;
+    }
+    if(reliable_window == NULL || reliable_count == ALLES_RELIABLE_WINDOW) return -1;
+    if(tries < 1) tries = 1;
+    reliable_msg_t *m = &reliable_window[(reliable_head + reliable_count) % ALLES_RELIABLE_WINDOW];
+    m->seq = reliable_next_seq++;
+    m->blind = blind;
+    m->tries_left = tries - 1;
+    m->sent_at = amy_sysclock();
+    if(m->blind) {
+        memcpy(m->frame, message, len);
+        m->len = len;
+    } else {
+        write_header(m->frame, ALLES_RELIABLE_DATA, m->seq);
+        memcpy(m->frame + ALLES_RELIABLE_HEADER, message, len);
+        m->len = len + ALLES_RELIABLE_HEADER;
+    }
+    reliable_count++;
+    mcast_send(m->frame, m->len);
+    return reliable_count == 1 ? 1 : 0;
+}
+
+// 1 if every live node that speaks the reliable protocol has acked seq
+static uint8_t all_acked(uint16_t seq) {
+    uint8_t acked = 1;
+    alles_peers_lock();
+    for(uint8_t i=0;i<alles_peer_count;i++) {
+        alles_peer_t *p = alles_peer_live(i);
+        if(p->wire < ALLES_WIRE_RELIABLE) continue;
+        if(!p->rel_acked_valid || seq_diff(p->rel_acked, seq) < 0) { acked = 0; break; }
+    }
+    alles_peers_unlock();
+    return acked;
+}
+
+uint32_t alles_reliable_service() {
+    if(reliable_window == NULL) return 0;
+    int32_t now = amy_sysclock();
+    uint32_t rto = reliable_rto_ms();
+    // Acks are cumulative, so retired messages are always at the head
+    while(reliable_count) {
+        reliable_msg_t *m = &reliable_window[reliable_head];
+        uint8_t done = m->blind ? (m->tries_left == 0) : all_acked(m->seq);
+        if(!done && m->tries_left == 0 && now - m->sent_at >= (int32_t)rto) {
+            alles_reliable_failures++;
+            fprintf(stderr, "[alles] reliable message %d was not acked by every node\n", m->seq);
+            done = 1;
+        }
+        if(!done) break;
+        reliable_head = (reliable_head + 1) % ALLES_RELIABLE_WINDOW;
+        reliable_count--;
+    }
+    // Go back N: once the oldest is overdue, everything after it goes again too. Blind (idempotent)
+    // messages are just repeated an rto apart.
+    for(uint8_t i=0;i<reliable_count;i++) {
+        reliable_msg_t *m = &reliable_window[(reliable_head + i) % ALLES_RELIABLE_WINDOW];
+        if(m->tries_left && now - m->sent_at >= (int32_t)rto) {
+            m->tries_left--;
+            m->sent_at = now;
+            alles_reliable_retransmits++;
+            mcast_send(m->frame, m->len);
+        }
+    }
+    return reliable_count ? rto : 0;
+}
+
+static void send_ack(uint8_t to, uint8_t epoch, uint16_t seq) {
+    char frame[ALLES_RELIABLE_HEADER + 1];
+    frame[0] = ALLES_RELIABLE_ACK;
+    frame[1] = ipv4_quartet;
+    frame[2] = epoch;
+    frame[3] = seq & 0xFF;
+    frame[4] = seq >> 8;
+    frame[5] = to;
+    mcast_send(frame, sizeof(frame));
+}
+
+void alles_reliable_receive(char * data, uint16_t len, void (*handle)(char *message, uint16_t length)) {
+    if(len < ALLES_RELIABLE_HEADER) return;
+    uint8_t type = data[0];
+    uint8_t from = data[1];
+    uint8_t epoch = data[2];
+    uint16_t seq = (uint8_t)data[3] | ((uint8_t)data[4] << 8);
+    // Our own frames come back to us over multicast loopback
+    if(from == ipv4_quartet) return;
+
+    if(type == ALLES_RELIABLE_ACK) {
+        if(len < ALLES_RELIABLE_HEADER + 1 || (uint8_t)data[5] != ipv4_quartet || epoch != reliable_epoch) return;
+        alles_peers_lock();
+        alles_peer_t *p = alles_peer_find(from);
+        if(p != NULL && (!p->rel_acked_valid || seq_diff(seq, p->rel_acked) > 0)) {
+            p->rel_acked = seq;
+            p->rel_acked_valid = 1;
+        }
+        alles_peers_unlock();
+        return;
+    }
+    if(type != ALLES_RELIABLE_DATA) return;
+
+    // First we've heard from this sender (or it restarted), start from wherever it is
+    if(!rx_valid[from] || rx_epoch[from] != epoch) {
+        rx_valid[from] = 1;
+        rx_epoch[from] = epoch;
+        rx_expected[from] = seq;
+    }
+    if(seq == rx_expected[from]) {
+        rx_expected[from]++;
+        alles_wire_split(data + ALLES_RELIABLE_HEADER, len - ALLES_RELIABLE_HEADER, handle);
+    }
+    // New data, repeats and gaps all get the same answer: here's how far we've got
+    send_ack(from, epoch, rx_expected[from] - 1);
+}
@@ -0,0 +1,33 @@
+// alles_reliable.h
+// Acknowledged delivery for mesh control messages (patch loads, resets, tempo). Notes stay unreliable.
+#ifndef ALLES_RELIABLE_H
+#define ALLES_RELIABLE_H
+
+#include "polyfills.h"
+
+// Frames: magic|type, sender quartet, sender epoch, seq (2 bytes LE), then for data the ASCII message(s)
+// and for acks the quartet being acked. Acks are cumulative: everything up to seq arrived in order.
+#define ALLES_RELIABLE_MAGIC 0xE0
+#define ALLES_RELIABLE_DATA 0xE0
+#define ALLES_RELIABLE_ACK 0xE1
+#define ALLES_RELIABLE_HEADER 5
+// Unacknowledged messages we hold on to for retransmits
+#define ALLES_RELIABLE_WINDOW 16
+#define ALLES_RELIABLE_MIN_RTO_MS 50
+
+void alles_reliable_init();
+// Sends message (up to MAX_RECEIVE_LEN, 'Z' terminated) with up to tries transmissions in total.
+// If some live node can't ack, it's sent once, unless idempotent says repeats are harmless.
+// Returns -1 if the window is full, 1 if the retransmit timer needs starting, 0 otherwise.
+int8_t alles_reliable_send(char * message, uint16_t len, uint8_t tries, uint8_t idempotent);
+// Retransmits what's overdue and retires what every node has acked.
+// Returns ms until it needs calling again, or 0 once nothing is outstanding.
+uint32_t alles_reliable_service();
+// Data and acks from the network task. Data is passed to handle once, in order.
+void alles_reliable_receive(char * data, uint16_t len, void (*handle)(char *message, uint16_t length));
+
+extern uint32_t alles_reliable_retransmits;
+extern uint32_t alles_reliable_failures;
+uint8_t alles_reliable_pending();
+
+#endif
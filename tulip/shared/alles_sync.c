@@ -0,0 +1,99 @@
+// alles_sync.c
+// Sync requests carry our clock ('U') and an index ('i'). Each node answers with its own clock and the
+// same index, so we know when we asked (t1), when we heard back (t4) and what the node read in between.
+// Assuming the trip is symmetric, offset = node_time - (t1 + rtt/2), good to within rtt/2. We keep the
+// best (lowest rtt) of the last few samples, and track drift as the slope from the first one we kept.
+
+#include "alles_sync.h"
+#include "alles_peers.h"
+#include "alles_wire.h"
+#include <inttypes.h>
+#include <string.h>
+
+int32_t sync_sent[ALLES_SYNC_REQUESTS];
+uint8_t sync_next_index = 0;
+
+void alles_sync_init() {
+    for(uint8_t i=0;i<ALLES_SYNC_REQUESTS;i++) sync_sent[i] = -1;
+}
+
+void alles_sync_request() {
+    char message[32];
+    uint8_t index = sync_next_index;
+    sync_next_index = (sync_next_index + 1) % ALLES_SYNC_REQUESTS;
+    int32_t now = amy_sysclock();
+    sync_sent[index] = now;
+    uint16_t len = snprintf(message, sizeof(message), "U%" PRIi32 "i%dZ", now, index);
+    mcast_send(message, len);
+}
+
+void alles_sync_response(uint8_t ipv4, int32_t node_time, int8_t index) {
+    if(index < 0 || sync_sent[index] < 0) return;
+    int32_t t4 = amy_sysclock();
+    float rtt = (float)(t4 - sync_sent[index]);
+    // A stale answer (index reused long ago) isn't worth anything
+    if(rtt < 0 || rtt > ALLES_SYNC_MAX_LATENCY_MS) return;
+    alles_peers_lock();
+    alles_peer_t *peer = alles_peer_find(ipv4);
+    if(peer == NULL) { alles_peers_unlock(); return; }
+    alles_clock_t *c = &peer->sync;
+    c->win_offset[c->win_pos] = (float)(node_time - sync_sent[index]) - rtt * 0.5f;
+    c->win_rtt[c->win_pos] = rtt;
+    c->win_at[c->win_pos] = t4;
+    c->win_pos = (c->win_pos + 1) % ALLES_SYNC_WINDOW;
+    c->samples++;
+
+    uint8_t n = c->samples < ALLES_SYNC_WINDOW ? c->samples : ALLES_SYNC_WINDOW;
+    uint8_t best = 0;
+    for(uint8_t i=1;i<n;i++) if(c->win_rtt[i] < c->win_rtt[best]) best = i;
+    c->jitter_ms += (rtt - c->win_rtt[best] - c->jitter_ms) * 0.25f;
+
+    if(c->win_at[best] != c->ref_ms) {
+        c->offset_ms = c->win_offset[best];
+        c->ref_ms = c->win_at[best];
+        c->rtt_ms = c->win_rtt[best];
+    }
+    if(!c->anchor_ms) {
+        c->anchor_ms = c->ref_ms;
+        c->anchor_offset_ms = c->offset_ms;
+    } else if(c->ref_ms - c->anchor_ms >= ALLES_SYNC_DRIFT_MIN_MS) {
+        // Each offset is only good to a few ms, so measure the slope over as long a stretch as we have
+        float drift = (c->offset_ms - c->anchor_offset_ms) / (float)(c->ref_ms - c->anchor_ms);
+        if(drift > ALLES_SYNC_MAX_DRIFT) drift = ALLES_SYNC_MAX_DRIFT;
+        if(drift < -ALLES_SYNC_MAX_DRIFT) drift = -ALLES_SYNC_MAX_DRIFT;
+        c->drift = drift;
+    }
+    alles_peers_unlock();
+}
+
+int32_t alles_sync_node_time(int16_t client, int32_t local_ms) {
+    int32_t node_ms = local_ms;
+    alles_peers_lock();
+    for(uint8_t i=0;i<alles_peer_count;i++) {
+        alles_peer_t *p = alles_peer_live(i);
+        if(p->client == client && p->sync.samples && p->wire >= ALLES_WIRE_NODE_TIME) {
+            node_ms = local_ms + (int32_t)(p->sync.offset_ms + p->sync.drift * (float)(local_ms - p->sync.ref_ms));
+            break;
+        }
+    }
+    alles_peers_unlock();
+    return node_ms;
+}
+
+uint32_t alles_sync_latency_ms() {
+    float latency = ALLES_SYNC_MIN_LATENCY_MS;
+    uint8_t synced = 1;
+    alles_peers_lock();
+    if(!alles_peer_count) synced = 0;
+    for(uint8_t i=0;i<alles_peer_count;i++) {
+        alles_clock_t *c = &alles_peer_live(i)->sync;
+        if(c->samples < ALLES_SYNC_MIN_SAMPLES) { synced = 0; break; }
+        // Half the round trip is the offset's error bound, plus room for the trip itself to wobble
+        float need = c->rtt_ms * 0.5f + c->jitter_ms * 4.0f + ALLES_SYNC_MARGIN_MS;
+        if(need > latency) latency = need;
+    }
+    alles_peers_unlock();
+    if(!synced) return 0;
+    if(latency > ALLES_SYNC_MAX_LATENCY_MS) latency = ALLES_SYNC_MAX_LATENCY_MS;
+    return (uint32_t)latency;
+}
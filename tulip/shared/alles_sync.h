@@ -0,0 +1,46 @@
+// alles_sync.h
+// Per-node clock offset and drift, estimated from sync request / response round trips
+#ifndef ALLES_SYNC_H
+#define ALLES_SYNC_H
+
+#include "polyfills.h"
+
+// Sync indexes go out as 'i', which receivers keep in an int8
+#define ALLES_SYNC_REQUESTS 128
+// Like NTP's clock filter, the offset comes from the lowest round trip of the last few samples
+#define ALLES_SYNC_WINDOW 8
+#define ALLES_SYNC_MIN_SAMPLES 4
+// Drift is measured once filtered offsets span this long, and crystals are never worse than this
+#define ALLES_SYNC_DRIFT_MIN_MS 30000
+#define ALLES_SYNC_MAX_DRIFT 0.0005f
+#define ALLES_SYNC_MARGIN_MS 20
+#define ALLES_SYNC_MIN_LATENCY_MS 50
+#define ALLES_SYNC_MAX_LATENCY_MS 1000
+
+typedef struct {
+    float offset_ms;    // node clock - our clock, measured at ref_ms
+    float drift;        // change in offset per ms of our clock, 0 until we've watched for a while
+    int32_t ref_ms;
+    float rtt_ms;       // round trip of the sample offset_ms came from
+    float jitter_ms;    // smoothed spread of round trips above the best one
+    int16_t client;
+    int32_t anchor_ms;  // the first filtered offset, where drift is measured from
+    float anchor_offset_ms;
+    uint16_t samples;
+    float win_offset[ALLES_SYNC_WINDOW];
+    float win_rtt[ALLES_SYNC_WINDOW];
+    int32_t win_at[ALLES_SYNC_WINDOW];
+    uint8_t win_pos;
+} alles_clock_t;
+
+void alles_sync_init();
+// Multicasts a sync request stamped with our clock. Every node answers with its own.
+void alles_sync_request();
+// Call after alles_peers_seen, so the node is in the peer table
+void alles_sync_response(uint8_t ipv4, int32_t node_time, int8_t index);
+// Our sysclock time converted to that node's clock. Returns local_ms unchanged if we know nothing yet.
+int32_t alles_sync_node_time(int16_t client, int32_t local_ms);
+// Smallest safe scheduling latency for every synced live node, or 0 if any of them isn't synced yet
+uint32_t alles_sync_latency_ms();
+
+#endif
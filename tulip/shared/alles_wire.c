@@ -0,0 +1,182 @@
+// alles_wire.c
+// ASCII AMY messages are a letter followed by a value, over and over. On the wire we keep the letters
+// but send integers as varints and decimals as float32, and pack many events per datagram.
+// Receivers turn events back into ASCII for amy_parse_message, since AMY owns the letter -> field mapping.
+
+#include "alles_wire.h"
+#include "alles_reliable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+static int8_t letter_index(char c) {
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    return -1;
+}
+
+static char index_letter(uint8_t i) {
+    return i < 26 ? 'A' + i : 'a' + (i - 26);
+}
+
+static uint16_t put_varint(uint8_t *out, uint16_t pos, uint16_t cap, uint32_t v) {
+    do {
+        if(pos >= cap) return 0;
+        uint8_t b = v & 0x7F;
+        v >>= 7;
+        out[pos++] = b | (v ? 0x80 : 0);
+    } while(v);
+    return pos;
+}
+
+static uint16_t get_varint(const uint8_t *in, uint16_t pos, uint16_t len, uint32_t *v) {
+    *v = 0;
+    for(uint8_t shift=0; shift<35; shift+=7) {
+        if(pos >= len) return 0;
+        uint8_t b = in[pos++];
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)) return pos;
+    }
+    return 0;
+}
+
+// 1 for a plain integer that fits in 32 bits, 2 for a decimal, 0 for anything else (lists, names)
+static uint8_t value_kind(const char *v, uint16_t n) {
+    uint16_t i = 0, digits = 0, dots = 0;
+    if(n && v[0] == '-') i++;
+    for(; i<n; i++) {
+        if(v[i] >= '0' && v[i] <= '9') digits++;
+        else if(v[i] == '.') dots++;
+        else return 0;
+    }
+    if(!digits || dots > 1) return 0;
+    if(dots) return 2;
+    return digits <= 9 ? 1 : 0;
+}
+
+uint16_t alles_wire_encode(const char *message, uint16_t len, uint8_t *out, uint16_t out_len, uint16_t cap) {
+    uint16_t pos = out_len;
+    if(pos == 0) {
+        if(cap < 1) return 0;
+        out[pos++] = ALLES_WIRE_MAGIC | ALLES_WIRE_FORMAT;
+    }
+    uint16_t c = 0;
+    char value[32];
+    while(c < len) {
+        int8_t letter = letter_index(message[c]);
+        if(letter < 0) return 0;
+        uint16_t start = ++c;
+        while(c < len && letter_index(message[c]) < 0) c++;
+        uint16_t n = c - start;
+        uint8_t kind = value_kind(message + start, n);
+        if(pos >= cap) return 0;
+        if(kind == 1) {
+            long v = strtol(message + start, NULL, 10);
+            out[pos++] = ((v < 0 ? ALLES_WIRE_NINT : ALLES_WIRE_UINT) << 6) | letter;
+            pos = put_varint(out, pos, cap, (uint32_t)(v < 0 ? -v : v));
+        } else if(kind == 2 && n < sizeof(value)) {
+            memcpy(value, message + start, n);
+            value[n] = 0;
+            float f = strtof(value, NULL);
+            if(pos + 5 > cap) return 0;
+            out[pos++] = (ALLES_WIRE_FLOAT << 6) | letter;
+            uint32_t bits;
+            memcpy(&bits, &f, 4);
+            for(uint8_t i=0;i<4;i++) out[pos++] = (bits >> (8*i)) & 0xFF;
+        } else {
+            out[pos++] = (ALLES_WIRE_STRING << 6) | letter;
+            pos = put_varint(out, pos, cap, n);
+            if(!pos || pos + n > cap) return 0;
+            memcpy(out + pos, message + start, n);
+            pos += n;
+        }
+        if(!pos) return 0;
+    }
+    if(pos >= cap) return 0;
+    out[pos++] = ALLES_WIRE_END_EVENT;
+    return pos;
+}
+
+// Decodes one event starting at *pos into ASCII. Returns the ASCII length, or -1 on a malformed event.
+static int16_t decode_event(const uint8_t *in, uint16_t len, uint16_t *pos, char *message, uint16_t cap) {
+    uint16_t p = *pos;
+    uint16_t m = 0;
+    while(p < len) {
+        uint8_t tag = in[p++];
+        if(tag == ALLES_WIRE_END_EVENT) {
+            *pos = p;
+            message[m] = 0;
+            return m;
+        }
+        uint8_t type = tag >> 6;
+        uint8_t letter = tag & 0x3F;
+        if(letter > 51 || m + 2 >= cap) return -1;
+        message[m++] = index_letter(letter);
+        uint32_t v;
+        int n = 0;
+        if(type == ALLES_WIRE_UINT || type == ALLES_WIRE_NINT) {
+            p = get_varint(in, p, len, &v);
+            if(!p) return -1;
+            n = snprintf(message + m, cap - m, type == ALLES_WIRE_NINT ? "-%" PRIu32 : "%" PRIu32, v);
+        } else if(type == ALLES_WIRE_FLOAT) {
+            if(p + 4 > len) return -1;
+            uint32_t bits = 0;
+            for(uint8_t i=0;i<4;i++) bits |= (uint32_t)in[p++] << (8*i);
+            float f;
+            memcpy(&f, &bits, 4);
+            // Fixed point only, as the 'e' of an exponent would read as the next field. Fewest places
+            // that read back as the same float; 60 is enough for any finite one, down to the denormals.
+            if(!isfinite(f)) return -1;
+            for(uint8_t places=0; places<=60; places++) {
+                n = snprintf(message + m, cap - m, "%.*f", places, (double)f);
+                if(n < 0 || m + n >= cap) return -1;
+                if(strtof(message + m, NULL) == f) break;
+            }
+            if(memchr(message + m, '.', n)) {
+                while(message[m + n - 1] == '0') n--;
+                if(message[m + n - 1] == '.') n--;
+            }
+        } else {
+            p = get_varint(in, p, len, &v);
+            if(!p || p + v > len || m + v >= cap) return -1;
+            memcpy(message + m, in + p, v);
+            p += v;
+            n = v;
+        }
+        if(n < 0 || m + n >= cap) return -1;
+        m += n;
+    }
+    return -1;
+}
+
+// Sized for one decoded event, which started life as an ASCII message of at most MAX_RECEIVE_LEN
+static char wire_message[512];
+
+void alles_wire_split(char *data, uint16_t len, void (*handle)(char *message, uint16_t length)) {
+    if(len && ((uint8_t)data[0] & 0xF0) == ALLES_RELIABLE_MAGIC) {
+        alles_reliable_receive(data, len, handle);
+        return;
+    }
+    if(len && ((uint8_t)data[0] & 0xF0) == ALLES_WIRE_MAGIC) {
+        // A newer format than ours could mean anything, so drop it
+        if(((uint8_t)data[0] & 0x0F) > ALLES_WIRE_FORMAT) return;
+        uint16_t pos = 1;
+        while(pos < len) {
+            int16_t n = decode_event((const uint8_t *)data, len, &pos, wire_message, sizeof(wire_message));
+            if(n < 0) return;
+            handle(wire_message, n);
+        }
+        return;
+    }
+    uint16_t start = 0;
+    // Break the packet up into messages (delimited by Z.)
+    for(uint16_t i=0;i<len;i++) {
+        if(data[i] == 'Z') {
+            data[i] = 0;
+            handle(data + start, i - start);
+            start = i+1;
+        }
+    }
+}
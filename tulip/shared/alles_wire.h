@@ -0,0 +1,43 @@
+// alles_wire.h
+// Compact binary encoding for Alles mesh traffic, used only when every live node says it understands it
+#ifndef ALLES_WIRE_H
+#define ALLES_WIRE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+
+// What a node can take, as advertised in its sync responses: 1 adds binary events, 2 adds reliable frames
+#define ALLES_WIRE_VERSION 2
+#define ALLES_WIRE_BINARY 1
+#define ALLES_WIRE_RELIABLE 2
+// Nodes that advertise any wire version take event times on their own clock. Older ones apply their
+// computed_delta to the sender's time themselves, so converting for them would correct twice.
+#define ALLES_WIRE_NODE_TIME 1
+
+// A node's sync response: its clock, the sync index, its ipv4 quartet, client id and ALLES_WIRE_VERSION.
+// Tulip never answers syncs itself, and Alles firmware that leaves out the w field counts as version 0,
+// so binary and reliable frames only get used once the node firmware sends this (or under alles_sim).
+#define ALLES_SYNC_RESPONSE_FMT "_U%" PRIi32 "i%dr%dg%dw%dZ"
+
+// First byte of a binary datagram, with the format version in the low nibble.
+// ASCII AMY messages never have the high bit set.
+#define ALLES_WIRE_MAGIC 0xF0
+#define ALLES_WIRE_FORMAT 1
+// Nodes that advertise a wire version accept datagrams up to this size
+#define ALLES_WIRE_MAX_LEN 1024
+
+// A field is a tag byte, (type << 6) | letter index (A-Z = 0-25, a-z = 26-51), then its value
+#define ALLES_WIRE_UINT 0   // varint
+#define ALLES_WIRE_NINT 1   // varint of the negated value
+#define ALLES_WIRE_FLOAT 2  // 4 bytes, little endian float32
+#define ALLES_WIRE_STRING 3 // varint length, then the bytes
+#define ALLES_WIRE_END_EVENT 0xFF
+
+// Appends one ASCII message (no 'Z') to a binary datagram. Returns the new datagram length, or 0 if it
+// doesn't fit or can't be encoded, in which case out is left as it was.
+uint16_t alles_wire_encode(const char *message, uint16_t len, uint8_t *out, uint16_t out_len, uint16_t cap);
+
+// Calls handle on every message in a received datagram, ASCII, binary or reliable. ASCII is split in place.
+void alles_wire_split(char *data, uint16_t len, void (*handle)(char *message, uint16_t length));
+
+#endif
@@ -0,0 +1,265 @@
+// async_load.c
+// A worker (a thread on desktop, a low priority task on the S3's MicroPython core) decodes into a
+// staging buffer from malloc_caps, then schedules async_load_deliver, which makes the Python result
+// on the MicroPython thread and calls back. The worker never touches MicroPython objects. Files on the
+// desktop host filesystem are read by the worker too; anything else goes through the VFS, which only
+// the MicroPython thread can use, so that is read up front. Web has no threads and does it all in line,
+// calling back straight away if the scheduler queue is full.
+
+#include "async_load.h"
+#include "tulip_helpers.h"
+#include "polyfills.h"
+#include "display.h"
+#include "lodepng.h"
+
+MP_REGISTER_ROOT_POINTER(mp_obj_t async_load_callbacks[8]);
+
+#if defined ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "tasks.h"
+static portMUX_TYPE async_load_mux = portMUX_INITIALIZER_UNLOCKED;
+#define ASYNC_LOCK() portENTER_CRITICAL_SAFE(&async_load_mux)
+#define ASYNC_UNLOCK() portEXIT_CRITICAL_SAFE(&async_load_mux)
+TaskHandle_t async_load_handle = NULL;
+#elif defined __EMSCRIPTEN__
+#define ASYNC_LOCK()
+#define ASYNC_UNLOCK()
+#else
+#include <pthread.h>
+static pthread_mutex_t async_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_load_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t async_load_started = 0;
+#define ASYNC_LOCK() pthread_mutex_lock(&async_load_mutex)
+#define ASYNC_UNLOCK() pthread_mutex_unlock(&async_load_mutex)
+#endif
+
+#define ASYNC_LOAD_FREE 0
+#define ASYNC_LOAD_QUEUED 1
+#define ASYNC_LOAD_WORKING 2
+#define ASYNC_LOAD_DONE 3
+
+typedef struct {
+    uint8_t state;
+    uint8_t kind;
+    uint8_t ok;
+    char path[ASYNC_LOAD_PATH_LEN]; // set if the worker reads the file itself
+    uint8_t *data;                  // the file, then what it decoded to
+    uint32_t len;
+    uint32_t a;                     // png width or wav rate
+    uint32_t b;                     // png height or wav channels
+} async_load_job_t;
+
+static async_load_job_t async_load_jobs[ASYNC_LOAD_SLOTS];
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+// RGBA to palette indexes, with see-through pixels as ALPHA like sprite_png
+static uint8_t decode_png(async_load_job_t *job) {
+    unsigned char *image;
+    unsigned w, h;
+    if(lodepng_decode_memory(&image, &w, &h, job->data, job->len, LCT_RGBA, 8)) return 0;
+    uint8_t *bitmap = (uint8_t*)malloc_caps_tag(w * h, MALLOC_CAP_SPIRAM, MEM_TAG_PNG);
+    if(bitmap == NULL) {
+        free_caps(image);
+        return 0;
+    }
+    for(uint32_t i=0;i<w*h;i++) {
+        uint8_t *px = image + i*4;
+        bitmap[i] = px[3] ? color_332(px[0], px[1], px[2]) : ALPHA;
+    }
+    free_caps(image);
+    free_caps(job->data);
+    job->data = bitmap;
+    job->len = w * h;
+    job->a = w;
+    job->b = h;
+    return 1;
+}
+
+// Finds the fmt and data chunks of a RIFF WAVE file and keeps just the samples
+static uint8_t decode_wav(async_load_job_t *job) {
+    const uint8_t *d = job->data;
+    if(job->len < 12 || memcmp(d, "RIFF", 4) || memcmp(d + 8, "WAVE", 4)) return 0;
+    uint32_t pos = 12;
+    uint8_t have_fmt = 0;
+    while(pos + 8 <= job->len) {
+        uint32_t size = le32(d + pos + 4);
+        const uint8_t *chunk = d + pos + 8;
+        if(size > job->len - pos - 8) size = job->len - pos - 8;
+        if(!memcmp(d + pos, "fmt ", 4) && size >= 16) {
+            // Plain 16 bit PCM only
+            if(le16(chunk) != 1 || le16(chunk + 14) != 16) return 0;
+            job->b = le16(chunk + 2);
+            job->a = le32(chunk + 4);
+            have_fmt = 1;
+        } else if(!memcmp(d + pos, "data", 4) && have_fmt) {
+            memmove(job->data, chunk, size);
+            job->len = size;
+            return 1;
+        }
+        pos += 8 + size + (size & 1);
+    }
+    return 0;
+}
+
+static void async_load_work(async_load_job_t *job) {
+    #ifdef TULIP_DESKTOP
+    if(job->path[0] && host_read_alloc(job->path, &job->data, &job->len, MALLOC_CAP_SPIRAM) != 0) {
+        job->ok = 0;
+        return;
+    }
+    #endif
+    if(job->kind == ASYNC_LOAD_PNG) {
+        job->ok = decode_png(job);
+    } else if(job->kind == ASYNC_LOAD_WAV) {
+        job->ok = decode_wav(job);
+    } else {
+        job->ok = 1;
+    }
+}
+
+STATIC mp_obj_t async_load_deliver(mp_obj_t slot_in) {
+    uint8_t slot = mp_obj_get_int(slot_in);
+    async_load_job_t *job = &async_load_jobs[slot];
+    mp_obj_t result = mp_const_none;
+    nlr_buf_t nlr;
+    // Out of heap for the result counts as failing, so the slot is still freed
+    if(job->ok && nlr_push(&nlr) == 0) {
+        mp_obj_t bytes = mp_obj_new_bytes(job->data, job->len);
+        if(job->kind == ASYNC_LOAD_BYTES) {
+            result = bytes;
+        } else {
+            mp_obj_t tuple[3] = { mp_obj_new_int(job->a), mp_obj_new_int(job->b), bytes };
+            result = mp_obj_new_tuple(3, tuple);
+        }
+        nlr_pop();
+    }
+    if(job->data) free_caps(job->data);
+    job->data = NULL;
+    mp_obj_t callback = MP_STATE_VM(async_load_callbacks)[slot];
+    MP_STATE_VM(async_load_callbacks)[slot] = MP_OBJ_NULL;
+    ASYNC_LOCK();
+    job->state = ASYNC_LOAD_FREE;
+    ASYNC_UNLOCK();
+    mp_call_function_1(callback, result);
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(async_load_deliver_obj, async_load_deliver);
+
+// Works through everything queued, handing each one back as it's done
+static void async_load_run() {
+    for(uint8_t i=0;i<ASYNC_LOAD_SLOTS;i++) {
+        async_load_job_t *job = &async_load_jobs[i];
+        ASYNC_LOCK();
+        uint8_t mine = (job->state == ASYNC_LOAD_QUEUED);
+        if(mine) job->state = ASYNC_LOAD_WORKING;
+        ASYNC_UNLOCK();
+        if(!mine) continue;
+        async_load_work(job);
+        ASYNC_LOCK();
+        job->state = ASYNC_LOAD_DONE;
+        ASYNC_UNLOCK();
+        #ifdef __EMSCRIPTEN__
+        // We're on the MicroPython thread here, so nothing would drain a full scheduler queue. Hand it
+        // back now instead, before async_load_start returns.
+        if(!mp_sched_schedule(MP_OBJ_FROM_PTR(&async_load_deliver_obj), MP_OBJ_NEW_SMALL_INT(i))) {
+            async_load_deliver(MP_OBJ_NEW_SMALL_INT(i));
+        }
+        #else
+        // The scheduler queue can be full for a moment, so keep trying
+        while(!mp_sched_schedule(MP_OBJ_FROM_PTR(&async_load_deliver_obj), MP_OBJ_NEW_SMALL_INT(i))) delay_ms(5);
+        #endif
+    }
+}
+
+#if defined ESP_PLATFORM
+static void async_load_task(void *arg) {
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        async_load_run();
+    }
+}
+#elif !defined __EMSCRIPTEN__
+static void *async_load_thread(void *arg) {
+    ASYNC_LOCK();
+    while(1) {
+        uint8_t queued = 0;
+        for(uint8_t i=0;i<ASYNC_LOAD_SLOTS;i++) if(async_load_jobs[i].state == ASYNC_LOAD_QUEUED) queued = 1;
+        if(!queued) {
+            pthread_cond_wait(&async_load_cond, &async_load_mutex);
+            continue;
+        }
+        ASYNC_UNLOCK();
+        async_load_run();
+        ASYNC_LOCK();
+    }
+    return NULL;
+}
+#endif
+
+// Starts the worker the first time, and tells it there's something to do
+static void async_load_wake() {
+    #if defined ESP_PLATFORM
+    if(async_load_handle == NULL) {
+        xTaskCreatePinnedToCore(async_load_task, ASYNC_LOAD_TASK_NAME, ASYNC_LOAD_TASK_STACK_SIZE / sizeof(StackType_t), NULL, ASYNC_LOAD_TASK_PRIORITY, &async_load_handle, ASYNC_LOAD_TASK_COREID);
+    }
+    xTaskNotifyGive(async_load_handle);
+    #elif defined __EMSCRIPTEN__
+    async_load_run();
+    #else
+    ASYNC_LOCK();
+    if(!async_load_started) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, async_load_thread, NULL);
+        pthread_detach(thread);
+        async_load_started = 1;
+    }
+    pthread_cond_signal(&async_load_cond);
+    ASYNC_UNLOCK();
+    #endif
+}
+
+uint8_t async_load_start(const char *path, uint8_t kind, mp_obj_t callback) {
+    uint8_t *data = NULL;
+    uint32_t len = 0;
+    uint8_t worker_reads = 0;
+    #ifdef TULIP_DESKTOP
+    worker_reads = file_on_host(path) && strlen(path) < ASYNC_LOAD_PATH_LEN;
+    #endif
+    if(!worker_reads) {
+        // Raises if it isn't there
+        data = read_file_alloc(path, &len, MALLOC_CAP_SPIRAM);
+        if(data == NULL) mp_raise_OSError(MP_ENOMEM);
+    }
+    uint8_t slot;
+    ASYNC_LOCK();
+    for(slot=0;slot<ASYNC_LOAD_SLOTS;slot++) if(async_load_jobs[slot].state == ASYNC_LOAD_FREE) break;
+    // Held by us until it's queued
+    if(slot < ASYNC_LOAD_SLOTS) async_load_jobs[slot].state = ASYNC_LOAD_WORKING;
+    ASYNC_UNLOCK();
+    if(slot == ASYNC_LOAD_SLOTS) {
+        if(data) free_caps(data);
+        return 0;
+    }
+    async_load_job_t *job = &async_load_jobs[slot];
+    job->kind = kind;
+    job->ok = 0;
+    job->data = data;
+    job->len = len;
+    job->path[0] = 0;
+    if(worker_reads) strcpy(job->path, path);
+    MP_STATE_VM(async_load_callbacks)[slot] = callback;
+    ASYNC_LOCK();
+    job->state = ASYNC_LOAD_QUEUED;
+    ASYNC_UNLOCK();
+    async_load_wake();
+    return 1;
+}
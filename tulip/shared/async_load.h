@@ -0,0 +1,19 @@
+// async_load.h
+// Reads and decodes files off the MicroPython thread, then schedules a Python callback with the result
+#ifndef ASYNC_LOAD_H
+#define ASYNC_LOAD_H
+
+#include "py/runtime.h"
+
+// Loads in flight at once. The callbacks root pointer in async_load.c has to match
+#define ASYNC_LOAD_SLOTS 8
+#define ASYNC_LOAD_PATH_LEN 256
+
+#define ASYNC_LOAD_BYTES 0 // the file as bytes
+#define ASYNC_LOAD_PNG 1   // (w, h, bitmap) of palette indexes, ready for sprite_bitmap or bg_bitmap
+#define ASYNC_LOAD_WAV 2   // (rate, channels, bytes) of 16 bit PCM
+
+// Starts loading path. Returns 0 if every slot is busy. callback gets None if it fails.
+uint8_t async_load_start(const char *path, uint8_t kind, mp_obj_t callback);
+
+#endif
@@ -0,0 +1,67 @@
+// audio_stats.c
+// Render-time accounting for the AMY audio path. Written from the audio tasks / threads, read from Python.
+// Nothing here locks: a reader can see a block half-accounted, which is fine for stats.
+
+#include "audio_stats.h"
+
+audio_stats_t audio_stats;
+
+void audio_stats_init(uint8_t ncores) {
+    if(ncores > AUDIO_STATS_MAX_CORES) ncores = AUDIO_STATS_MAX_CORES;
+    audio_stats.ncores = ncores;
+    audio_stats.budget_us = (uint32_t)(((uint64_t)AMY_BLOCK_SIZE * 1000000) / AMY_SAMPLE_RATE);
+    audio_stats_reset();
+}
+
+static void core_reset(audio_stats_core_t *c) {
+    c->busy_us = 0;
+    c->blocks = 0;
+    c->last_us = 0;
+    c->max_us = 0;
+    for(uint8_t i=0;i<AUDIO_STATS_HIST_BUCKETS;i++) c->hist[i] = 0;
+}
+
+void audio_stats_reset() {
+    core_reset(&audio_stats.block);
+    for(uint8_t i=0;i<AUDIO_STATS_MAX_CORES;i++) core_reset(&audio_stats.cores[i]);
+    audio_stats.underruns = 0;
+    audio_stats.overruns = 0;
+    audio_stats.max_voices = 0;
+    audio_stats.since_us = get_time_us();
+}
+
+static uint32_t core_stop(audio_stats_core_t *c) {
+    uint32_t took = (uint32_t)(get_time_us() - c->start_us);
+    c->last_us = took;
+    c->busy_us += took;
+    c->blocks++;
+    if(took > c->max_us) c->max_us = took;
+    uint32_t bucket = (took * (AUDIO_STATS_HIST_BUCKETS - 1)) / audio_stats.budget_us;
+    if(bucket >= AUDIO_STATS_HIST_BUCKETS) bucket = AUDIO_STATS_HIST_BUCKETS - 1;
+    c->hist[bucket]++;
+    return took;
+}
+
+void audio_stats_block_start() {
+    audio_stats.block.start_us = get_time_us();
+    __atomic_store_n(&audio_stats.block_voices, 0, __ATOMIC_RELAXED);
+}
+
+void audio_stats_block_stop() {
+    if(core_stop(&audio_stats.block) > audio_stats.budget_us) audio_stats.overruns++;
+    uint16_t voices = __atomic_load_n(&audio_stats.block_voices, __ATOMIC_RELAXED);
+    audio_stats.voices = voices;
+    if(voices > audio_stats.max_voices) audio_stats.max_voices = voices;
+}
+
+void audio_stats_render_start(uint8_t core) {
+    if(core < AUDIO_STATS_MAX_CORES) audio_stats.cores[core].start_us = get_time_us();
+}
+
+void audio_stats_render_stop(uint8_t core) {
+    if(core < AUDIO_STATS_MAX_CORES) core_stop(&audio_stats.cores[core]);
+}
+
+void audio_stats_underrun() {
+    audio_stats.underruns++;
+}
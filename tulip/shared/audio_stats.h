@@ -0,0 +1,48 @@
+// audio_stats.h
+// Render-time accounting for the AMY audio path, read from Python with tulip.audio_stats()
+#ifndef AUDIO_STATS_H
+#define AUDIO_STATS_H
+
+#include "polyfills.h"
+
+#define AUDIO_STATS_MAX_CORES 8
+// Histogram buckets are 10% of the block budget each. The last bucket is everything at or over budget.
+#define AUDIO_STATS_HIST_BUCKETS 11
+
+typedef struct {
+    uint64_t busy_us;       // total time spent rendering on this core
+    uint32_t blocks;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint32_t hist[AUDIO_STATS_HIST_BUCKETS];
+    int64_t start_us;
+} audio_stats_core_t;
+
+typedef struct {
+    audio_stats_core_t block;   // whole block, prepare -> fill
+    audio_stats_core_t cores[AUDIO_STATS_MAX_CORES];
+    uint8_t ncores;
+    uint32_t budget_us;         // real time length of one AMY block
+    uint32_t underruns;         // the output device was starved
+    uint32_t overruns;          // a block took longer than budget_us to render
+    uint32_t block_voices;      // oscillators rendered so far in the current block, across cores
+    uint16_t voices;
+    uint16_t max_voices;
+    int64_t since_us;           // time of the last reset
+} audio_stats_t;
+
+extern audio_stats_t audio_stats;
+
+void audio_stats_init(uint8_t ncores);
+void audio_stats_reset();
+void audio_stats_block_start();
+void audio_stats_block_stop();
+void audio_stats_render_start(uint8_t core);
+void audio_stats_render_stop(uint8_t core);
+void audio_stats_underrun();
+// Call from amy_external_render_hook, once per oscillator rendered. Cores render at once, so this is atomic.
+static inline void audio_stats_voice() {
+    __atomic_add_fetch(&audio_stats.block_voices, 1, __ATOMIC_RELAXED);
+}
+
+#endif
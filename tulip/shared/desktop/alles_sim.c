@@ -0,0 +1,325 @@
+// alles_sim.c
+// A fake Alles mesh for Tulip Desktop. While it runs, Tulip's mesh socket is bound to loopback and sends to
+// the sim's socket instead of the multicast group, and a thread plays a handful of virtual nodes: each with
+// its own clock (offset and drift), each seeing every datagram after latency +/- jitter, or not at all.
+// Nodes answer pings, sync requests and reliable frames the way real ones do, back to Tulip's socket, so
+// Tulip's own send, receive and parse path is the one exercised. They keep score, so sync, coalescing, the
+// wire format and the reliable channel can all be checked without a room full of hardware.
+
+#include "alles.h"
+#include "alles_wire.h"
+#include "alles_peers.h"
+#include "alles_reliable.h"
+#include "alles_sim.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+extern uint8_t ipv4_quartet;
+
+uint8_t alles_sim_running = 0;
+alles_sim_config_t alles_sim_config = { .nodes = 0, .latency_ms = 5, .jitter_ms = 2, .loss = 0, .seed = 1 };
+
+typedef struct {
+    char * data;
+    uint16_t len;
+    uint8_t to;       // 0 for Tulip, else node index + 1
+    int32_t due;
+    int32_t sent_at;
+} sim_packet_t;
+
+typedef struct {
+    int32_t offset_ms;
+    float drift;      // ppm / 1e6
+    int16_t client;
+    int32_t next_ping;
+    // reliable receive state for the one sender (Tulip) they hear from
+    uint8_t rx_valid;
+    uint8_t rx_epoch;
+    uint16_t rx_expected;
+} sim_node_t;
+
+sim_node_t sim_nodes[ALLES_SIM_MAX_NODES];
+int32_t sim_start_ms;
+uint32_t sim_rand_state;
+
+// The lock covers the stats, node state, packets in flight and Tulip's address
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+sim_packet_t * sim_in_flight = NULL;
+sim_packet_t * sim_due = NULL;
+uint16_t sim_in_flight_count = 0;
+alles_sim_stats_t sim_stats;
+double sim_latency_total = 0;
+pthread_t sim_thread_id;
+volatile uint8_t sim_stopping = 0;
+
+// The nodes' side of the network, and where Tulip's socket is once it has attached
+int sim_sock = -1;
+struct sockaddr_in sim_addr;
+struct sockaddr_in sim_tulip_addr;
+uint8_t sim_tulip_known = 0;
+char sim_rx[ALLES_WIRE_MAX_LEN];
+
+// The node (and datagram) being handled, for the alles_wire_split callbacks
+uint8_t sim_current = 0;
+int32_t sim_current_sent_at = 0;
+
+// xorshift32, seeded so a run can be repeated
+static uint32_t sim_rand() {
+    uint32_t x = sim_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim_rand_state = x;
+    return x;
+}
+
+static float sim_rand_float() {
+    return (float)(sim_rand() >> 8) / (float)(1 << 24);
+}
+
+static int32_t node_clock(uint8_t node, int32_t now) {
+    sim_node_t *n = &sim_nodes[node];
+    return now + n->offset_ms + (int32_t)((float)(now - sim_start_ms) * n->drift);
+}
+
+// Sim thread only, with sim_lock held
+static void sim_queue(uint8_t to, char * data, uint16_t len, int32_t now, int32_t sent_at) {
+    sim_stats.sent++;
+    if(sim_rand_float() < alles_sim_config.loss || sim_in_flight_count == ALLES_SIM_MAX_IN_FLIGHT) {
+        sim_stats.dropped++;
+        return;
+    }
+    char * copy = malloc(len + 1);
+    if(copy == NULL) { sim_stats.dropped++; return; }
+    memcpy(copy, data, len);
+    copy[len] = 0;
+    int32_t delay = alles_sim_config.latency_ms;
+    if(alles_sim_config.jitter_ms) delay += (int32_t)(sim_rand() % (2 * alles_sim_config.jitter_ms + 1)) - alles_sim_config.jitter_ms;
+    if(delay < 0) delay = 0;
+    sim_packet_t *p = &sim_in_flight[sim_in_flight_count++];
+    p->data = copy;
+    p->len = len;
+    p->to = to;
+    p->due = now + delay;
+    p->sent_at = sent_at;
+}
+
+static void node_reply(uint8_t node, char * message, uint16_t len, int32_t now) {
+    sim_queue(0, message, len, now, now);
+}
+
+static void node_ping(uint8_t node, int8_t index, int32_t now) {
+    char message[64];
+    uint16_t len = snprintf(message, sizeof(message), ALLES_SYNC_RESPONSE_FMT, node_clock(node, now), index,
+        node + ALLES_SIM_TULIP_IPV4 + 1, sim_nodes[node].client, ALLES_WIRE_VERSION);
+    node_reply(node, message, len, now);
+}
+
+// One message from Tulip, as a node sees it
+static void node_message(char * message, uint16_t length) {
+    int32_t now = amy_sysclock();
+    char * i = strchr(message, 'i');
+    if(message[0] == 'U' && i != NULL) {
+        node_ping(sim_current, atoi(i + 1), now);
+        return;
+    }
+    float latency = (float)(now - sim_current_sent_at);
+    sim_stats.events++;
+    sim_latency_total += latency;
+    if(latency > sim_stats.max_latency_ms) sim_stats.max_latency_ms = latency;
+}
+
+static void node_receive(uint8_t node, char * data, uint16_t len, int32_t now) {
+    sim_current = node;
+    if(len && ((uint8_t)data[0] & 0xF0) == ALLES_RELIABLE_MAGIC) {
+        if(len < ALLES_RELIABLE_HEADER || (uint8_t)data[0] != ALLES_RELIABLE_DATA) return;
+        sim_node_t *n = &sim_nodes[node];
+        uint8_t epoch = data[2];
+        uint16_t seq = (uint8_t)data[3] | ((uint8_t)data[4] << 8);
+        if(!n->rx_valid || n->rx_epoch != epoch) {
+            n->rx_valid = 1;
+            n->rx_epoch = epoch;
+            n->rx_expected = seq;
+        }
+        if(seq == n->rx_expected) {
+            n->rx_expected++;
+            sim_stats.reliable++;
+            alles_wire_split(data + ALLES_RELIABLE_HEADER, len - ALLES_RELIABLE_HEADER, node_message);
+        } else if((int16_t)(seq - n->rx_expected) < 0) {
+            sim_stats.duplicates++;
+        }
+        char ack[ALLES_RELIABLE_HEADER + 1];
+        uint16_t acked = n->rx_expected - 1;
+        ack[0] = ALLES_RELIABLE_ACK;
+        ack[1] = node + ALLES_SIM_TULIP_IPV4 + 1;
+        ack[2] = epoch;
+        ack[3] = acked & 0xFF;
+        ack[4] = acked >> 8;
+        ack[5] = data[1];
+        node_reply(node, ack, sizeof(ack), now);
+        return;
+    }
+    alles_wire_split(data, len, node_message);
+}
+
+void * alles_sim_task(void *vargp) {
+    struct pollfd pfd = { .fd = sim_sock, .events = POLLIN };
+    while(!sim_stopping) {
+        // Wakes for Tulip's datagrams, or every ms to deliver what's due
+        poll(&pfd, 1, 1);
+        int32_t now = amy_sysclock();
+        uint16_t due = 0;
+        pthread_mutex_lock(&sim_lock);
+        // Multicast: every node gets its own copy, with its own luck
+        ssize_t len;
+        while((len = recv(sim_sock, sim_rx, sizeof(sim_rx), MSG_DONTWAIT)) > 0) {
+            for(uint8_t n=0;n<alles_sim_config.nodes;n++) sim_queue(n + 1, sim_rx, len, now, now);
+        }
+
+        for(uint8_t n=0;n<alles_sim_config.nodes;n++) {
+            if(now >= sim_nodes[n].next_ping) {
+                node_ping(n, -1, now);
+                sim_nodes[n].next_ping = now + PING_TIME_MS;
+            }
+        }
+
+        // Pull out what has arrived, keeping order so zero jitter means no reordering
+        uint16_t kept = 0;
+        for(uint16_t i=0;i<sim_in_flight_count;i++) {
+            // Replies wait until Tulip's socket is there to take them
+            if(now >= sim_in_flight[i].due && (sim_in_flight[i].to || sim_tulip_known)) sim_due[due++] = sim_in_flight[i];
+            else sim_in_flight[kept++] = sim_in_flight[i];
+        }
+        sim_in_flight_count = kept;
+        sim_stats.delivered += due;
+
+        for(uint16_t i=0;i<due;i++) {
+            sim_packet_t *p = &sim_due[i];
+            sim_current_sent_at = p->sent_at;
+            if(p->to == 0) {
+                // Through Tulip's socket, to be read and parsed by its listen task like any node's
+                sendto(sim_sock, p->data, p->len, 0, (struct sockaddr *)&sim_tulip_addr, sizeof(sim_tulip_addr));
+            } else {
+                node_receive(p->to - 1, p->data, p->len, now);
+            }
+            free(p->data);
+        }
+        pthread_mutex_unlock(&sim_lock);
+    }
+    return NULL;
+}
+
+uint8_t alles_sim_start() {
+    sim_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    memset(&sim_addr, 0, sizeof(sim_addr));
+    sim_addr.sin_family = AF_INET;
+    sim_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(sim_addr);
+    if(sim_sock < 0 || bind(sim_sock, (struct sockaddr *)&sim_addr, sizeof(sim_addr)) < 0 ||
+        getsockname(sim_sock, (struct sockaddr *)&sim_addr, &addr_len) < 0) {
+        fprintf(stderr, "[alles] can't make the simulated network's socket\n");
+        if(sim_sock >= 0) close(sim_sock);
+        sim_sock = -1;
+        alles_sim_config.nodes = 0;
+        return 0;
+    }
+    if(alles_sim_config.nodes > ALLES_SIM_MAX_NODES) alles_sim_config.nodes = ALLES_SIM_MAX_NODES;
+    sim_rand_state = alles_sim_config.seed ? alles_sim_config.seed : 1;
+    sim_start_ms = amy_sysclock();
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    sim_latency_total = 0;
+    for(uint8_t n=0;n<alles_sim_config.nodes;n++) {
+        sim_node_t *node = &sim_nodes[n];
+        memset(node, 0, sizeof(sim_node_t));
+        node->offset_ms = (int32_t)(sim_rand() % (2 * ALLES_SIM_MAX_OFFSET_MS + 1)) - ALLES_SIM_MAX_OFFSET_MS;
+        node->drift = (sim_rand_float() * 2.0f - 1.0f) * ALLES_SIM_MAX_DRIFT_PPM * 1e-6f;
+        // Nodes announce themselves as they come up
+        node->next_ping = sim_start_ms;
+    }
+    // Client numbers go by uptime, and a node further ahead has been up longer
+    for(uint8_t n=0;n<alles_sim_config.nodes;n++) {
+        for(uint8_t m=0;m<alles_sim_config.nodes;m++) {
+            if(sim_nodes[m].offset_ms > sim_nodes[n].offset_ms || (sim_nodes[m].offset_ms == sim_nodes[n].offset_ms && m < n)) {
+                sim_nodes[n].client++;
+            }
+        }
+    }
+    sim_in_flight = malloc(sizeof(sim_packet_t) * ALLES_SIM_MAX_IN_FLIGHT);
+    sim_due = malloc(sizeof(sim_packet_t) * ALLES_SIM_MAX_IN_FLIGHT);
+    sim_in_flight_count = 0;
+    sim_tulip_known = 0;
+    sim_stopping = 0;
+    ipv4_quartet = ALLES_SIM_TULIP_IPV4;
+    alles_sim_running = 1;
+    fprintf(stderr, "[alles] simulating %d nodes, %dms +/- %dms, %.1f%% loss\n", alles_sim_config.nodes,
+        alles_sim_config.latency_ms, alles_sim_config.jitter_ms, alles_sim_config.loss * 100.0f);
+    pthread_create(&sim_thread_id, NULL, alles_sim_task, NULL);
+    return 1;
+}
+
+void alles_sim_stop() {
+    if(!alles_sim_running) return;
+    sim_stopping = 1;
+    pthread_join(sim_thread_id, NULL);
+    close(sim_sock);
+    sim_sock = -1;
+    for(uint16_t i=0;i<sim_in_flight_count;i++) free(sim_in_flight[i].data);
+    sim_in_flight_count = 0;
+    free(sim_in_flight);
+    free(sim_due);
+    sim_in_flight = sim_due = NULL;
+    sim_tulip_known = 0;
+    alles_sim_running = 0;
+    // The next mesh start is a real one unless alles_sim is asked for again
+    alles_sim_config.nodes = 0;
+    fprintf(stderr, "[alles] simulation stopped\n");
+}
+
+int alles_sim_attach(int sock, struct sockaddr_in * dest) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+    if(getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0) return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_tulip_addr = addr;
+    sim_tulip_known = 1;
+    pthread_mutex_unlock(&sim_lock);
+    *dest = sim_addr;
+    ipv4_quartet = ALLES_SIM_TULIP_IPV4;
+    return 0;
+}
+
+void alles_sim_get_stats(alles_sim_stats_t * stats) {
+    pthread_mutex_lock(&sim_lock);
+    *stats = sim_stats;
+    stats->latency_ms = sim_stats.events ? (float)(sim_latency_total / sim_stats.events) : 0;
+    pthread_mutex_unlock(&sim_lock);
+    if(!alles_sim_running) return;
+    // How far off our estimate of each node's clock is, right now
+    int32_t now = amy_sysclock();
+    float total = 0;
+    alles_peers_lock();
+    for(uint8_t i=0;i<alles_peer_count;i++) {
+        alles_peer_t *p = alles_peer_live(i);
+        uint8_t node = p->ipv4 - ALLES_SIM_TULIP_IPV4 - 1;
+        if(p->sync.samples < ALLES_SYNC_MIN_SAMPLES || node >= alles_sim_config.nodes) continue;
+        float estimate = p->sync.offset_ms + p->sync.drift * (float)(now - p->sync.ref_ms);
+        float error = estimate - (float)(node_clock(node, now) - now);
+        if(error < 0) error = -error;
+        total += error;
+        if(error > stats->max_sync_error_ms) stats->max_sync_error_ms = error;
+        stats->synced++;
+    }
+    alles_peers_unlock();
+    stats->sync_error_ms = stats->synced ? total / stats->synced : 0;
+}
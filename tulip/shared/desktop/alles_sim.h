@@ -0,0 +1,52 @@
+// alles_sim.h
+// A simulated Alles mesh for Tulip Desktop: virtual nodes in this process, over a lossy, jittery fake network
+#ifndef ALLES_SIM_H
+#define ALLES_SIM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define ALLES_SIM_MAX_NODES 64
+#define ALLES_SIM_MAX_IN_FLIGHT 4096
+// Node clocks start up to this far from ours, and run up to this fast or slow
+#define ALLES_SIM_MAX_OFFSET_MS 10000
+#define ALLES_SIM_MAX_DRIFT_PPM 100
+// Tulip is 1 on the simulated network, nodes are 2 and up
+#define ALLES_SIM_TULIP_IPV4 1
+
+typedef struct {
+    uint8_t nodes;
+    uint16_t latency_ms;  // one way
+    uint16_t jitter_ms;   // +/- on top of latency
+    float loss;           // chance each datagram to each receiver is lost, 0-1
+    uint32_t seed;
+} alles_sim_config_t;
+
+typedef struct {
+    uint32_t sent;             // datagrams, counted once per receiver
+    uint32_t dropped;
+    uint32_t delivered;
+    uint32_t events;           // messages nodes received from Tulip
+    float latency_ms;          // mean delivery latency of those
+    float max_latency_ms;
+    uint32_t reliable;         // reliable messages nodes took, once each
+    uint32_t duplicates;       // reliable repeats nodes threw away
+    float sync_error_ms;       // mean |estimated - true| node clock over synced nodes
+    float max_sync_error_ms;
+    uint8_t synced;
+} alles_sim_stats_t;
+
+extern uint8_t alles_sim_running;
+extern alles_sim_config_t alles_sim_config;
+
+// Starts the virtual nodes on a loopback socket. Called from alles_init_multicast before the listen task
+// starts. Returns 0 if the socket can't be made.
+uint8_t alles_sim_start();
+// Stops the node thread and frees everything. Called from alles_stop_multicast once the listen task is done.
+void alles_sim_stop();
+// While the sim runs, Tulip's mesh socket calls this in place of joining the multicast group: it binds sock
+// to loopback and points dest at the nodes. Returns -1 on failure.
+int alles_sim_attach(int sock, struct sockaddr_in * dest);
+void alles_sim_get_stats(alles_sim_stats_t * stats);
+
+#endif
@@ -0,0 +1,95 @@
+// mmap_file.c
+// Read-only file mappings for Tulip Desktop. The pages come straight from the OS file cache, so big
+// images and samples don't get copied onto the heap. Unmapped by close() or when collected.
+
+#include "mmap_file.h"
+#include "tulip_helpers.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    mp_obj_base_t base;
+    uint8_t *data; // NULL for an empty file
+    size_t len;
+    uint8_t closed;
+} mmap_file_obj_t;
+
+mp_obj_t mmap_file_open(const char *filename) {
+    // mmap needs a real path, and the host filesystem is only at / of the VFS
+    if(!file_on_host(filename)) mp_raise_OSError(MP_ENOENT);
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) mp_raise_OSError(errno);
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        mp_raise_OSError(err);
+    }
+    uint8_t *data = NULL;
+    if(st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            mp_raise_OSError(err);
+        }
+    }
+    // The mapping stays good once the file is closed
+    close(fd);
+    mmap_file_obj_t *self = m_new_obj_with_finaliser(mmap_file_obj_t);
+    self->base.type = &tulip_mmap_type;
+    self->data = data;
+    self->len = st.st_size;
+    self->closed = 0;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+STATIC mp_obj_t mmap_file_close(mp_obj_t self_in) {
+    mmap_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    if(self->data) munmap(self->data, self->len);
+    self->data = NULL;
+    self->len = 0;
+    self->closed = 1;
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mmap_file_close_obj, mmap_file_close);
+
+STATIC mp_obj_t mmap_file_unary_op(mp_unary_op_t op, mp_obj_t self_in) {
+    mmap_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    switch(op) {
+        case MP_UNARY_OP_LEN: return MP_OBJ_NEW_SMALL_INT(self->len);
+        case MP_UNARY_OP_BOOL: return mp_obj_new_bool(self->len != 0);
+        default: return MP_OBJ_NULL;
+    }
+}
+
+STATIC mp_int_t mmap_file_get_buffer(mp_obj_t self_in, mp_buffer_info_t *bufinfo, mp_uint_t flags) {
+    mmap_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    // Read only, and gone once closed
+    if((flags & MP_BUFFER_WRITE) || self->closed) return 1;
+    static uint8_t empty[1];
+    bufinfo->buf = self->data ? self->data : empty;
+    bufinfo->len = self->len;
+    bufinfo->typecode = 'B';
+    return 0;
+}
+
+STATIC const mp_rom_map_elem_t mmap_file_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mmap_file_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR___del__), MP_ROM_PTR(&mmap_file_close_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mmap_file_locals_dict, mmap_file_locals_dict_table);
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    tulip_mmap_type,
+    MP_QSTR_mmap,
+    MP_TYPE_FLAG_NONE,
+    unary_op, mmap_file_unary_op,
+    buffer, mmap_file_get_buffer,
+    locals_dict, &mmap_file_locals_dict
+    );
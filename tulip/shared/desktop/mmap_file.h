@@ -0,0 +1,13 @@
+// mmap_file.h
+// tulip.mmap on desktop: a file mapped read-only into memory, usable as a buffer with no copy
+#ifndef MMAP_FILE_H
+#define MMAP_FILE_H
+
+#include "py/obj.h"
+
+extern const mp_obj_type_t tulip_mmap_type;
+
+// Maps filename, raising OSError if it can't
+mp_obj_t mmap_file_open(const char *filename);
+
+#endif
@@ -1,5 +1,10 @@
 // multicast_desktop.c
+#ifdef __linux__
+#define _GNU_SOURCE // sendmmsg / recvmmsg
+#endif
 #include "alles.h"
+#include "alles_wire.h"
+#include "alles_sim.h"
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -13,18 +18,31 @@
 #include <string.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 extern void deserialize_event(char * message, uint16_t length);
 
 int sock= -1;
 uint8_t ipv4_quartet;
 //extern uint8_t quartet_offset;
-char udp_message[MAX_RECEIVE_LEN];
+// Datagrams read per wakeup
+#define MCAST_RX_BATCH 16
+char udp_messages[MCAST_RX_BATCH][ALLES_WIRE_MAX_LEN];
 extern char *message_start_pointer;
 extern char *alles_local_ip;
 extern int16_t message_length;
 uint32_t udp_message_counter = 0;
+struct sockaddr_in mcast_dest; // resolved once when the socket is created
 int64_t last_ping_time = PING_TIME_MS; // do the first ping at 10s in to wait for other synths to announce themselves
+pthread_t mcast_listen_thread;
+uint8_t mcast_listening = 0;
+volatile uint8_t mcast_stopping = 0;
+int mcast_wake[2] = {-1, -1}; // written by mcast_listen_stop to wake the listen task
 
 
 // Gets the first non-localhost IP address if the user did not specify one on the commandline.
@@ -99,6 +117,16 @@ void create_multicast_ipv4_socket(void) {
         exit(1);
     }
 
+    // The simulator's nodes live on loopback, so the socket goes there instead of the multicast group
+    if(alles_sim_running) {
+        if(alles_sim_attach(sock, &mcast_dest) < 0) {
+            fprintf(stderr, "Failed to attach to the simulator. Error %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Simulating %d nodes on 127.0.0.1:%d\n", alles_sim_config.nodes, ntohs(mcast_dest.sin_port));
+        return;
+    }
+
     int yes = 1;
     err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
     if(err<0) fprintf(stderr, "Can't set reuseport %d\n",errno);
@@ -135,101 +163,166 @@ void create_multicast_ipv4_socket(void) {
     err = socket_add_ipv4_multicast_group();
     if(err) exit(EXIT_FAILURE);
 
+    memset(&mcast_dest, 0, sizeof(mcast_dest));
+    mcast_dest.sin_family = AF_INET;
+    mcast_dest.sin_port = htons(UDP_PORT);
+    inet_pton(AF_INET, MULTICAST_IPV4_ADDR, &mcast_dest.sin_addr.s_addr);
+
     fprintf(stderr,"Multicast IF is %s. Listening on %s:%d\n", alles_local_ip,  MULTICAST_IPV4_ADDR, UDP_PORT);
 }
 
 
 void mcast_send(char * message, uint16_t len) {
-    struct addrinfo hints = {
-        .ai_flags = AI_PASSIVE,
-        .ai_socktype = SOCK_DGRAM,
-    };
-    struct addrinfo *res;
-    hints.ai_family = AF_INET; // For an IPv4 socket
-    int err = getaddrinfo(MULTICAST_IPV4_ADDR, NULL, &hints, &res);
-    if (err < 0) {
-        fprintf(stderr, "getaddrinfo() failed for IPV4 destination address. error: %d", err);
-    }
-    if (res == 0) {
-        fprintf(stderr, "getaddrinfo() did not return any addresses");
-    }
-    ((struct sockaddr_in *)res->ai_addr)->sin_port = htons(UDP_PORT);
-    err = sendto(sock, message, len, 0, res->ai_addr, res->ai_addrlen);
-    freeaddrinfo(res);
+    if(sock < 0) return;
+    int err = sendto(sock, message, len, 0, (struct sockaddr *)&mcast_dest, sizeof(mcast_dest));
     if (err < 0) {
         fprintf(stderr, "IPV4 sendto failed. errno: %d", errno);
     }
+}
 
+// Send a batch of datagrams, in one syscall where the OS has sendmmsg
+void mcast_send_batch(char ** messages, uint16_t * lens, uint8_t count) {
+    if(sock < 0) return;
+#ifdef __linux__
+    struct mmsghdr msgs[MESH_QUEUE_DATAGRAMS];
+    struct iovec iovs[MESH_QUEUE_DATAGRAMS];
+    if(count > MESH_QUEUE_DATAGRAMS) count = MESH_QUEUE_DATAGRAMS;
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for(uint8_t i=0;i<count;i++) {
+        iovs[i].iov_base = messages[i];
+        iovs[i].iov_len = lens[i];
+        msgs[i].msg_hdr.msg_name = &mcast_dest;
+        msgs[i].msg_hdr.msg_namelen = sizeof(mcast_dest);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    uint8_t sent = 0;
+    while(sent < count) {
+        int n = sendmmsg(sock, msgs + sent, count - sent, 0);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "IPV4 sendmmsg failed. errno: %d", errno);
+            return;
+        }
+        sent += n;
+    }
+#else
+    for(uint8_t i=0;i<count;i++) mcast_send(messages[i], lens[i]);
+#endif
 }
 
 
 
-// called from pthread
+static void handle_message(char * message, uint16_t length) {
+    udp_message_counter++;
+    message_start_pointer = message;
+    message_length = length;
+    alles_parse_message(message_start_pointer, message_length);
+}
+
+// Reads what's waiting on the socket without blocking, up to MCAST_RX_BATCH datagrams, in one syscall where
+// the OS has recvmmsg. Returns how many, 0 once the socket is drained, or -1 on error.
+static int mcast_receive_batch(uint16_t * lens) {
+#ifdef __linux__
+    struct mmsghdr msgs[MCAST_RX_BATCH];
+    struct iovec iovs[MCAST_RX_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(uint8_t i=0;i<MCAST_RX_BATCH;i++) {
+        iovs[i].iov_base = udp_messages[i];
+        iovs[i].iov_len = ALLES_WIRE_MAX_LEN - 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(sock, msgs, MCAST_RX_BATCH, MSG_DONTWAIT, NULL);
+    if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    for(int i=0;i<n;i++) lens[i] = msgs[i].msg_len;
+    return n;
+#else
+    int n = 0;
+    while(n < MCAST_RX_BATCH) {
+        ssize_t len = recv(sock, udp_messages[n], ALLES_WIRE_MAX_LEN - 1, MSG_DONTWAIT);
+        if(len < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            return n ? n : -1;
+        }
+        lens[n++] = len;
+    }
+    return n;
+#endif
+}
+
+// called from pthread. Sleeps until the socket has data, then drains it a batch at a time, until
+// mcast_listen_stop writes to mcast_wake.
 void *mcast_listen_task(void *vargp) {
-    struct timeval tv = {
-        .tv_sec =  0,
-        .tv_usec = 10*1000,
-    };
-
-    create_multicast_ipv4_socket();
-
-    int16_t full_message_length;
-    while (1) {
-        // set destination multicast addresses for sending from these sockets
-        //struct sockaddr_in sdestv4 = {
-        //    .sin_family = AF_INET,
-         //   .sin_port = htons(UDP_PORT),
-        //};
-        // We know this inet_aton will pass because we did it above already
-        //inet_pton(AF_INET, MULTICAST_IPV4_ADDR, &(sdestv4.sin_addr.s_addr));
-
-        int err = 1;
-        while (err > 0) { 
-            fd_set rfds;
-            FD_ZERO(&rfds);
-            FD_SET(sock, &rfds);
-
-            int s = select(sock + 1, &rfds, NULL, NULL, &tv);
+    uint16_t lens[MCAST_RX_BATCH];
+    while (!mcast_stopping) {
+        create_multicast_ipv4_socket();
+#ifdef __linux__
+        int epfd = epoll_create1(0);
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = sock };
+        struct epoll_event wake_ev = { .events = EPOLLIN, .data.fd = mcast_wake[0] };
+        if(epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0
+            || epoll_ctl(epfd, EPOLL_CTL_ADD, mcast_wake[0], &wake_ev) < 0) {
+            fprintf(stderr, "epoll setup failed: errno %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+#else
+        struct pollfd pfds[2] = { { .fd = sock, .events = POLLIN }, { .fd = mcast_wake[0], .events = POLLIN } };
+#endif
+        int err = 0;
+        while (err >= 0 && !mcast_stopping) {
+#ifdef __linux__
+            int s = epoll_wait(epfd, &ev, 1, -1);
+#else
+            int s = poll(pfds, 2, -1);
+#endif
             if (s < 0) {
-                fprintf(stderr, "Select failed: errno %d\n", errno);
-                err = -1;
+                if(errno == EINTR) continue;
+                fprintf(stderr, "multicast wait failed: errno %d\n", errno);
                 break;
             }
-            else if (s > 0) {
-                if (FD_ISSET(sock, &rfds)) {
-                    // Incoming UDP packet received
-                    // Turn on the CPU monitor to see how long parsing takes
-                    struct sockaddr_in6 raddr; // Large enough for both IPv4 or IPv6
-                    socklen_t socklen = sizeof(raddr);
-                    full_message_length = recvfrom(sock, udp_message, sizeof(udp_message)-1, 0,
-                                       (struct sockaddr *)&raddr, &socklen);
-                    if (full_message_length < 0) {
-                        fprintf(stderr, "multicast recvfrom failed: errno %d\n", errno);
-                        err = -1;
-                        break;
-                    }
-                    udp_message[full_message_length] = 0;
-                    uint16_t start = 0;
-                    // Break the packet up into messages (delimited by Z.)
-                    for(uint16_t i=0;i<full_message_length;i++) {
-                        if(udp_message[i] == 'Z') {
-                            udp_message[i] = 0;
-                            udp_message_counter++;
-                            message_start_pointer = udp_message + start;
-                            message_length = i - start;
-                            alles_parse_message(message_start_pointer, message_length);
-                            start = i+1;
-                        }
-                    }
+            if (mcast_stopping) break;
+            while ((err = mcast_receive_batch(lens)) > 0) {
+                for(int i=0;i<err;i++) {
+                    udp_messages[i][lens[i]] = 0;
+                    alles_wire_split(udp_messages[i], lens[i], handle_message);
                 }
-            } 
-            // Tulip doesn't ping, and we don't need real time UDP listening on Tulip. This is just for receiving pings for the map. 
-            usleep(1000*10);
+            }
+            if (err < 0) fprintf(stderr, "multicast receive failed: errno %d\n", errno);
         }
 
-        fprintf(stderr, "Shutting down socket and restarting...\n");
-        shutdown(sock, 0);
-        close(sock);
+        if(!mcast_stopping) fprintf(stderr, "Shutting down socket and restarting...\n");
+#ifdef __linux__
+        close(epfd);
+#endif
+        int old = sock;
+        sock = -1; // senders drop messages from here on
+        shutdown(old, 0);
+        close(old);
+    }
+    return NULL;
+}
+
+void mcast_listen_start() {
+    if(mcast_listening) return;
+    if(pipe(mcast_wake) < 0) {
+        fprintf(stderr, "Can't make the multicast wake pipe. Error %d\n", errno);
+        exit(EXIT_FAILURE);
     }
+    mcast_stopping = 0;
+    pthread_create(&mcast_listen_thread, NULL, mcast_listen_task, NULL);
+    mcast_listening = 1;
 }
 
+// Returns once the listen task has closed the socket
+void mcast_listen_stop() {
+    if(!mcast_listening) return;
+    mcast_stopping = 1;
+    char c = 0;
+    if(write(mcast_wake[1], &c, 1) < 0) fprintf(stderr, "Can't wake the multicast task. Error %d\n", errno);
+    pthread_join(mcast_listen_thread, NULL);
+    close(mcast_wake[0]);
+    close(mcast_wake[1]);
+    mcast_wake[0] = mcast_wake[1] = -1;
+    mcast_listening = 0;
+}
@@ -0,0 +1,363 @@
+// unix_audio.c
+// Tulip Desktop's audio driver: runs AMY through miniaudio, with render timing fed to audio_stats.
+// Replaces AMY's own libminiaudio-audio.c so that Tulip owns the render loop.
+
+#define MINIAUDIO_IMPLEMENTATION
+#define MA_NO_DECODING
+#define MA_NO_ENCODING
+#define MA_NO_GENERATION
+#include "miniaudio.h"
+#include "alles.h"
+#include "audio_stats.h"
+#include "render_split.h"
+#include "unix_audio.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include "mpthreadport.h"
+#endif
+
+extern uint8_t status;
+
+int16_t amy_playback_device_id = -1;
+int16_t amy_capture_device_id = -1;
+
+ma_context audio_context;
+ma_device audio_device;
+
+// AMY renders in AMY_BLOCK_SIZE frames but the device asks for whatever it wants,
+// so keep the tail of the last block around for the next callback.
+int16_t leftover_buf[AMY_BLOCK_SIZE * AMY_NCHANS];
+uint16_t leftover_frames = 0;
+
+// Render pool. The callback thread renders part 0 as AMY core 0, worker i renders part i as core i.
+// 0 threads means one per CPU. Past that, the ceiling is how many cores AMY keeps mix buffers for.
+uint8_t unix_audio_threads = 0;
+
+// Device callback size in frames (0 lets the backend pick), and how many AMY blocks a producer
+// thread renders ahead of the device. 0 lookahead renders inside the callback, lowest latency.
+uint16_t unix_audio_period_frames = 0;
+uint8_t unix_audio_lookahead = 0;
+uint8_t unix_audio_realtime = 0;
+
+void unix_audio_set_mode(uint8_t mode) {
+    if(mode == UNIX_AUDIO_MODE_LOW_LATENCY) {
+        unix_audio_period_frames = AMY_BLOCK_SIZE;
+        unix_audio_lookahead = 0;
+        unix_audio_threads = 0;
+        unix_audio_realtime = 1;
+    } else if(mode == UNIX_AUDIO_MODE_HIGH_POLYPHONY) {
+        unix_audio_period_frames = AMY_BLOCK_SIZE * 4;
+        unix_audio_lookahead = 4;
+        unix_audio_threads = 0;
+        unix_audio_realtime = 0;
+    } else {
+        unix_audio_period_frames = 0;
+        unix_audio_lookahead = 0;
+        unix_audio_threads = 0;
+        unix_audio_realtime = 0;
+    }
+}
+
+void unix_audio_set_threads(uint8_t threads) {
+    if(threads > UNIX_AUDIO_MAX_THREADS) threads = UNIX_AUDIO_MAX_THREADS;
+    unix_audio_threads = threads;
+}
+
+void unix_audio_pick_threads() {
+    if(unix_audio_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unix_audio_threads = cpus > UNIX_AUDIO_MAX_THREADS ? UNIX_AUDIO_MAX_THREADS : (cpus < 1 ? 1 : cpus);
+    }
+    if(unix_audio_threads > UNIX_AUDIO_MAX_THREADS) unix_audio_threads = UNIX_AUDIO_MAX_THREADS;
+}
+
+static void unix_audio_set_thread_realtime() {
+#if defined(__APPLE__)
+    mp_thread_set_realtime();
+#else
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+        fprintf(stderr, "could not set realtime audio priority, check your rtprio limit\n");
+    }
+#endif
+}
+
+pthread_t render_workers[UNIX_AUDIO_MAX_THREADS];
+pthread_mutex_t render_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_pool_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t render_pool_done = PTHREAD_COND_INITIALIZER;
+uint32_t render_pool_generation = 0;
+uint8_t render_pool_pending = 0;
+uint8_t render_pool_running = 0;
+
+static void render_part(uint8_t part) {
+    audio_stats_render_start(part);
+    render_split_part_start();
+    amy_render(render_split_bounds[part], render_split_bounds[part+1], part);
+    audio_stats_render_stop(part);
+}
+
+static void *render_worker(void *vargp) {
+    uint8_t part = (uint8_t)(uintptr_t)vargp;
+    uint32_t seen = 0;
+    if(unix_audio_realtime) unix_audio_set_thread_realtime();
+    pthread_mutex_lock(&render_pool_mutex);
+    while(render_pool_running) {
+        while(render_pool_running && render_pool_generation == seen) {
+            pthread_cond_wait(&render_pool_start, &render_pool_mutex);
+        }
+        if(!render_pool_running) break;
+        seen = render_pool_generation;
+        pthread_mutex_unlock(&render_pool_mutex);
+        render_part(part);
+        pthread_mutex_lock(&render_pool_mutex);
+        if(--render_pool_pending == 0) pthread_cond_signal(&render_pool_done);
+    }
+    pthread_mutex_unlock(&render_pool_mutex);
+    return NULL;
+}
+
+static void render_pool_start_workers() {
+    unix_audio_pick_threads();
+    render_pool_running = 1;
+    for(uint8_t i=1;i<unix_audio_threads;i++) {
+        pthread_create(&render_workers[i], NULL, render_worker, (void*)(uintptr_t)i);
+    }
+}
+
+static void render_pool_stop_workers() {
+    pthread_mutex_lock(&render_pool_mutex);
+    render_pool_running = 0;
+    pthread_cond_broadcast(&render_pool_start);
+    pthread_mutex_unlock(&render_pool_mutex);
+    for(uint8_t i=1;i<unix_audio_threads;i++) pthread_join(render_workers[i], NULL);
+}
+
+static int16_t * render_block() {
+    audio_stats_block_start();
+    amy_prepare_buffer();
+    if(unix_audio_threads > 1) {
+        pthread_mutex_lock(&render_pool_mutex);
+        render_pool_pending = unix_audio_threads - 1;
+        render_pool_generation++;
+        pthread_cond_broadcast(&render_pool_start);
+        pthread_mutex_unlock(&render_pool_mutex);
+    }
+    render_part(0);
+    if(unix_audio_threads > 1) {
+        pthread_mutex_lock(&render_pool_mutex);
+        while(render_pool_pending) pthread_cond_wait(&render_pool_done, &render_pool_mutex);
+        pthread_mutex_unlock(&render_pool_mutex);
+        render_split_update();
+    }
+    int16_t *block = amy_fill_buffer();
+    audio_stats_block_stop();
+    return block;
+}
+
+// Lookahead ring. The producer owns ring[ring_write] while ring_count < lookahead, the callback
+// owns ring[ring_read] while ring_count > 0, so only the count needs the lock.
+static int16_t ring[UNIX_AUDIO_MAX_LOOKAHEAD][AMY_BLOCK_SIZE * AMY_NCHANS];
+static int16_t ring_input[AMY_BLOCK_SIZE * AMY_NCHANS];
+static uint8_t ring_read = 0;
+static uint8_t ring_write = 0;
+static uint8_t ring_count = 0;
+static uint8_t producer_running = 0;
+static pthread_t producer_thread;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;
+
+static void *render_producer(void *vargp) {
+    if(unix_audio_realtime) unix_audio_set_thread_realtime();
+    pthread_mutex_lock(&ring_mutex);
+    while(producer_running) {
+        while(producer_running && ring_count == unix_audio_lookahead) {
+            pthread_cond_wait(&ring_space, &ring_mutex);
+        }
+        if(!producer_running) break;
+        // Audio input arrives a lookahead late in this mode, take the freshest block we have
+        memcpy(amy_in_block, ring_input, sizeof(ring_input));
+        pthread_mutex_unlock(&ring_mutex);
+        int16_t *block = render_block();
+        memcpy(ring[ring_write], block, sizeof(int16_t) * AMY_BLOCK_SIZE * AMY_NCHANS);
+        ring_write = (ring_write + 1) % unix_audio_lookahead;
+        pthread_mutex_lock(&ring_mutex);
+        ring_count++;
+    }
+    pthread_mutex_unlock(&ring_mutex);
+    return NULL;
+}
+
+static void producer_start() {
+    if(unix_audio_lookahead > UNIX_AUDIO_MAX_LOOKAHEAD) unix_audio_lookahead = UNIX_AUDIO_MAX_LOOKAHEAD;
+    if(unix_audio_lookahead == 0) return;
+    ring_read = ring_write = ring_count = 0;
+    producer_running = 1;
+    pthread_create(&producer_thread, NULL, render_producer, NULL);
+}
+
+static void producer_stop() {
+    if(unix_audio_lookahead == 0) return;
+    pthread_mutex_lock(&ring_mutex);
+    producer_running = 0;
+    pthread_cond_signal(&ring_space);
+    pthread_mutex_unlock(&ring_mutex);
+    pthread_join(producer_thread, NULL);
+}
+
+// Takes the next rendered block off the ring, or silence if the producer fell behind.
+static int16_t * ring_take(const int16_t *in, ma_uint32 in_frames) {
+    pthread_mutex_lock(&ring_mutex);
+    if(in != NULL) {
+        ma_uint32 n = in_frames < AMY_BLOCK_SIZE ? in_frames : AMY_BLOCK_SIZE;
+        memcpy(ring_input, in, sizeof(int16_t) * n * AMY_NCHANS);
+    }
+    uint8_t avail = ring_count;
+    pthread_mutex_unlock(&ring_mutex);
+    if(!avail) {
+        audio_stats_underrun();
+        memset(leftover_buf, 0, sizeof(leftover_buf));
+        return leftover_buf;
+    }
+    memcpy(leftover_buf, ring[ring_read], sizeof(leftover_buf));
+    ring_read = (ring_read + 1) % unix_audio_lookahead;
+    pthread_mutex_lock(&ring_mutex);
+    ring_count--;
+    pthread_cond_signal(&ring_space);
+    pthread_mutex_unlock(&ring_mutex);
+    return leftover_buf;
+}
+
+static void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frame_count) {
+    int64_t start = get_time_us();
+    int16_t *out = (int16_t *)pOutput;
+    const int16_t *in = (const int16_t *)pInput;
+    ma_uint32 done = 0;
+
+    while(done < frame_count) {
+        if(leftover_frames == 0 && unix_audio_lookahead) {
+            ring_take(in ? in + done * AMY_NCHANS : NULL, frame_count - done);
+            leftover_frames = AMY_BLOCK_SIZE;
+        } else if(leftover_frames == 0) {
+            // Feed the capture frames lined up with this block to AMY's audio input
+            for(uint16_t i=0;i<AMY_BLOCK_SIZE*AMY_NCHANS;i++) {
+                uint32_t src = done * AMY_NCHANS + i;
+                amy_in_block[i] = (in != NULL && src < frame_count * AMY_NCHANS) ? in[src] : 0;
+            }
+            int16_t *block = render_block();
+            memcpy(leftover_buf, block, sizeof(int16_t) * AMY_BLOCK_SIZE * AMY_NCHANS);
+            leftover_frames = AMY_BLOCK_SIZE;
+        }
+        ma_uint32 take = frame_count - done;
+        if(take > leftover_frames) take = leftover_frames;
+        memcpy(out + done * AMY_NCHANS,
+               leftover_buf + (AMY_BLOCK_SIZE - leftover_frames) * AMY_NCHANS,
+               sizeof(int16_t) * take * AMY_NCHANS);
+        leftover_frames -= take;
+        done += take;
+    }
+
+    // If filling this callback took longer than the audio it produced, the device ran dry.
+    // (With lookahead the callback only copies, and ring_take counts the underruns.)
+    if(!unix_audio_lookahead && (get_time_us() - start) * AMY_SAMPLE_RATE > (int64_t)frame_count * 1000000) {
+        audio_stats_underrun();
+    }
+}
+
+static amy_err_t audio_context_init() {
+    ma_context_config context_config = ma_context_config_init();
+    if(unix_audio_realtime) context_config.threadPriority = ma_thread_priority_realtime;
+    if (ma_context_init(NULL, 0, &context_config, &audio_context) != MA_SUCCESS) {
+        fprintf(stderr, "could not init audio context\n");
+        return AMY_FAIL;
+    }
+    return AMY_OK;
+}
+
+void amy_print_devices() {
+    ma_device_info* playback_infos;
+    ma_uint32 playback_count;
+    ma_device_info* capture_infos;
+    ma_uint32 capture_count;
+    if(audio_context_init() != AMY_OK) return;
+    if (ma_context_get_devices(&audio_context, &playback_infos, &playback_count, &capture_infos, &capture_count) != MA_SUCCESS) {
+        fprintf(stderr, "could not list audio devices\n");
+    } else {
+        for (ma_uint32 i = 0; i < playback_count; i++) {
+            printf("%d - %s\n", i, playback_infos[i].name);
+        }
+        if(capture_count) printf("capture devices:\n");
+        for (ma_uint32 i = 0; i < capture_count; i++) {
+            printf("%d - %s\n", i, capture_infos[i].name);
+        }
+    }
+    ma_context_uninit(&audio_context);
+}
+
+static amy_err_t audio_device_init() {
+    ma_device_info* playback_infos;
+    ma_uint32 playback_count;
+    ma_device_info* capture_infos;
+    ma_uint32 capture_count;
+    if(audio_context_init() != AMY_OK) return AMY_FAIL;
+    if (ma_context_get_devices(&audio_context, &playback_infos, &playback_count, &capture_infos, &capture_count) != MA_SUCCESS) {
+        fprintf(stderr, "could not list audio devices\n");
+        return AMY_FAIL;
+    }
+
+    ma_device_config config = ma_device_config_init(ma_device_type_duplex);
+    if(amy_playback_device_id >= 0 && amy_playback_device_id < (int16_t)playback_count) {
+        config.playback.pDeviceID = &playback_infos[amy_playback_device_id].id;
+    }
+    if(amy_capture_device_id >= 0 && amy_capture_device_id < (int16_t)capture_count) {
+        config.capture.pDeviceID = &capture_infos[amy_capture_device_id].id;
+    }
+    config.playback.format = ma_format_s16;
+    config.playback.channels = AMY_NCHANS;
+    config.capture.format = ma_format_s16;
+    config.capture.channels = AMY_NCHANS;
+    config.sampleRate = AMY_SAMPLE_RATE;
+    config.periodSizeInFrames = unix_audio_period_frames;
+    if(unix_audio_realtime) config.performanceProfile = ma_performance_profile_low_latency;
+    config.dataCallback = data_callback;
+    config.pUserData = NULL;
+
+    if (ma_device_init(&audio_context, &config, &audio_device) != MA_SUCCESS) {
+        // No capture device, try again without audio input
+        fprintf(stderr, "no duplex audio device, trying playback only\n");
+        config.deviceType = ma_device_type_playback;
+        if (ma_device_init(&audio_context, &config, &audio_device) != MA_SUCCESS) {
+            fprintf(stderr, "could not open audio device\n");
+            ma_context_uninit(&audio_context);
+            return AMY_FAIL;
+        }
+    }
+    if (ma_device_start(&audio_device) != MA_SUCCESS) {
+        fprintf(stderr, "could not start audio device\n");
+        ma_device_uninit(&audio_device);
+        ma_context_uninit(&audio_context);
+        return AMY_FAIL;
+    }
+    return AMY_OK;
+}
+
+void *miniaudio_run(void *vargp) {
+    render_pool_start_workers();
+    producer_start();
+    if(audio_device_init() != AMY_OK) {
+        producer_stop();
+        render_pool_stop_workers();
+        return NULL;
+    }
+    while(status & RUNNING) {
+        delay_ms(10);
+    }
+    ma_device_uninit(&audio_device);
+    ma_context_uninit(&audio_context);
+    producer_stop();
+    render_pool_stop_workers();
+    return NULL;
+}
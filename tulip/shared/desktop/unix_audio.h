@@ -0,0 +1,36 @@
+// unix_audio.h
+#ifndef __UNIX_AUDIOH
+#define __UNIX_AUDIOH
+#include <stdint.h>
+#include "amy.h"
+#include "render_split.h"
+
+#define UNIX_AUDIO_MODE_DEFAULT 0
+#define UNIX_AUDIO_MODE_LOW_LATENCY 1    // one AMY block per callback, rendered in the callback, realtime threads
+#define UNIX_AUDIO_MODE_HIGH_POLYPHONY 2 // bigger callbacks, every render thread, blocks rendered ahead
+
+// AMY renders on at most AMY_CORES cores, each with its own mix buffer
+#ifdef AMY_CORES
+#define UNIX_AUDIO_MAX_THREADS (AMY_CORES < RENDER_SPLIT_MAX_PARTS ? AMY_CORES : RENDER_SPLIT_MAX_PARTS)
+#else
+#define UNIX_AUDIO_MAX_THREADS 2
+#endif
+#define UNIX_AUDIO_MAX_LOOKAHEAD 16
+
+extern int16_t amy_playback_device_id;
+extern int16_t amy_capture_device_id;
+extern uint8_t unix_audio_threads;
+extern uint16_t unix_audio_period_frames;
+extern uint8_t unix_audio_lookahead;
+extern uint8_t unix_audio_realtime;
+
+// Set these before alles_start, the device and render threads are set up once.
+void unix_audio_set_mode(uint8_t mode);
+// 0 threads is one per CPU, up to UNIX_AUDIO_MAX_THREADS
+void unix_audio_set_threads(uint8_t threads);
+// Settles unix_audio_threads on a real count, before AMY starts
+void unix_audio_pick_threads();
+void amy_print_devices();
+void *miniaudio_run(void *vargp);
+
+#endif
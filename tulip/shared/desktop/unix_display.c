@@ -391,7 +391,7 @@ void unix_display_init() {
 
     SDL_StartTextInput();
 
-    frame_bb = (uint8_t *) malloc_caps(FONT_HEIGHT*H_RES*BYTES_PER_PIXEL,MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    frame_bb = (uint8_t *) malloc_caps_tag(FONT_HEIGHT*H_RES*BYTES_PER_PIXEL, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_DISPLAY);
     SDL_StartTextInput();
 
 
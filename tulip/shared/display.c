@@ -577,7 +577,7 @@ void display_screenshot(char * screenshot_fn) {
     // Blank the display
     display_stop();
 
-    uint8_t * screenshot_bb = (uint8_t *) malloc_caps(FONT_HEIGHT*H_RES*BYTES_PER_PIXEL,MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t * screenshot_bb = (uint8_t *) malloc_caps_tag(FONT_HEIGHT*H_RES*BYTES_PER_PIXEL, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_DISPLAY);
     uint32_t c = 0;
     uint8_t r,g,b,a;
 
@@ -1057,35 +1057,35 @@ void display_init(void) {
     // 12 divides into 600, 480, 240
     // Create the background FB
     // 1536000 bytes
-    bg = (uint8_t*)calloc_caps(32, 1, (H_RES+OFFSCREEN_X_PX)*(V_RES+OFFSCREEN_Y_PX)*BYTES_PER_PIXEL, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bg = (uint8_t*)calloc_caps_tag(32, 1, (H_RES+OFFSCREEN_X_PX)*(V_RES+OFFSCREEN_Y_PX)*BYTES_PER_PIXEL, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_DISPLAY);
     // 614400 bytes
-    bg_tfb = (uint8_t*)calloc_caps(32, 1, (H_RES*V_RES), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bg_tfb = (uint8_t*)calloc_caps_tag(32, 1, (H_RES*V_RES), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_DISPLAY);
 
     // And various ptrs
-    sprite_ids = (uint8_t*)malloc_caps(H_RES *  sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-    sprite_ram = (uint8_t*)malloc_caps(SPRITE_RAM_BYTES*sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-    sprite_x_px = (uint16_t*)malloc_caps(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-    sprite_y_px = (uint16_t*)malloc_caps(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-    sprite_w_px = (uint16_t*)malloc_caps(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-    sprite_h_px = (uint16_t*)malloc_caps(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-    sprite_vis = (uint8_t*)malloc_caps(SPRITES*sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-    sprite_mem = (uint32_t*)malloc_caps(SPRITES*sizeof(uint32_t), MALLOC_CAP_INTERNAL);
-    collision_bitfield = (uint8_t*)malloc_caps(128, MALLOC_CAP_INTERNAL);
-    TFB_pxlen = (uint16_t*)malloc_caps(V_RES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-
-
-    TFB = (uint8_t*)malloc_caps(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-    TFBf = (uint8_t*)malloc_caps(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-    TFBfg = (uint8_t*)malloc_caps(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-    TFBbg = (uint8_t*)malloc_caps(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL);
-
-
-    x_offsets = (int16_t*)malloc_caps(V_RES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-    y_offsets = (int16_t*)malloc_caps(V_RES*sizeof(uint16_t), MALLOC_CAP_INTERNAL);
-    x_speeds = (int16_t*)malloc_caps(V_RES*sizeof(int16_t), MALLOC_CAP_INTERNAL);
-    y_speeds = (int16_t*)malloc_caps(V_RES*sizeof(int16_t), MALLOC_CAP_INTERNAL);
-
-    bg_lines = (uint32_t**)malloc_caps(V_RES*sizeof(uint32_t*), MALLOC_CAP_INTERNAL);
+    sprite_ids = (uint8_t*)malloc_caps_tag(H_RES *  sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_ram = (uint8_t*)malloc_caps_tag(SPRITE_RAM_BYTES*sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_x_px = (uint16_t*)malloc_caps_tag(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_y_px = (uint16_t*)malloc_caps_tag(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_w_px = (uint16_t*)malloc_caps_tag(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_h_px = (uint16_t*)malloc_caps_tag(SPRITES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_vis = (uint8_t*)malloc_caps_tag(SPRITES*sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    sprite_mem = (uint32_t*)malloc_caps_tag(SPRITES*sizeof(uint32_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    collision_bitfield = (uint8_t*)malloc_caps_tag(128, MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    TFB_pxlen = (uint16_t*)malloc_caps_tag(V_RES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+
+
+    TFB = (uint8_t*)malloc_caps_tag(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    TFBf = (uint8_t*)malloc_caps_tag(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    TFBfg = (uint8_t*)malloc_caps_tag(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    TFBbg = (uint8_t*)malloc_caps_tag(TFB_ROWS*TFB_COLS*sizeof(uint8_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+
+
+    x_offsets = (int16_t*)malloc_caps_tag(V_RES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    y_offsets = (int16_t*)malloc_caps_tag(V_RES*sizeof(uint16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    x_speeds = (int16_t*)malloc_caps_tag(V_RES*sizeof(int16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+    y_speeds = (int16_t*)malloc_caps_tag(V_RES*sizeof(int16_t), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
+
+    bg_lines = (uint32_t**)malloc_caps_tag(V_RES*sizeof(uint32_t*), MALLOC_CAP_INTERNAL, MEM_TAG_DISPLAY);
 
 
     // Init the BG, TFB and sprite and UI layers
@@ -5,6 +5,8 @@
 #include "tulip_helpers.h"
 #include "display.h"
 #include "polyfills.h"
+#include "editor_text.h"
+#include "editor_search.h"
 
 #define EDITOR_COLOR_FG 255
 #define EDITOR_COLOR_COMMENT 229
@@ -13,6 +15,7 @@
 #define EDITOR_COLOR_OPERATOR 240
 #define EDITOR_COLOR_SELECTION_BG 72
 #define EDITOR_COLOR_FUNCTION 188
+#define EDITOR_COLOR_KEYWORD 188
 #define EDITOR_COLOR_BG 36
 
 /* palette from tulip editor v1 with tulip4 pal idxes
@@ -26,10 +29,8 @@
 36    {39, 40, 34},    //7 BG
 */
 
-// shared vars for editor
-char ** text_lines;
+// shared vars for editor. The text itself is in editor_text.c
 char * yank;
-uint16_t lines = 0; 
 uint8_t dirty = 0;
 uint8_t *saved_tfb;
 uint8_t *saved_tfbf;
@@ -38,14 +39,16 @@ uint8_t *saved_tfbbg;
 uint16_t saved_tfb_y;
 uint16_t saved_tfb_x;
 uint8_t quit_flag = 0;
-uint16_t y_offset = 0;
+uint32_t y_offset = 0;
 uint16_t cursor_x = 0;
 uint16_t cursor_y = 0;
 #define EDITOR_NORMAL 0
 #define EDITOR_PROMPT_CHAR 1
 #define EDITOR_PROMPT_SEARCH 2
 #define EDITOR_PROMPT_SAVE 3
-#define EDITOR_PROMPT_READ 3
+#define EDITOR_PROMPT_READ 4
+#define EDITOR_PROMPT_REPLACE 5
+#define EDITOR_PROMPT_REPLACE_WITH 6
 #define MAX_STRING_LEN 50 // for search string, filenames
 #define EDITOR_TAB_SPACES 4
 #define V_SCROLL_MARGIN 6
@@ -55,8 +58,14 @@ char current_prompt[MAX_STRING_LEN];
 uint8_t prompted_count = 0;
 uint8_t editor_mode = EDITOR_NORMAL;
 char fn[MAX_STRING_LEN]; 
+// Last search, and whether its matches are marked on screen
+char search_pattern[MAX_STRING_LEN];
+uint8_t search_regex = 0;
+uint8_t search_marks = 0;
 int mc=0;
 int fc=0;
+// One screen row of the document, for painting
+char row_text[TFB_COLS+1];
 
 void dbg(const char *fmt, ...) {
     va_list args;
@@ -68,7 +77,7 @@ void dbg(const char *fmt, ...) {
 
 void * editor_malloc(uint32_t size) {
     mc++;
-	return malloc_caps(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	return malloc_caps_tag(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
 }
 
 
@@ -77,54 +86,172 @@ void editor_free(void* ptr) {
     free_caps(ptr);
 }
 
+void * editor_realloc(void * ptr, uint32_t size) {
+	return realloc_caps_tag(ptr, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+}
+
 
-void editor_highlight_at_row(uint16_t y) {
-    // {"False", "None", "True", "and", "as", "assert", "break", "class", "continue", "def", 
-    //  "del", "elif", "else", "except", "finally", "for", "from", "global", "if", "import", "in", "is", "lambda", "nonlocal", 
-    //  "not", "or", "pass", "raise", "return", "try", "while", "with", "yield"};
-    const char operators[]= ":;-/=+-()[]{}\'\".,\\|!@#$%^&*<>?"; // this + space is delims
+// Syntax highlighting. The lexer state at the end of each line is kept, so a row can be colored
+// without lexing everything above it. States for lines [0, hl_valid) are right. Lines up to hl_known
+// were lexed before, and each was lexed from the state now stored above it unless marked HL_DIRTY
+// (edited, or the line above has changed since). So once a line that isn't marked ends in the same
+// state as before, everything after it up to the next marked line is right again.
+#define HL_CODE 0
+#define HL_DQ 1 // "
+#define HL_SQ 2 // '
+#define HL_TDQ 3 // """
+#define HL_TSQ 4 // '''
+#define HL_DIRTY 0x80
+// Jumping further than this past what has been lexed (into a big file), just assume code
+#define EDITOR_HIGHLIGHT_LOOKBACK 5000
+
+uint8_t * hl_state = NULL;
+uint32_t hl_cap = 0;
+uint32_t hl_valid = 0;
+uint32_t hl_known = 0;
+
+const uint8_t hl_operators[128] = {
+    [':']=1, [';']=1, ['-']=1, ['/']=1, ['=']=1, ['+']=1, ['(']=1, [')']=1, ['[']=1, [']']=1, ['{']=1, ['}']=1,
+    ['\'']=1, ['"']=1, ['.']=1, [',']=1, ['\\']=1, ['|']=1, ['!']=1, ['@']=1, ['#']=1, ['$']=1, ['%']=1,
+    ['^']=1, ['&']=1, ['*']=1, ['<']=1, ['>']=1, ['?']=1, ['~']=1,
+};
+
+const char * hl_keywords[] = {"False", "None", "True", "and", "as", "assert", "async", "await", "break", "class",
+    "continue", "def", "del", "elif", "else", "except", "finally", "for", "from", "global", "if", "import", "in",
+    "is", "lambda", "nonlocal", "not", "or", "pass", "raise", "return", "try", "while", "with", "yield", NULL};
+
+uint8_t is_word_char(char c) {
+    return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c=='_' || (uint8_t)c >= 128;
+}
 
-    uint8_t state = 0;
-    // TODO: keywords, function calls a = dog(), etc, kwargs?
-    for(uint16_t i=0;i<strlen(text_lines[y+y_offset]);i++) {
-        uint8_t operator_hit = 0;
-        char c = text_lines[y+y_offset][i];
-        //dbg("char %c state %d row %d i %d\n", c, state, y, i);
-        if(!state) { 
-            for(uint8_t j=0;j<strlen(operators);j++) {
-                if(c==operators[j]) {
-                    operator_hit = 1;
+uint8_t is_keyword(const char * word, uint8_t len) {
+    for(uint8_t i=0;hl_keywords[i];i++) {
+        if(strlen(hl_keywords[i]) == len && memcmp(hl_keywords[i], word, len) == 0) return 1;
+    }
+    return 0;
+}
+
+void color_at_row(uint16_t y, uint32_t from, uint32_t to, uint8_t color) {
+    if(y >= TFB_ROWS) return;
+    if(to > TFB_COLS) to = TFB_COLS;
+    for(uint32_t i=from;i<to;i++) TFBfg[y*TFB_COLS+i] = color;
+}
+
+// Lexes line, starting in state, and colors what is on screen of it into row y (none if y is
+// TFB_ROWS or more). Returns the state at the end of the line.
+uint8_t highlight_line(uint32_t line, uint8_t state, uint16_t y) {
+    uint32_t start = editor_text_line_start(line);
+    uint32_t len = editor_text_line_len(line);
+    uint32_t i = 0;
+    while(i < len) {
+        char c = editor_text_at(start + i);
+        uint32_t j = i + 1;
+        if(state == HL_CODE) {
+            uint8_t color = EDITOR_COLOR_FG;
+            if(c == '#') {
+                color_at_row(y, i, len, EDITOR_COLOR_COMMENT);
+                break;
+            } else if(c == '"' || c == '\'') {
+                uint8_t triple = (i + 2 < len && editor_text_at(start+i+1) == c && editor_text_at(start+i+2) == c);
+                if(triple) j = i + 3;
+                state = (c == '"') ? (triple ? HL_TDQ : HL_DQ) : (triple ? HL_TSQ : HL_SQ);
+                color = EDITOR_COLOR_STRING;
+            } else if(c >= '0' && c <= '9') {
+                while(j < len && (is_word_char(editor_text_at(start+j)) || editor_text_at(start+j) == '.')) j++;
+                color = EDITOR_COLOR_NUMBER;
+            } else if(is_word_char(c)) {
+                char word[9];
+                word[0] = c;
+                while(j < len && is_word_char(editor_text_at(start+j))) {
+                    if(j - i < sizeof(word)) word[j-i] = editor_text_at(start+j);
+                    j++;
+                }
+                if(j - i <= sizeof(word) && is_keyword(word, j - i)) color = EDITOR_COLOR_KEYWORD;
+            } else if((uint8_t)c < 128 && hl_operators[(uint8_t)c]) {
+                color = EDITOR_COLOR_OPERATOR;
+            }
+            color_at_row(y, i, j, color);
+        } else {
+            // In a string: skip escapes, look for the end
+            if(c == '\\') {
+                j = i + 2;
+            } else if((state == HL_DQ && c == '"') || (state == HL_SQ && c == '\'')) {
+                state = HL_CODE;
+            } else if((state == HL_TDQ && c == '"') || (state == HL_TSQ && c == '\'')) {
+                if(i + 2 < len && editor_text_at(start+i+1) == c && editor_text_at(start+i+2) == c) {
+                    j = i + 3;
+                    state = HL_CODE;
                 }
             }
-            if(c==34 || c==39) {
-                state = 1;
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_STRING;
-            } else if (c==39) {
-                state = 2;
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_STRING;
-            } else if(c==35) {
-                state = 3;
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_COMMENT;
-            } else if(c>='0' && c<='9') {
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_NUMBER;
-            } else if(operator_hit) {
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_OPERATOR;
+            color_at_row(y, i, j, EDITOR_COLOR_STRING);
+        }
+        i = j;
+    }
+    // Only triple quoted strings (or a \ at the end) carry on to the next line
+    if((state == HL_DQ || state == HL_SQ) && !(len && editor_text_at(start + len - 1) == '\\')) state = HL_CODE;
+    return state;
+}
+
+uint8_t highlight_reserve(uint32_t lines) {
+    if(lines <= hl_cap) return 1;
+    uint32_t cap = lines + lines / 2 + 256;
+    uint8_t * s = (uint8_t*)realloc_caps_tag(hl_state, cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+    if(s == NULL) return 0;
+    hl_state = s;
+    hl_cap = cap;
+    return 1;
+}
+
+void highlight_reset() {
+    hl_valid = 0;
+    hl_known = 0;
+}
+
+// Keeps the states lined up with the lines after an edit to line that added (or took away) delta lines
+void highlight_edited(uint32_t line, int32_t delta) {
+    if(line < hl_known) {
+        if(delta > 0) {
+            if(!highlight_reserve(hl_known + delta)) {
+                hl_known = line;
+            } else {
+                memmove(hl_state + line + 1 + delta, hl_state + line + 1, hl_known - line - 1);
+                memset(hl_state + line + 1, HL_DIRTY, delta);
+                hl_known += delta;
+            }
+        } else if(delta < 0) {
+            uint32_t gone = -delta;
+            if(line + 1 + gone >= hl_known) {
+                hl_known = line + 1;
             } else {
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_FG; 
+                memmove(hl_state + line + 1, hl_state + line + 1 + gone, hl_known - line - 1 - gone);
+                hl_known -= gone;
             }
-        } else {
-            // We are in a state
-            if(state == 1) {
-                if(c==34) state = 0;
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_STRING;
-            } else if(state ==2) {
-                if(c==39) state = 0;
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_STRING;
-            } else if(state == 3) {
-                TFBfg[y*TFB_COLS+i] = EDITOR_COLOR_COMMENT;
-            } 
         }
+        if(line < hl_known) hl_state[line] |= HL_DIRTY;
+    }
+    if(hl_valid > line) hl_valid = line;
+}
+
+// Stores the end state of line hl_valid
+void highlight_commit(uint32_t line, uint8_t state) {
+    if(line != hl_valid || !highlight_reserve(line + 1)) return;
+    uint8_t converged = (line < hl_known && hl_state[line] == state);
+    // The next line was lexed from what this one used to end in
+    if(line + 1 < hl_known && (hl_state[line] & ~HL_DIRTY) != state) hl_state[line+1] |= HL_DIRTY;
+    hl_state[line] = state;
+    hl_valid = line + 1;
+    if(hl_known < hl_valid) hl_known = hl_valid;
+    if(converged) while(hl_valid < hl_known && !(hl_state[hl_valid] & HL_DIRTY)) hl_valid++;
+}
+
+uint8_t highlight_state_before(uint32_t line) {
+    if(line == 0 || line > hl_valid + EDITOR_HIGHLIGHT_LOOKBACK) return HL_CODE;
+    while(hl_valid < line) {
+        uint32_t l = hl_valid;
+        highlight_commit(l, highlight_line(l, l ? hl_state[l-1] : HL_CODE, TFB_ROWS));
+        if(hl_valid == l) return HL_CODE; // out of memory
     }
+    return hl_state[line-1];
 }
 
 void clear_row(uint16_t y) {
@@ -150,6 +277,7 @@ void string_at_row(char * s, int16_t len, uint16_t y) {
     //dbg("string at row ###%s### len %d y %d\n", s, len, y);
     if(s!=NULL) {
     	if(len < 0) len=strlen(s);
+        if(len > TFB_COLS) len = TFB_COLS;
     	if(y<TFB_ROWS) {
     		for(uint16_t i=0;i<len;i++) {
     			TFB[y*TFB_COLS+i] = s[i];
@@ -160,17 +288,235 @@ void string_at_row(char * s, int16_t len, uint16_t y) {
     		for(uint16_t i=len;i<TFB_COLS;i++) {
     			TFB[y*TFB_COLS+i] = 0;
     		}
-            if(y!=TFB_ROWS-1)editor_highlight_at_row(y);
     	}
     }
 }
 
 
+uint32_t cursor_line() {
+    return cursor_y + y_offset;
+}
+
+// Document offset of the cursor
+uint32_t cursor_pos() {
+    return editor_text_line_start(cursor_line()) + cursor_x;
+}
+
+// Copies what fits on screen of line into row_text, returns its length
+uint16_t line_to_row(uint32_t line) {
+    uint32_t len = editor_text_line_len(line);
+    if(len > TFB_COLS) len = TFB_COLS;
+    editor_text_copy(editor_text_line_start(line), len, row_text);
+    row_text[len] = 0;
+    return len;
+}
+
+void paint_tfb(uint16_t start_at_y);
+
+// Unmarks search matches once the text changes
+void search_marks_off() {
+    if(search_marks) {
+        search_marks = 0;
+        paint_tfb(0);
+    }
+}
+
+// Undo journal. Each edit is kept as what was inserted or deleted where, oldest first. Every key
+// starts a new group, and undo takes back a whole group, so a newline and its indent go together.
+// Typing and backspacing add to the last record until a word ends. The oldest records are dropped
+// once the journal passes EDITOR_UNDO_MAX_BYTES.
+#define EDITOR_UNDO_MAX_BYTES (256*1024)
+typedef struct {
+    uint32_t group;
+    uint32_t pos;
+    uint32_t len;
+    uint32_t cursor; // where the cursor was before the edit
+    uint8_t insert;
+    uint8_t typed; // made by typing or backspacing, so it can grow
+    char * text;
+} undo_rec_t;
+
+undo_rec_t ** undo_stack = NULL;
+undo_rec_t ** redo_stack = NULL;
+uint32_t undo_count = 0;
+uint32_t redo_count = 0;
+uint32_t undo_cap = 0;
+uint32_t undo_bytes = 0;
+uint32_t undo_group = 1;
+// The group on top when last saved, to know when undo gets back there
+uint32_t undo_saved_group = 0;
+// Set while undoing or redoing, so those edits aren't journaled themselves
+uint8_t undo_applying = 0;
+
+void undo_rec_free(undo_rec_t * r) {
+    undo_bytes -= sizeof(undo_rec_t) + r->len;
+    editor_free(r->text);
+    editor_free(r);
+}
+
+void undo_clear_redo() {
+    while(redo_count) undo_rec_free(redo_stack[--redo_count]);
+}
+
+void undo_clear() {
+    undo_clear_redo();
+    while(undo_count) undo_rec_free(undo_stack[--undo_count]);
+    undo_saved_group = 0;
+}
+
+uint32_t undo_top_group() {
+    return undo_count ? undo_stack[undo_count-1]->group : 0;
+}
+
+uint8_t undo_is_space(char c) {
+    return c == ' ' || c == '\n';
+}
+
+// Where the cursor is, even when an edit in progress has taken its line away
+uint32_t undo_cursor() {
+    if(!editor_text_has_line(cursor_line())) return editor_text_length();
+    uint32_t pos = cursor_pos();
+    return (pos > editor_text_length()) ? editor_text_length() : pos;
+}
+
+// Grows the last record when this edit carries on typing (or backspacing) from the key before
+uint8_t undo_coalesce(uint8_t insert, uint32_t pos, const char * text, uint32_t len) {
+    if(!undo_count || len != 1 || text[0] == '\n') return 0;
+    undo_rec_t * r = undo_stack[undo_count-1];
+    if(!r->typed || r->insert != insert || r->group + 1 < undo_group || r->group == undo_saved_group) return 0;
+    uint8_t append;
+    if(insert) {
+        if(pos != r->pos + r->len) return 0;
+        append = 1;
+    } else if(pos + len == r->pos) {
+        append = 0; // backspace
+    } else if(pos == r->pos) {
+        append = 1; // delete
+    } else {
+        return 0;
+    }
+    // A space after a word ends it
+    char next_to = append ? r->text[r->len-1] : r->text[0];
+    if(undo_is_space(text[0]) && !undo_is_space(next_to)) return 0;
+    char * grown = (char*)editor_realloc(r->text, r->len + len);
+    if(grown == NULL) return 0;
+    if(append) {
+        memcpy(grown + r->len, text, len);
+    } else {
+        memmove(grown + len, grown, r->len);
+        memcpy(grown, text, len);
+        r->pos = pos;
+    }
+    r->text = grown;
+    r->len += len;
+    r->group = undo_group;
+    undo_bytes += len;
+    return 1;
+}
+
+void undo_record(uint8_t insert, uint32_t pos, const char * text, uint32_t len) {
+    undo_clear_redo();
+    if(!undo_coalesce(insert, pos, text, len)) {
+        // Out of memory: an edit missing from the journal would throw the rest off, so start over
+        undo_rec_t * r = (undo_rec_t*)editor_malloc(sizeof(undo_rec_t));
+        if(r == NULL) { undo_clear(); return; }
+        r->text = (char*)editor_malloc(len ? len : 1);
+        if(r->text == NULL) { editor_free(r); undo_clear(); return; }
+        if(undo_count == undo_cap) {
+            uint32_t cap = undo_cap ? undo_cap * 2 : 64;
+            undo_rec_t ** stack = (undo_rec_t**)editor_realloc(undo_stack, cap * sizeof(undo_rec_t*));
+            undo_rec_t ** redo = (undo_rec_t**)editor_realloc(redo_stack, cap * sizeof(undo_rec_t*));
+            if(stack) undo_stack = stack;
+            if(redo) redo_stack = redo;
+            if(stack == NULL || redo == NULL) { editor_free(r->text); editor_free(r); undo_clear(); return; }
+            undo_cap = cap;
+        }
+        memcpy(r->text, text, len);
+        r->group = undo_group;
+        r->pos = pos;
+        r->len = len;
+        r->cursor = undo_cursor();
+        r->insert = insert;
+        r->typed = (len == 1 && text[0] != '\n');
+        undo_stack[undo_count++] = r;
+        undo_bytes += sizeof(undo_rec_t) + len;
+    }
+    // Forget the oldest edits. What's left still undoes cleanly back to there
+    uint32_t drop = 0;
+    while(drop < undo_count && undo_bytes > EDITOR_UNDO_MAX_BYTES) undo_rec_free(undo_stack[drop++]);
+    if(drop) {
+        memmove(undo_stack, undo_stack + drop, (undo_count - drop) * sizeof(undo_rec_t*));
+        undo_count -= drop;
+    }
+}
+
+// Every edit goes through these, so the highlighter knows which lines changed, and so it can be undone
+uint8_t text_insert(uint32_t pos, const char * text, uint32_t len) {
+    uint32_t line = editor_text_line_of(pos);
+    uint32_t lines = editor_text_lines();
+    if(!editor_text_insert(pos, text, len)) return 0;
+    if(!undo_applying) undo_record(1, pos, text, len);
+    highlight_edited(line, (int32_t)(editor_text_lines() - lines));
+    search_marks_off();
+    return 1;
+}
+
+uint8_t text_delete(uint32_t pos, uint32_t len) {
+    // Index past the end first, so the line count only changes by what is deleted
+    editor_text_line_of(pos + len);
+    uint32_t line = editor_text_line_of(pos);
+    uint32_t lines = editor_text_lines();
+    // Keep what goes, for undo
+    char * gone = NULL;
+    if(!undo_applying) {
+        gone = (char*)editor_malloc(len ? len : 1);
+        if(gone) editor_text_copy(pos, len, gone);
+    }
+    if(!editor_text_delete(pos, len)) {
+        if(gone) editor_free(gone);
+        return 0;
+    }
+    if(gone) {
+        undo_record(0, pos, gone, len);
+        editor_free(gone);
+    } else if(!undo_applying) {
+        undo_clear();
+    }
+    highlight_edited(line, (int32_t)(editor_text_lines() - lines));
+    search_marks_off();
+    return 1;
+}
+
+// Marks matches of the last search on row y, which shows line
+void search_mark_row(uint32_t line, uint16_t y) {
+    uint32_t start = editor_text_line_start(line);
+    uint32_t end = start + editor_text_line_len(line);
+    uint32_t match_len;
+    uint32_t p = start;
+    while((p = editor_search_next(search_pattern, search_regex, p, end, &match_len)) != EDITOR_SEARCH_NONE) {
+        for(uint32_t i=p-start;i<p-start+match_len && i<TFB_COLS;i++) TFBbg[y*TFB_COLS+i] = EDITOR_COLOR_SELECTION_BG;
+        if(p - start >= TFB_COLS) break;
+        p += match_len;
+    }
+}
+
+// Paints and colors the document line on row y. Returns 1 if the line now ends in a different state
+// than it did, so the rows below need coloring again
+uint8_t paint_line(uint16_t y) {
+    uint32_t line = y_offset + y;
+    string_at_row(row_text, line_to_row(line), y);
+    uint8_t state = highlight_line(line, highlight_state_before(line), y);
+    if(search_marks) search_mark_row(line, y);
+    uint8_t changed = (line < hl_known && (hl_state[line] & ~HL_DIRTY) != state);
+    highlight_commit(line, state);
+    return changed;
+}
+
 // (Re) paints the entire TFB
 void paint_tfb(uint16_t start_at_y) {
     for(uint16_t y=start_at_y;y<TFB_ROWS-1;y++) {
-        if(y_offset + y < lines) { 
-	       string_at_row(text_lines[y_offset+y], -1, y);
+        if(editor_text_has_line(y_offset + y)) { 
+	       paint_line(y);
         } else {
             clear_row(y);
         }
@@ -189,7 +535,7 @@ void move_cursor(int16_t x, int16_t y) {
 	// Move viewport up/down (TFB_ROWS-1) / 2
 	// Move cursor to next/prev line (which would now be in the middle of the screen)
 	if(y < 0) {
-		uint16_t cursor_y_line_was = cursor_y + y_offset;
+		uint32_t cursor_y_line_was = cursor_y + y_offset;
 		if(y_offset > ((TFB_ROWS-1)/2)) {
 			y_offset = y_offset - (TFB_ROWS-1)/2;
 		} else {
@@ -198,7 +544,7 @@ void move_cursor(int16_t x, int16_t y) {
 		cursor_y = (cursor_y_line_was-1) - y_offset;
 		paint_tfb(0);
 	} else if(y == TFB_ROWS-1) {
-		uint16_t cursor_y_line_was = cursor_y + y_offset;
+		uint32_t cursor_y_line_was = cursor_y + y_offset;
 		y_offset = y_offset + (TFB_ROWS-1)/2;
 		cursor_y = (cursor_y_line_was+1) - y_offset;
 		paint_tfb(0);
@@ -223,14 +569,21 @@ void move_cursor(int16_t x, int16_t y) {
 	// Update status bar
 	char status[TFB_COLS];
 	// TODO, padding better 
+    int lines = editor_text_lines();
 	float percent = ((float)(cursor_y+y_offset+1) / (float)lines) * 100.0;
+    // A big file that isn't indexed to the end yet: lines so far, and how far in we are by bytes
+    char more_char = ' ';
+    if(!editor_text_complete()) {
+        more_char = '+';
+        percent = ((float)cursor_pos() / (float)editor_text_length()) * 100.0;
+    }
     char dirty_char = ' ';
     if(dirty) dirty_char = '*';
     #ifdef TDECK
     // Smaller screen, less space for text
-	sprintf(status, "%04d / %04d [%02.2f%%] %3d %.10s %c", cursor_y+y_offset+1, lines,  percent, cursor_x, fn, dirty_char);
+	sprintf(status, "%04d / %04d%c[%02.2f%%] %3d %.10s %c", (int)(cursor_y+y_offset+1), lines, more_char, percent, cursor_x, fn, dirty_char);
     #else
-    sprintf(status, "%04d / %04d [%02.2f%%] %3d %.35s %c", cursor_y+y_offset+1, lines,  percent, cursor_x, fn, dirty_char);
+    sprintf(status, "%04d / %04d%c[%02.2f%%] %3d %.35s %c", (int)(cursor_y+y_offset+1), lines, more_char, percent, cursor_x, fn, dirty_char);
     #endif    
 	string_at_row(status, strlen(status), TFB_ROWS-1);
 	format_at_row(FORMAT_INVERSE, -1, TFB_ROWS-1);
@@ -250,11 +603,15 @@ void editor_page_up() {
 }
 
 void editor_page_down() {
-	if(y_offset + (TFB_ROWS-V_SCROLL_MARGIN) < lines) {
+	if(editor_text_has_line(y_offset + (TFB_ROWS-V_SCROLL_MARGIN))) {
 		y_offset = y_offset + (TFB_ROWS-V_SCROLL_MARGIN);
 		move_cursor(cursor_x, 0);
 	} else {
-		move_cursor(cursor_x, lines-y_offset);
+		// Last line
+		uint32_t last = editor_text_lines()-1;
+		uint16_t x = cursor_x;
+		if(x > editor_text_line_len(last)) x = editor_text_line_len(last);
+		move_cursor(x, last-y_offset);
 	}
 	paint_tfb(0);
 
@@ -308,78 +665,28 @@ void restore_tfb() {
     display_tfb_update(-1);
 }
 
-void editor_new_file() {
-    text_lines = (char**)editor_malloc(sizeof(char**)*1);
-    text_lines[0] = (char*)editor_malloc(sizeof(char)*1);
-    text_lines[0][0]=0;
-    lines=1;
+// Returns 0 if there's no memory for even an empty document
+uint8_t editor_new_file() {
+    if(editor_text_init(0)) return 1;
+    dbg("editor: out of memory\n");
+    return 0;
 }
 
 
+// Reads filename into the document at the start of the cursor's line
 void editor_open_file(const char *filename) {
-    // A file may already be loaded, if so, insert the lines where we are
-	uint16_t c = 0;
-    uint16_t new_lines = 0;
-	//dbg("opening file %s\n", filename);
-	int32_t fs = file_size(filename);
-	if(fs > 0) {
-		char * text = (char*) editor_malloc(fs+3); 
-		uint32_t bytes_read = read_file(filename, (uint8_t*)text, fs, 0);
-        //dbg("Filesize %d bytes read %d\n", fs, bytes_read);
-        new_lines = 1;
-        //if(text[bytes_read-1]!='\n') { new_lines = 0; dbg("adding n\n"); text[bytes_read] = '\n'; bytes_read++; }
-		text[bytes_read] = 0; // end
-		for(uint32_t i=0;i<bytes_read;i++) if(text[i]=='\n') new_lines++;
-		//dbg("File %s has %d lines. %d bytes\n", filename, new_lines,bytes_read);
-		char ** incoming_text_lines = (char**)editor_malloc(sizeof(char*)*(new_lines));
-
-		uint32_t last = 0;
-		for(uint32_t i=0;i<bytes_read+1;i++) {
-			if(text[i]=='\n' || i==bytes_read) {
-                //dbg("mallocing line %d\n", c);
-				incoming_text_lines[c]  = editor_malloc(i-last + 1);
-				uint16_t x;
-				for(x=0;x<i-last;x++) { 
-					incoming_text_lines[c][x] = text[last+x];
-				}
-				incoming_text_lines[c][x] = 0;
-				last = i+1;
-				c++;
-			}
+	uint32_t bytes_read;
+	char * text = (char*)read_file_alloc(filename, &bytes_read, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if(text && bytes_read > 0) {
+		uint32_t at = editor_text_line_start(cursor_line());
+		uint8_t ok = text_insert(at, text, bytes_read);
+		// Keep the line we were on its own line
+		if(ok && editor_text_length() > bytes_read && bytes_read && text[bytes_read-1] != '\n') {
+			ok = text_insert(at + bytes_read, "\n", 1);
 		}
-        if(c < new_lines) {
-            //dbg("allocing last line %d\n", c);
-            incoming_text_lines[c] = editor_malloc(1);
-            incoming_text_lines[c][0] = 0;
-        }
-		editor_free(text);
-
-		//dbg("File %s read with %d lines. Inserting at position %d. existing lines %d\n", filename, new_lines, y_offset+cursor_y, lines);
-
-        // Now insert the text lines at cursor_y+y_offset
-        char ** combined_text_lines = (char**)editor_malloc(sizeof(char*)*(new_lines+lines));
-        uint16_t line = 0;
-        for(uint16_t y=0;y<cursor_y+y_offset;y++) {
-            combined_text_lines[line++] = text_lines[y];
-        }
-        for(uint16_t y=0;y<new_lines;y++) {
-            combined_text_lines[line++] = incoming_text_lines[y];
-        }
-        for(uint16_t y=cursor_y+y_offset;y<lines;y++) {
-            combined_text_lines[line++] = text_lines[y];
-        }
-        if(lines) { 
-            editor_free(text_lines);
-        }
-        editor_free(incoming_text_lines);
-        text_lines = combined_text_lines;
-        //dbg("Setting lines to %d, was %d\n", lines+new_lines, lines);
-        lines = lines + new_lines;
-	} else {
-        //dbg("File doesn't exist\n");
-        editor_new_file();
-    }
-
+		if(!ok) dbg("editor: out of memory reading %s\n", filename);
+	}
+	if(text) free_caps(text);
 	paint_tfb(0);
 }
 
@@ -397,27 +704,15 @@ void prompt_for_string(char * prompt,  uint8_t mode) {
 
 void editor_save() {
     if(strlen(fn)) {
-        uint32_t bytes = 0;
-        for(uint16_t i=0;i<lines;i++) { if(text_lines[i] != NULL) bytes = bytes + strlen(text_lines[i]) + 1; }
-        char * text = (char*)editor_malloc(bytes);
-        uint32_t c = 0;
-        for(uint16_t i=0;i<lines;i++) { 
-            if(text_lines[i]!=NULL) {
-                if(text_lines[i][0] != 0) {
-                    for(uint16_t j=0;j<strlen(text_lines[i]);j++) {
-                        text[c++] = text_lines[i][j];
-                    }
-                    text[c++] = '\n';
-                } else {
-                    text[c++] = '\n';
-                }
-            }
+        // Streamed out, and files end with a newline
+        if(!editor_text_save(fn, 1)) {
+            // Still dirty, so the * stays up
+            dbg("editor: couldn't save %s\n", fn);
+            move_cursor(cursor_x, cursor_y);
+            return;
         }
-        //display_stop();
-        write_file(fn, (uint8_t*)text, c, 0);
-        //display_start();
         dirty = 0;
-        editor_free(text);
+        undo_saved_group = undo_top_group();
         //dbg("Saved %s\n", fn);
         move_cursor(cursor_x, cursor_y);
     } else {
@@ -429,19 +724,9 @@ void editor_save() {
 
 void editor_insert_character(int c) {
 	dirty = 1;
-	char * source_line = text_lines[cursor_y + y_offset];
-	char * dest_line = (char*)editor_malloc(strlen(source_line) + 2);
-	for(uint16_t i=0;i<cursor_x;i++) {
-		dest_line[i] = source_line[i];
-	}
-	dest_line[cursor_x] = (uint8_t) c;
-	for(uint16_t i=cursor_x+1;i<strlen(source_line)+1;i++) {
-		dest_line[i] = source_line[i-1];
-	}
-	dest_line[strlen(source_line)+1] = 0;
-    editor_free(source_line); 
-	text_lines[cursor_y + y_offset] = dest_line;
-	string_at_row(dest_line, -1, cursor_y);
+    char ch = (char)c;
+    if(!text_insert(cursor_pos(), &ch, 1)) return;
+	if(paint_line(cursor_y)) paint_tfb(cursor_y+1);
 	move_cursor(cursor_x+1, cursor_y);
 }
 
@@ -450,12 +735,12 @@ void editor_linestart() {
 }
 
 void editor_lineend() {
-	move_cursor(strlen(text_lines[cursor_y + y_offset]), cursor_y);
+	move_cursor(editor_text_line_len(cursor_line()), cursor_y);
 }
 
 void editor_backspace() {
 	dirty = 1;
-	char* cur_line = text_lines[cursor_y + y_offset];
+    uint32_t line_start = editor_text_line_start(cursor_line());
 	if(cursor_x > 0) {
         // Check if there's a tab / N spaces before us
         uint8_t no_tab = 1;
@@ -463,50 +748,20 @@ void editor_backspace() {
         if(cursor_x>=EDITOR_TAB_SPACES) {
             no_tab = 0;
             for(int16_t i=cursor_x-1;i>=0;i--) {
-                if(cur_line[i] != 32) { no_tab = 1; } else { space_count++; }
-            }
-        }
-        if(!no_tab && (space_count % EDITOR_TAB_SPACES == 0)) {
-            // delete N characters
-            for(uint16_t i=cursor_x-EDITOR_TAB_SPACES;i<strlen(cur_line);i++) {
-                cur_line[i] = cur_line[i + EDITOR_TAB_SPACES];
+                if(editor_text_at(line_start+i) != 32) { no_tab = 1; } else { space_count++; }
             }
-            string_at_row(cur_line, -1, cursor_y);
-            move_cursor(cursor_x-EDITOR_TAB_SPACES, cursor_y);
-        } else {
-    		for(uint16_t i=cursor_x-1;i<strlen(cur_line);i++) {
-	       		cur_line[i] = cur_line[i + 1];
-    		}
-            string_at_row(cur_line, -1, cursor_y);
-            move_cursor(cursor_x-1, cursor_y);
         }
+        uint16_t n = 1;
+        if(!no_tab && (space_count % EDITOR_TAB_SPACES == 0)) n = EDITOR_TAB_SPACES; // delete N characters
+        text_delete(line_start + cursor_x - n, n);
+        if(paint_line(cursor_y)) paint_tfb(cursor_y+1);
+        move_cursor(cursor_x-n, cursor_y);
 	} else {
 		// hard mode, move up
 		if(cursor_y + y_offset > 0) {
-			// we will have 1 less line when this is done
-			char *above_line = text_lines[cursor_y+y_offset-1];
-            char *old_line = text_lines[cursor_y+y_offset];
-			char *new_line = (char*)editor_malloc(strlen(above_line) + strlen(cur_line) + 1);
-			uint16_t c = 0;
-			for(uint16_t i=0;i<strlen(above_line);i++) new_line[c++] = above_line[i];
-			uint16_t split = c;
-			for(uint16_t i=0;i<strlen(cur_line);i++) new_line[c++] = cur_line[i];
-			new_line[c] = 0;
-			editor_free(above_line);
-			text_lines[cursor_y+y_offset-1] = new_line;
-			lines--;
-
-
-            char** dest_text_lines = (char**)editor_malloc(sizeof(char*) * (lines));
-            for(uint16_t i=0;i<cursor_y+y_offset;i++) {
-                dest_text_lines[i] = text_lines[i];
-            }
-			for(uint16_t i=cursor_y+y_offset;i<lines;i++) {
-				dest_text_lines[i] = text_lines[i+1];
-			}
-            editor_free(text_lines);
-            editor_free(old_line);
-            text_lines = dest_text_lines;
+			// we will have 1 less line when this is done: take out the \n between them
+            uint16_t split = editor_text_line_len(cursor_line()-1);
+            text_delete(line_start-1, 1);
 			paint_tfb(cursor_y-1);
 
 			// Move the cursor up at the split
@@ -522,58 +777,17 @@ void editor_tab() {
 
 void editor_crlf() {
 	dirty = 1;
-	char* cur_line = text_lines[cursor_y + y_offset];
-	char** dest_text_lines = (char**)editor_malloc(sizeof(char*) * (lines + 1));
-	for(uint16_t i=0;i<cursor_y+y_offset+1;i++) {
-		dest_text_lines[i] = text_lines[i];
-	}
+    uint32_t line_start = editor_text_line_start(cursor_line());
+    uint32_t line_len = editor_text_line_len(cursor_line());
     // Count tabs at the beginning of this line and add them to the line below
     uint16_t space_count = 0;
-    for(uint16_t i=0;i<strlen(cur_line);i++) {
-        if(cur_line[i]==32) {
-            space_count++;
-        } else {
-            i = strlen(cur_line) + 1; // end loop
-        }
-    }
+    while(space_count < line_len && editor_text_at(line_start+space_count) == 32) space_count++;
     uint16_t tab_count = space_count / EDITOR_TAB_SPACES;
 
-	if(cursor_x == strlen(cur_line)) {
-		// We are at the end of the line, so just make an empty line underneath and move on
-		dest_text_lines[cursor_y+y_offset+1] = (char*)editor_malloc(1+(tab_count*EDITOR_TAB_SPACES));
-        uint16_t c =0;
-        for(uint16_t i=0;i<tab_count;i++) {
-            for(uint16_t j=0;j<EDITOR_TAB_SPACES;j++) {
-                dest_text_lines[cursor_y+y_offset+1][c++] = 32; 
-            }
-        }
-		dest_text_lines[cursor_y+y_offset+1][c] = 0;
-	} else {
-		// We are somewhere in the middle of the line, so split and copy
-		// Get the text on cur line that has to go below
-		uint16_t chars_to_copy = strlen(cur_line) - cursor_x;
-		dest_text_lines[cursor_y+y_offset+1] = (char*)editor_malloc(chars_to_copy+1+(tab_count*EDITOR_TAB_SPACES));
-		uint16_t i;
-        uint16_t c =0;
-        for(uint16_t i=0;i<tab_count;i++) {
-            for(uint16_t j=0;j<EDITOR_TAB_SPACES;j++) {
-                dest_text_lines[cursor_y+y_offset+1][c++] = 32; 
-            }
-        }        
-		for(i=0;i<chars_to_copy;i++) {
-			dest_text_lines[cursor_y+y_offset+1][c++] = dest_text_lines[cursor_y+y_offset][cursor_x+i];
-		}
-		dest_text_lines[cursor_y+y_offset+1][c] = 0;
-		// Chop the old line, no need to realloc, i think we're ok
-		dest_text_lines[cursor_y+y_offset][cursor_x] = 0;
-	}
-	// Copy the remaining lines below that were not impacted
-	for(uint16_t i=cursor_y+y_offset+2;i<lines+1;i++) {
-		dest_text_lines[i] = text_lines[i-1];
-	}
-	lines++;
-	editor_free(text_lines);		
-	text_lines = dest_text_lines;
+    // Whatever is after the cursor goes down to the new line, after the indent
+    uint32_t pos = line_start + cursor_x;
+    if(!text_insert(pos, "\n", 1)) return;
+    for(uint16_t i=0;i<tab_count;i++) text_insert(pos + 1 + i*EDITOR_TAB_SPACES, "    ", EDITOR_TAB_SPACES);
 
 	// Redraw everything from the split (going down, as scroll)
 	paint_tfb(cursor_y);
@@ -586,19 +800,19 @@ void editor_crlf() {
 
 void editor_up() {
     if(cursor_y+y_offset > 0) {
-        if(cursor_x < strlen(text_lines[cursor_y-1 + y_offset])) {
+        if(cursor_x < editor_text_line_len(cursor_line()-1)) {
             move_cursor(cursor_x, cursor_y-1);
         } else {
-            move_cursor(strlen(text_lines[cursor_y-1 + y_offset]), cursor_y-1);
+            move_cursor(editor_text_line_len(cursor_line()-1), cursor_y-1);
         }
     }
 }
 void editor_down() {
-    if(cursor_y + y_offset < lines-1) {
-        if(cursor_x < strlen(text_lines[cursor_y+1+y_offset])) {
+    if(editor_text_has_line(cursor_line() + 1)) {
+        if(cursor_x < editor_text_line_len(cursor_line()+1)) {
             move_cursor(cursor_x, cursor_y+1);
         } else {
-            move_cursor(strlen(text_lines[cursor_y+1+y_offset]), cursor_y+1);
+            move_cursor(editor_text_line_len(cursor_line()+1), cursor_y+1);
         }
     } 
 }
@@ -606,12 +820,13 @@ void editor_down() {
 void editor_right() {
     // easiest, just go right
     uint8_t tab = 0;
-    if(cursor_x < strlen(text_lines[cursor_y + y_offset])) {
+    uint32_t line_start = editor_text_line_start(cursor_line());
+    if(cursor_x < editor_text_line_len(cursor_line())) {
         // count spaces ahead , see there is EDITOR_TAB_SPACES in a row, move that many instead
-        if(cursor_x + EDITOR_TAB_SPACES < (uint16_t)strlen(text_lines[cursor_y + y_offset])) {
+        if(cursor_x + EDITOR_TAB_SPACES < editor_text_line_len(cursor_line())) {
             tab = 1;
             for(uint16_t i=cursor_x+1;i<cursor_x+EDITOR_TAB_SPACES;i++) {
-                if(text_lines[cursor_y+y_offset][i] != 32) tab = 0;
+                if(editor_text_at(line_start+i) != 32) tab = 0;
             }
         }
         if(tab) {
@@ -627,12 +842,13 @@ void editor_right() {
 void editor_left() {
     // Easiest, if x is not zero, just move left
     uint8_t tab = 0;
+    uint32_t line_start = editor_text_line_start(cursor_line());
     if(cursor_x > 0) {
         // count spaces behind , see there is EDITOR_TAB_SPACES in a row, move that many instead
         if(cursor_x - EDITOR_TAB_SPACES >= 0) {
             tab = 1;
             for(int16_t i=cursor_x-1;i>=cursor_x-EDITOR_TAB_SPACES;i--) {
-                if(text_lines[cursor_y+y_offset][i] != 32) tab = 0;
+                if(editor_text_at(line_start+i) != 32) tab = 0;
             }
         }
         if(tab) {
@@ -650,22 +866,29 @@ void editor_left() {
 
 
 void editor_yank() {
-    char * yanked_line = text_lines[cursor_y+y_offset];
-    if(strlen(yanked_line)) {
+    uint32_t line = cursor_line();
+    uint32_t len = editor_text_line_len(line);
+    if(len) {
         dirty = 1;
     	if(yank) editor_free(yank);
-    	yank = (char*)editor_malloc(strlen(yanked_line)+1);
-    	for(uint16_t i=0;i<strlen(yanked_line);i++) yank[i] = yanked_line[i];
-    	yank[strlen(yanked_line)] = 0;
-    	// Now remove this line from the text_lines
-    	for(uint16_t i=cursor_y+y_offset;i<lines-1;i++) {
-    		text_lines[i] = text_lines[i+1];
-    	}
-    	lines--;
-    	// Got a crash here when yanking twice without an unyank
-    	editor_free(yanked_line);
+    	yank = (char*)editor_malloc(len+1);
+        uint32_t start = editor_text_line_start(line);
+        editor_text_copy(start, len, yank);
+    	yank[len] = 0;
+    	// Now remove this line, and the \n that ends it (or the one before it, on the last line)
+        if(line + 1 < editor_text_lines()) {
+            text_delete(start, len + 1);
+        } else if(line > 0) {
+            text_delete(start - 1, len + 1);
+        } else {
+            text_delete(start, len);
+        }
     	paint_tfb(cursor_y);
-    	move_cursor(0, cursor_y);
+        if(line >= editor_text_lines()) {
+            move_cursor(0, cursor_y-1);
+        } else {
+        	move_cursor(0, cursor_y);
+        }
     } else {
         editor_backspace();
         editor_down();
@@ -676,76 +899,136 @@ void editor_unyank() {
 	if(yank) {
 		dirty = 1;
 		//dbg("unyanking ###%s###\n", yank);
-		char** dest_text_lines = (char**)editor_malloc(sizeof(char*) * (lines + 1));
-		for(uint16_t i=0;i<cursor_y+y_offset;i++) dest_text_lines[i] = text_lines[i];
-		dest_text_lines[cursor_y+y_offset] = (char*)editor_malloc(strlen(yank)+1);
-		for(uint16_t i=0;i<strlen(yank);i++) dest_text_lines[cursor_y+y_offset][i] = yank[i];
-		dest_text_lines[cursor_y+y_offset][strlen(yank)] = 0;
-		for(uint16_t i=cursor_y+y_offset;i<lines;i++) {
-			dest_text_lines[i+1] = text_lines[i];
-		}
-		lines++;
-		editor_free(text_lines);
-		text_lines = dest_text_lines;
+        uint32_t start = editor_text_line_start(cursor_line());
+        if(text_insert(start, yank, strlen(yank))) {
+            text_insert(start + strlen(yank), "\n", 1);
+        }
 		paint_tfb(cursor_y);
 		move_cursor(0,cursor_y);
         editor_down();
 	}
 }
 
+// Puts the cursor at pos after an undo or redo, scrolling to it if it's off screen
+void undo_move_to(uint32_t pos) {
+    uint32_t line = editor_text_line_of(pos);
+    if(line < y_offset || line >= y_offset + TFB_ROWS - 1) {
+        y_offset = (line > 10) ? line - 10 : 0;
+    }
+    paint_tfb(0);
+    move_cursor(pos - editor_text_line_start(line), line - y_offset);
+}
 
-void editor_search(char * search_string) {
-    if(strlen(search_string)) {
-        uint8_t found = 0;
-        //dbg("starting search on line %d\n", y_offset + cursor_y);
-        for(uint16_t i=y_offset+cursor_y;i<lines+y_offset+cursor_y;i++) {
-            uint16_t actual_line = i % lines; // wrap around
-            //dbg("wrap around actual line to search is %d\n", actual_line);
-            int16_t offset = 0;
-            if(strlen(text_lines[actual_line])) {
-                while(!found && offset < (uint16_t)(strlen(text_lines[actual_line])-1)) {
-                    //dbg("found was %d and offset %d was < %d\n", found, offset, (strlen(text_lines[actual_line])-1));
-                    char * ret = strstr(text_lines[actual_line]+offset, search_string);
-                    if(ret) {
-                        //dbg("found match at line %d and col %d. offset %d\n", actual_line, ret - text_lines[actual_line] + offset, offset);
-                        // See if this is before our last search result
-                        if((y_offset + cursor_y == actual_line) && (ret-text_lines[actual_line]+offset <= cursor_x)) {
-                            //dbg("skipping match because already seen. cursor line %d x %d\n", y_offset + cursor_y, cursor_x);
-                            // it was, keep looking on this line
-                            offset=(ret-text_lines[actual_line]+offset)+1;
-                        } else {
-                            // A new find, adjust the y_offset and cursor
-                            if(i > TFB_ROWS-1) { // adjust page a bit 
-                                y_offset = actual_line-10; // show some context
-                            } else {
-                                y_offset = 0;
-                            }
-                            //dbg("new find, offset to %d\n", y_offset);
-                            move_cursor(ret-text_lines[actual_line]+offset, actual_line-y_offset);
-                            //dbg("moved cursor to x %d y %d\n", ret-text_lines[actual_line]+offset, actual_line-y_offset);
-                            found = 1; // we're done
-                        }
-                    } else { //nothing found  on this line, go to the next
-                        offset = strlen(text_lines[actual_line])+2;
-                        //dbg("setting offset to %d\n", offset);
-                    }
-                    if(found) i = lines+y_offset+cursor_y+1;
-                } // end found
-            } // end strlen
-        } // for each line
-        if(!found) {
-            //dbg("nothing found\n");
-        }
-    } else {
-        //dbg("no search string given\n");
+// Takes back the last group of edits
+void editor_undo() {
+    if(!undo_count) return;
+    uint32_t group = undo_stack[undo_count-1]->group;
+    uint32_t cursor = 0;
+    undo_applying = 1;
+    while(undo_count && undo_stack[undo_count-1]->group == group) {
+        undo_rec_t * r = undo_stack[undo_count-1];
+        uint8_t ok = r->insert ? text_delete(r->pos, r->len) : text_insert(r->pos, r->text, r->len);
+        if(!ok) break;
+        cursor = r->cursor;
+        redo_stack[redo_count++] = r;
+        undo_count--;
+    }
+    undo_applying = 0;
+    dirty = (undo_top_group() != undo_saved_group);
+    undo_move_to(cursor);
+}
+
+// Puts back the last group undone
+void editor_redo() {
+    if(!redo_count) return;
+    uint32_t group = redo_stack[redo_count-1]->group;
+    uint32_t cursor = 0;
+    undo_applying = 1;
+    while(redo_count && redo_stack[redo_count-1]->group == group) {
+        undo_rec_t * r = redo_stack[redo_count-1];
+        uint8_t ok = r->insert ? text_insert(r->pos, r->text, r->len) : text_delete(r->pos, r->len);
+        if(!ok) break;
+        cursor = r->insert ? r->pos + r->len : r->pos;
+        undo_stack[undo_count++] = r;
+        redo_count--;
+    }
+    undo_applying = 0;
+    dirty = (undo_top_group() != undo_saved_group);
+    undo_move_to(cursor);
+}
+
+// Finds the next match of the last search after the cursor, wrapping around, and moves there
+void editor_search() {
+    uint32_t len = editor_text_length();
+    uint32_t match_len;
+    uint32_t from = cursor_pos() + 1;
+    if(from > len) from = len;
+    uint32_t p = editor_search_next(search_pattern, search_regex, from, len, &match_len);
+    if(p == EDITOR_SEARCH_NONE) {
+        // Round from the top. A match at the cursor itself runs past from, so look that far on
+        uint32_t to = from + strlen(search_pattern);
+        if(to > len) to = len;
+        p = editor_search_next(search_pattern, search_regex, 0, to, &match_len);
+    }
+    if(p == EDITOR_SEARCH_NONE) {
+        dbg("not found: %s\n", search_pattern);
+        return;
+    }
+    uint32_t line = editor_text_line_of(p);
+    if(line < y_offset || line >= y_offset + TFB_ROWS - 1) {
+        // Off screen, bring it in with some context
+        y_offset = (line > 10) ? line - 10 : 0;
     }
-    
+    // Repaint to mark every match on screen
+    search_marks = 1;
+    paint_tfb(0);
+    move_cursor(p - editor_text_line_start(line), line - y_offset);
+}
+
+// Replaces every match of the last search with replacement, in one pass from the top
+void editor_replace_all(const char * replacement) {
+    uint32_t count = 0;
+    uint32_t pos = 0;
+    uint32_t rlen = strlen(replacement);
+    uint32_t match_len;
+    uint32_t p;
+    while((p = editor_search_next(search_pattern, search_regex, pos, editor_text_length(), &match_len)) != EDITOR_SEARCH_NONE) {
+        // The gap follows along, so the whole pass only moves the text once
+        if(!text_delete(p, match_len) || !text_insert(p, replacement, rlen)) break;
+        pos = p + rlen;
+        count++;
+    }
+    if(count) dirty = 1;
+    dbg("replaced %d\n", (int)count);
+    // The cursor's line may have got shorter, or gone
+    uint32_t line = cursor_line();
+    while(line > 0 && !editor_text_has_line(line)) line--;
+    if(line < y_offset) y_offset = line;
+    uint16_t x = cursor_x;
+    if(x > editor_text_line_len(line)) x = editor_text_line_len(line);
+    paint_tfb(0);
+    move_cursor(x, line - y_offset);
+}
+
+// Shows what has been typed at the prompt so far
+void prompt_redraw() {
+    char row[TFB_COLS];
+    snprintf(row, TFB_COLS, "%s %s", current_prompt, prompted_string);
+    string_at_row(row, -1, TFB_ROWS-1);
+    format_at_row(FORMAT_INVERSE, -1, TFB_ROWS-1);
+    display_tfb_update(TFB_ROWS-1);
 }
 
+const char * search_prompt(uint8_t mode) {
+    if(mode == EDITOR_PROMPT_REPLACE) return search_regex ? "Regex replace: " : "Replace: ";
+    return search_regex ? "Regex search: " : "Search string: ";
+}
 
 void process_char(int c) {
-    if(editor_mode == EDITOR_PROMPT_SEARCH || editor_mode == EDITOR_PROMPT_SAVE || editor_mode == EDITOR_PROMPT_READ) {
-        if(c>31 && c<127) {
+    // Each key is its own undo step
+    undo_group++;
+    if(editor_mode != EDITOR_NORMAL) {
+        if(c>31 && c<127 && prompted_count < MAX_STRING_LEN-1) {
             prompted_string[prompted_count++] = c;
             TFB[(TFB_ROWS-1)*TFB_COLS+prompted_count+strlen(current_prompt)] = c;
             paint_tfb(TFB_ROWS-1);
@@ -755,6 +1038,12 @@ void process_char(int c) {
             editor_mode=EDITOR_NORMAL;
             move_cursor(cursor_x,cursor_y);
         }
+        if(c==18 && (editor_mode == EDITOR_PROMPT_SEARCH || editor_mode == EDITOR_PROMPT_REPLACE)) { // control-R, regex on/off
+            search_regex = !search_regex;
+            prompted_string[prompted_count] = 0;
+            strcpy(current_prompt, search_prompt(editor_mode));
+            prompt_redraw();
+        }
         if(c==127 || c==8) {
             if(prompted_count>0) {
                 prompted_string[prompted_count] = 0;
@@ -766,25 +1055,36 @@ void process_char(int c) {
         }
         if(c==13 || c == 10) {
             prompted_string[prompted_count] = 0;
-            if(strlen(prompted_string)==0) {
+            uint8_t mode = editor_mode;
+            editor_mode = EDITOR_NORMAL;
+            if(mode == EDITOR_PROMPT_REPLACE_WITH) {
+                // Replacing with nothing is fine
+                editor_replace_all(prompted_string);
+            } else if(strlen(prompted_string)==0 && mode == EDITOR_PROMPT_SEARCH && strlen(search_pattern)) {
+                // Search again
+                editor_search();
+            } else if(strlen(prompted_string)==0) {
                 dbg("no text entered\n");
             } else {
                 //dbg("str %s\n", prompted_string); 
-                if(editor_mode == EDITOR_PROMPT_SAVE) {
+                if(mode == EDITOR_PROMPT_SAVE) {
                     strcpy(fn, prompted_string);
                     editor_save();
-                } else if(editor_mode==EDITOR_PROMPT_READ) {
+                } else if(mode==EDITOR_PROMPT_READ) {
                     if(file_exists(prompted_string)) {
                         editor_open_file(prompted_string);
                     } else {
                         dbg("no such file %s\n", prompted_string);
                     }
-                } else if(editor_mode==EDITOR_PROMPT_SEARCH) {
-                    editor_search(prompted_string);
+                } else if(mode==EDITOR_PROMPT_SEARCH) {
+                    strcpy(search_pattern, prompted_string);
+                    editor_search();
+                } else if(mode==EDITOR_PROMPT_REPLACE) {
+                    strcpy(search_pattern, prompted_string);
+                    prompt_for_string("Replace with: ", EDITOR_PROMPT_REPLACE_WITH);
                 }
             }
-            editor_mode = EDITOR_NORMAL;
-            move_cursor(cursor_x,cursor_y);
+            if(editor_mode == EDITOR_NORMAL) move_cursor(cursor_x,cursor_y);
         } 
     } else {
     	//dbg("Got char %d\n", c);
@@ -804,8 +1104,10 @@ void process_char(int c) {
             prompt_for_string("Save as: ", EDITOR_PROMPT_SAVE);
         } else if(c==18) { // control-R, read into
             prompt_for_string("Read file: ",EDITOR_PROMPT_READ);
-    	} else if(c==23) { // control-W, "where is" aka search TODO 
-            prompt_for_string("Search string: ", EDITOR_PROMPT_SEARCH);
+    	} else if(c==23) { // control-W, "where is" aka search. Enter on its own searches again
+            prompt_for_string((char*)search_prompt(EDITOR_PROMPT_SEARCH), EDITOR_PROMPT_SEARCH);
+    	} else if(c==28) { // control-\, replace all
+            prompt_for_string((char*)search_prompt(EDITOR_PROMPT_REPLACE), EDITOR_PROMPT_REPLACE);
     	} else if(c==24) { // control-X, save (no ask)
             if(strlen(fn)>0) {
                 editor_save();
@@ -816,6 +1118,10 @@ void process_char(int c) {
     		editor_linestart();
     	} else if(c == 5) { // control-E, end of line
     		editor_lineend();
+    	} else if(c==26) { // control-Z, undo
+    		editor_undo();
+    	} else if(c==7) { // control-G, redo
+    		editor_redo();
     	} else if(c==25) { // control Y, page up
     		editor_page_up();
     	} else if(c==22) { // control V, page down 
@@ -835,31 +1141,45 @@ void process_char(int c) {
 }
 
 
-void editor_start(const char * filename) {
+// Returns 0, with nothing to edit, if the file couldn't be opened
+uint8_t editor_start(const char * filename) {
     mc = 0; 
     fc = 0;
     prompted_string[0] = 0;
     current_prompt[0] = 0;
     prompted_count = 0;
     editor_mode = EDITOR_NORMAL;
-    lines =0;
     dirty = 0;
     y_offset = 0;
     cursor_y = 0;
     cursor_x = 0;
     fn[0] = 0;
+    highlight_reset();
+    search_marks = 0;
+    undo_clear();
 
     if(filename != NULL) { 
         strcpy(fn, filename);
-		editor_open_file(fn);
+        if(file_exists(fn)) {
+            // Big files stay on disk and are read as they are shown. An empty document in its place
+            // would be saved over it, so don't start at all
+            if(!editor_text_open(fn)) {
+                dbg("editor: out of memory opening %s\n", fn);
+                return 0;
+            }
+        } else if(!editor_new_file()) {
+            return 0;
+        }
+        paint_tfb(0);
 
 	} else {
 		//dbg("no filename given\n");
-        // In this case, let's just make a first text_line
-        editor_new_file();
+        // In this case, let's just start with one empty line
+        if(!editor_new_file()) return 0;
 	}
 	move_cursor(0,0);
 	y_offset = 0;
+    return 1;
 }
 
 void editor_key(int c) {
@@ -874,13 +1194,18 @@ void editor_activate() {
 
 void editor_deinit() {
     //restore_tfb();
-    for(uint16_t i=0;i<lines;i++) {
-        //delay_ms(1);
-        editor_free(text_lines[i]);
-    }
-    editor_free(text_lines);
+    editor_text_free();
+    if(hl_state) free_caps(hl_state);
+    hl_state = NULL;
+    hl_cap = 0;
     if(yank) editor_free(yank);
     yank = 0;
+    undo_clear();
+    if(undo_stack) free_caps(undo_stack);
+    if(redo_stack) free_caps(redo_stack);
+    undo_stack = NULL;
+    redo_stack = NULL;
+    undo_cap = 0;
     // this is usually the case because the TFB is restored after deinit 
     //if(mc != fc) dbg("mc %d fc %d\n", mc, fc);
 }
@@ -0,0 +1,179 @@
+// editor_search.c
+// Plain searches run Boyer-Moore-Horspool straight over the document's spans (the two sides of the
+// gap, or file pages for a big file), so nothing is copied. Only the few windows that straddle two
+// spans are checked a byte at a time. Regex searches go a line at a time.
+
+#include "editor_search.h"
+#include "editor_text.h"
+#include "polyfills.h"
+#include <string.h>
+
+static uint8_t matches_at(uint32_t pos, const char * pattern, uint32_t m) {
+    for(uint32_t i=0;i<m;i++) if(editor_text_at(pos + i) != pattern[i]) return 0;
+    return 1;
+}
+
+static uint32_t find_plain(const char * pattern, uint32_t from, uint32_t to) {
+    uint32_t m = strlen(pattern);
+    if(m == 0) return EDITOR_SEARCH_NONE;
+    // How far the window can move when its last byte is c
+    uint32_t skip[256];
+    for(uint16_t c=0;c<256;c++) skip[c] = m;
+    for(uint32_t i=0;i+1<m;i++) skip[(uint8_t)pattern[i]] = m - 1 - i;
+    uint8_t last = (uint8_t)pattern[m-1];
+
+    uint32_t pos = from;
+    while(pos < to && to - pos >= m) {
+        const char * s;
+        uint32_t n = editor_text_span(pos, &s);
+        if(n == 0) break;
+        if(n > to - pos) n = to - pos;
+        uint32_t i = 0;
+        while(i + m <= n) {
+            uint8_t c = (uint8_t)s[i + m - 1];
+            if(c == last && memcmp(s + i, pattern, m - 1) == 0) return pos + i;
+            i += skip[c];
+        }
+        // Windows that start in this span but end in the next one
+        for(;i<n && to - (pos + i) >= m;i++) {
+            if(matches_at(pos + i, pattern, m)) return pos + i;
+        }
+        pos += (i > n) ? i : n;
+    }
+    return EDITOR_SEARCH_NONE;
+}
+
+static uint32_t find_regex(const char * re, uint32_t from, uint32_t to, uint32_t * len) {
+    uint32_t total = editor_text_length();
+    if(from >= total || from >= to) return EDITOR_SEARCH_NONE;
+    char * line_text = NULL;
+    uint32_t line_cap = 0;
+    uint32_t found = EDITOR_SEARCH_NONE;
+    uint32_t line = editor_text_line_of(from);
+    while(editor_text_has_line(line)) {
+        uint32_t start = editor_text_line_start(line);
+        if(start >= to) break;
+        uint32_t line_len = editor_text_line_len(line);
+        if(line_len + 1 > line_cap) {
+            if(line_text) free_caps(line_text);
+            line_cap = line_len + 256;
+            line_text = (char*)malloc_caps_tag(line_cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+            if(line_text == NULL) break;
+        }
+        editor_text_copy(start, line_len, line_text);
+        uint32_t match_len;
+        int32_t at = editor_regex_find(re, line_text, line_len, (from > start) ? from - start : 0, &match_len);
+        if(at >= 0 && start + at < to) {
+            found = start + at;
+            *len = match_len;
+            break;
+        }
+        line++;
+    }
+    if(line_text) free_caps(line_text);
+    return found;
+}
+
+uint32_t editor_search_next(const char * pattern, uint8_t regex, uint32_t from, uint32_t to, uint32_t * len) {
+    if(regex) return find_regex(pattern, from, to, len);
+    *len = strlen(pattern);
+    return find_plain(pattern, from, to);
+}
+
+
+// Length of the atom at the start of re
+static uint32_t atom_len(const char * re) {
+    if(re[0] == '\\' && re[1]) return 2;
+    if(re[0] == '[') {
+        uint32_t i = 1;
+        if(re[i] == '^') i++;
+        if(re[i] == ']') i++; // a ] first is literal
+        while(re[i] && re[i] != ']') {
+            if(re[i] == '\\' && re[i+1]) i++;
+            i++;
+        }
+        if(re[i] == ']') return i + 1;
+        // No closing ], so just a [
+    }
+    return 1;
+}
+
+static uint8_t class_matches(char e, char c) {
+    switch(e) {
+        case 'd': return c >= '0' && c <= '9';
+        case 'D': return !(c >= '0' && c <= '9');
+        case 'w': return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c == '_';
+        case 'W': return !((c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c == '_');
+        case 's': return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+        case 'S': return !(c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v');
+        case 't': return c == '\t';
+        default: return c == e;
+    }
+}
+
+static uint8_t atom_matches(const char * re, uint32_t alen, char c) {
+    if(alen == 1) return re[0] == '.' || re[0] == c;
+    if(re[0] == '\\') return class_matches(re[1], c);
+    // [...]
+    uint32_t i = 1;
+    uint8_t negate = 0;
+    if(re[i] == '^') { negate = 1; i++; }
+    uint8_t hit = 0;
+    uint32_t end = alen - 1;
+    while(i < end) {
+        if(re[i] == '\\' && i + 1 < end) {
+            if(class_matches(re[i+1], c)) hit = 1;
+            i += 2;
+        } else if(i + 2 < end && re[i+1] == '-') {
+            if((uint8_t)c >= (uint8_t)re[i] && (uint8_t)c <= (uint8_t)re[i+2]) hit = 1;
+            i += 3;
+        } else {
+            if(re[i] == c) hit = 1;
+            i++;
+        }
+    }
+    return hit != negate;
+}
+
+// Matches re at pos, returning where the match ends or -1. Quantifiers are greedy and back off.
+static int32_t match_here(const char * re, const char * text, uint32_t pos, uint32_t len) {
+    if(re[0] == 0) return pos;
+    if(re[0] == '$' && re[1] == 0) return (pos == len) ? (int32_t)pos : -1;
+    uint32_t a = atom_len(re);
+    char q = re[a];
+    if(q == '*' || q == '+' || q == '?') {
+        uint32_t most = 0;
+        while(pos + most < len && atom_matches(re, a, text[pos + most])) {
+            most++;
+            if(q == '?') break;
+        }
+        uint32_t least = (q == '+') ? 1 : 0;
+        for(int32_t k=most;k>=(int32_t)least;k--) {
+            int32_t end = match_here(re + a + 1, text, pos + k, len);
+            if(end >= 0) return end;
+        }
+        return -1;
+    }
+    if(pos < len && atom_matches(re, a, text[pos])) return match_here(re + a, text, pos + 1, len);
+    return -1;
+}
+
+int32_t editor_regex_find(const char * re, const char * text, uint32_t len, uint32_t start, uint32_t * match_len) {
+    if(re[0] == '^') {
+        if(start > 0) return -1;
+        int32_t end = match_here(re + 1, text, 0, len);
+        if(end > 0) {
+            *match_len = end;
+            return 0;
+        }
+        return -1;
+    }
+    for(uint32_t p=start;p<len;p++) {
+        int32_t end = match_here(re, text, p, len);
+        if(end > (int32_t)p) {
+            *match_len = end - p;
+            return p;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,19 @@
+// editor_search.h
+// Finding text in the editor's document: Boyer-Moore-Horspool for plain strings, a small regex for the rest
+#ifndef EDITOR_SEARCH_H
+#define EDITOR_SEARCH_H
+
+#include <stdint.h>
+
+#define EDITOR_SEARCH_NONE 0xFFFFFFFF
+
+// First match that starts in [from, to), or EDITOR_SEARCH_NONE. Sets *len to its length.
+// Plain matches must also end by to. Regex matches stay within a line and are never empty.
+uint32_t editor_search_next(const char * pattern, uint8_t regex, uint32_t from, uint32_t to, uint32_t * len);
+
+// Regex on one piece of text: literals, . [abc] [a-z] [^abc] \d \w \s (and \D \W \S), \ escapes,
+// * + ? after any of those, and ^ $ anchors. Returns the offset of the first non-empty match at or
+// after start, or -1, and sets *len.
+int32_t editor_regex_find(const char * re, const char * text, uint32_t len, uint32_t start, uint32_t * match_len);
+
+#endif
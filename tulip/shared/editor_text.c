@@ -0,0 +1,474 @@
+// editor_text.c
+// Text lives in one buffer with a gap at the last edit, so typing, newlines and pastes only move the
+// bytes between the old edit and the new one. Line starts live in a second gap buffer, split at the
+// same place while editing: starts before the split are stored as offsets from the start of the
+// document, starts after it as offsets from the end. An insert or delete at the gap leaves both kinds
+// where they are, so only the lines it adds or removes are touched.
+//
+// A big file is opened lazily: the document is file[0, head) + the buffer + file[tail, end), and only
+// the part that has been edited is in RAM. The rest is read through a few cached pages, and its lines
+// are indexed as far as the editor has looked. Editing outside the buffer pulls the file bytes in
+// between into it.
+
+#include "editor_text.h"
+#include "polyfills.h"
+#include "tulip_helpers.h"
+
+char * et_text = NULL;
+uint32_t et_cap = 0;
+uint32_t et_gap = 0;
+uint32_t et_gap_end = 0;
+
+uint32_t * et_starts = NULL;
+uint32_t et_starts_cap = 0;
+uint32_t et_lgap = 0;
+uint32_t et_lgap_end = 0;
+
+// Lazy file backing. All 0 when the whole document is in the buffer
+uint8_t et_lazy = 0;
+char et_path[EDITOR_TEXT_PATH_LEN];
+uint32_t et_file_len = 0;
+uint32_t et_head = 0;
+uint32_t et_tail = 0;
+uint32_t et_scanned = 0;
+
+typedef struct {
+    char * data;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t used;
+} et_page_t;
+et_page_t et_pages[EDITOR_TEXT_PAGES];
+uint32_t et_page_tick = 0;
+// Set when file_span couldn't give the real bytes, so a save can tell
+uint8_t et_read_failed = 0;
+
+MP_REGISTER_ROOT_POINTER(mp_obj_t editor_text_file);
+
+static void * et_malloc(uint32_t size) {
+    return malloc_caps_tag(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+}
+
+static void close_backing() {
+    if(MP_STATE_VM(editor_text_file) != MP_OBJ_NULL) tulip_fclose(MP_STATE_VM(editor_text_file));
+    MP_STATE_VM(editor_text_file) = MP_OBJ_NULL;
+    for(uint8_t i=0;i<EDITOR_TEXT_PAGES;i++) {
+        if(et_pages[i].data) free_caps(et_pages[i].data);
+        et_pages[i].data = NULL;
+    }
+    et_lazy = 0;
+    et_file_len = et_head = et_tail = et_scanned = 0;
+}
+
+void editor_text_free() {
+    close_backing();
+    if(et_text) free_caps(et_text);
+    if(et_starts) free_caps(et_starts);
+    et_text = NULL;
+    et_starts = NULL;
+    et_cap = et_gap = et_gap_end = 0;
+    et_starts_cap = et_lgap = et_lgap_end = 0;
+}
+
+uint8_t editor_text_init(uint32_t cap) {
+    editor_text_free();
+    et_cap = cap + EDITOR_TEXT_GAP;
+    et_text = (char*)et_malloc(et_cap);
+    et_starts_cap = EDITOR_TEXT_LINE_GAP;
+    et_starts = (uint32_t*)et_malloc(et_starts_cap * sizeof(uint32_t));
+    if(et_text == NULL || et_starts == NULL) {
+        editor_text_free();
+        return 0;
+    }
+    et_gap = 0;
+    et_gap_end = et_cap;
+    // Line 0 always starts at 0
+    et_starts[0] = 0;
+    et_lgap = 1;
+    et_lgap_end = et_starts_cap;
+    return 1;
+}
+
+static uint32_t buffer_len() {
+    return et_cap - (et_gap_end - et_gap);
+}
+
+uint32_t editor_text_length() {
+    return et_head + buffer_len() + (et_file_len - et_tail);
+}
+
+uint8_t editor_text_complete() {
+    return et_scanned >= et_file_len;
+}
+
+uint32_t editor_text_lines() {
+    return et_lgap + (et_starts_cap - et_lgap_end);
+}
+
+// Reads file[offset, offset+len) of the backing file, one page at a time. Returns a pointer to at
+// least one byte and sets *len to how many are there
+static const char * file_span(uint32_t offset, uint32_t * len) {
+    et_page_t * page = NULL;
+    uint32_t base = offset - (offset % EDITOR_TEXT_PAGE_SIZE);
+    for(uint8_t i=0;i<EDITOR_TEXT_PAGES;i++) {
+        if(et_pages[i].data && et_pages[i].offset == base) { page = &et_pages[i]; break; }
+    }
+    if(page == NULL) {
+        // Reuse the least recently used page
+        page = &et_pages[0];
+        for(uint8_t i=1;i<EDITOR_TEXT_PAGES;i++) if(et_pages[i].used < page->used) page = &et_pages[i];
+        if(page->data == NULL) page->data = (char*)et_malloc(EDITOR_TEXT_PAGE_SIZE);
+        page->offset = base;
+        page->len = 0;
+        if(page->data) {
+            tulip_fseek(MP_STATE_VM(editor_text_file), base, SEEK_SET);
+            page->len = tulip_fread(MP_STATE_VM(editor_text_file), (uint8_t*)page->data, EDITOR_TEXT_PAGE_SIZE);
+        }
+    }
+    page->used = ++et_page_tick;
+    uint32_t in_page = offset - base;
+    if(in_page >= page->len) {
+        // Short read, or out of memory for the page. Show spaces rather than garbage
+        static char blank = ' ';
+        et_read_failed = 1;
+        *len = 1;
+        return &blank;
+    }
+    if(*len > page->len - in_page) *len = page->len - in_page;
+    return page->data + in_page;
+}
+
+uint32_t editor_text_span(uint32_t pos, const char ** out) {
+    uint32_t mid = buffer_len();
+    uint32_t len;
+    if(pos < et_head) {
+        len = et_head - pos;
+        *out = file_span(pos, &len);
+    } else if(pos < et_head + mid) {
+        uint32_t b = pos - et_head;
+        if(b < et_gap) {
+            len = et_gap - b;
+            *out = et_text + b;
+        } else {
+            len = mid - b;
+            *out = et_text + b + (et_gap_end - et_gap);
+        }
+    } else if(pos < editor_text_length()) {
+        uint32_t f = et_tail + (pos - et_head - mid);
+        len = et_file_len - f;
+        *out = file_span(f, &len);
+    } else {
+        len = 0;
+        *out = NULL;
+    }
+    return len;
+}
+
+char editor_text_at(uint32_t pos) {
+    uint32_t b = pos - et_head;
+    if(pos >= et_head && b < buffer_len()) return et_text[b < et_gap ? b : b + (et_gap_end - et_gap)];
+    const char * s;
+    if(editor_text_span(pos, &s) == 0) return 0;
+    return s[0];
+}
+
+uint32_t editor_text_copy(uint32_t pos, uint32_t len, char * out) {
+    uint32_t total = editor_text_length();
+    if(pos >= total) return 0;
+    if(len > total - pos) len = total - pos;
+    uint32_t done = 0;
+    while(done < len) {
+        const char * s;
+        uint32_t n = editor_text_span(pos + done, &s);
+        if(n > len - done) n = len - done;
+        memcpy(out + done, s, n);
+        done += n;
+    }
+    return len;
+}
+
+static uint8_t grow_lines(uint32_t need) {
+    if(et_lgap_end - et_lgap >= need) return 1;
+    uint32_t after = et_starts_cap - et_lgap_end;
+    uint32_t new_cap = et_starts_cap + need + (et_starts_cap / 2 > EDITOR_TEXT_LINE_GAP ? et_starts_cap / 2 : EDITOR_TEXT_LINE_GAP);
+    uint32_t * s = (uint32_t*)realloc_caps_tag(et_starts, new_cap * sizeof(uint32_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+    if(s == NULL) return 0;
+    memmove(s + new_cap - after, s + et_lgap_end, after * sizeof(uint32_t));
+    et_starts = s;
+    et_lgap_end = new_cap - after;
+    et_starts_cap = new_cap;
+    return 1;
+}
+
+// Document offset up to which lines are known
+static uint32_t indexed_end() {
+    return editor_text_length() - (et_file_len - et_scanned);
+}
+
+static void move_line_gap(uint32_t pos);
+
+// Indexes the lines of the next chunk of the backing file. The split of the line index only has to
+// be at the text gap while editing, so it is moved past the indexed lines first and the new ones
+// go on the end of the lower half.
+static uint8_t scan_more() {
+    if(editor_text_complete()) return 0;
+    char * chunk = (char*)et_malloc(EDITOR_TEXT_SCAN_SIZE);
+    if(chunk == NULL) return 0;
+    tulip_fseek(MP_STATE_VM(editor_text_file), et_scanned, SEEK_SET);
+    uint32_t n = tulip_fread(MP_STATE_VM(editor_text_file), (uint8_t*)chunk, EDITOR_TEXT_SCAN_SIZE);
+    if(n == 0) {
+        // The file got shorter under us, stop here
+        et_scanned = et_file_len;
+        free_caps(chunk);
+        return 0;
+    }
+    if(n > et_file_len - et_scanned) n = et_file_len - et_scanned;
+    uint32_t found = 0;
+    for(uint32_t i=0;i<n;i++) if(chunk[i] == '\n') found++;
+    if(!grow_lines(found)) {
+        free_caps(chunk);
+        return 0;
+    }
+    uint32_t start = indexed_end();
+    move_line_gap(start);
+    for(uint32_t i=0;i<n;i++) if(chunk[i] == '\n') et_starts[et_lgap++] = start + i + 1;
+    et_scanned += n;
+    free_caps(chunk);
+    return 1;
+}
+
+uint8_t editor_text_has_line(uint32_t line) {
+    while(line >= editor_text_lines() && scan_more());
+    return line < editor_text_lines();
+}
+
+static void scan_to(uint32_t pos) {
+    while(pos >= indexed_end() && scan_more());
+}
+
+uint32_t editor_text_line_start(uint32_t line) {
+    if(line < et_lgap) return et_starts[line];
+    return editor_text_length() - et_starts[et_lgap_end + (line - et_lgap)];
+}
+
+uint32_t editor_text_line_len(uint32_t line) {
+    // The end of the last known line may not be scanned yet
+    while(line + 1 >= editor_text_lines() && scan_more());
+    uint32_t start = editor_text_line_start(line);
+    uint32_t end = (line + 1 < editor_text_lines()) ? editor_text_line_start(line + 1) - 1 : editor_text_length();
+    return end - start;
+}
+
+uint32_t editor_text_line_of(uint32_t pos) {
+    scan_to(pos);
+    uint32_t lo = 0;
+    uint32_t hi = editor_text_lines() - 1;
+    while(lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if(editor_text_line_start(mid) <= pos) lo = mid; else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Moves the split of the line index to pos (a document offset)
+static void move_line_gap(uint32_t pos) {
+    uint32_t total = editor_text_length();
+    // Lines that now start after the gap are counted from the end instead
+    while(et_lgap > 1 && et_starts[et_lgap - 1] > pos) {
+        et_lgap--;
+        et_lgap_end--;
+        et_starts[et_lgap_end] = total - et_starts[et_lgap];
+    }
+    while(et_lgap_end < et_starts_cap && total - et_starts[et_lgap_end] <= pos) {
+        et_starts[et_lgap] = total - et_starts[et_lgap_end];
+        et_lgap++;
+        et_lgap_end++;
+    }
+}
+
+// Moves the text gap to pos, which has to be inside the buffer
+static void move_gap(uint32_t pos) {
+    uint32_t b = pos - et_head;
+    if(b < et_gap) {
+        uint32_t n = et_gap - b;
+        memmove(et_text + et_gap_end - n, et_text + b, n);
+        et_gap = b;
+        et_gap_end -= n;
+    } else if(b > et_gap) {
+        uint32_t n = b - et_gap;
+        memmove(et_text + et_gap, et_text + et_gap_end, n);
+        et_gap += n;
+        et_gap_end += n;
+    }
+    move_line_gap(pos);
+}
+
+// Makes the text gap at least need bytes, growing by half again so a long paste isn't quadratic
+static uint8_t grow_text(uint32_t need) {
+    if(et_gap_end - et_gap >= need) return 1;
+    uint32_t after = et_cap - et_gap_end;
+    uint32_t new_cap = et_cap + need + (et_cap / 2 > EDITOR_TEXT_GAP ? et_cap / 2 : EDITOR_TEXT_GAP);
+    char * t = (char*)realloc_caps_tag(et_text, new_cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+    if(t == NULL) return 0;
+    memmove(t + new_cap - after, t + et_gap_end, after);
+    et_text = t;
+    et_gap_end = new_cap - after;
+    et_cap = new_cap;
+    return 1;
+}
+
+// Pulls the file bytes around the buffer into it until it covers [pos, end)
+static uint8_t take_in(uint32_t pos, uint32_t end) {
+    if(pos < et_head) {
+        uint32_t n = et_head - pos;
+        move_gap(et_head);
+        if(!grow_text(n)) return 0;
+        // The bytes go in front of the gap, which stays at the same document offset
+        uint32_t done = 0;
+        while(done < n) {
+            uint32_t len = n - done;
+            const char * s = file_span(pos + done, &len);
+            memcpy(et_text + done, s, len);
+            done += len;
+        }
+        et_gap = n;
+        et_head = pos;
+    }
+    uint32_t mid_end = et_head + buffer_len();
+    if(end > mid_end) {
+        uint32_t n = end - mid_end;
+        scan_to(end);
+        move_gap(mid_end);
+        if(!grow_text(n)) return 0;
+        uint32_t done = 0;
+        while(done < n) {
+            uint32_t len = n - done;
+            const char * s = file_span(et_tail + done, &len);
+            memcpy(et_text + et_gap + done, s, len);
+            done += len;
+        }
+        et_gap += n;
+        et_tail += n;
+        // The gap moved forward over lines that were after it
+        move_line_gap(mid_end + n);
+    }
+    return 1;
+}
+
+uint8_t editor_text_insert(uint32_t pos, const char * s, uint32_t len) {
+    if(pos > editor_text_length()) pos = editor_text_length();
+    uint32_t newlines = 0;
+    for(uint32_t i=0;i<len;i++) if(s[i] == '\n') newlines++;
+    // Lines are only indexed up to what the editor has seen, and it can only edit there
+    scan_to(pos);
+    if(!take_in(pos, pos) || !grow_text(len) || !grow_lines(newlines)) return 0;
+    move_gap(pos);
+    memcpy(et_text + et_gap, s, len);
+    // New lines start inside the inserted text, so before the gap once it moves past it
+    for(uint32_t i=0;i<len;i++) if(s[i] == '\n') et_starts[et_lgap++] = pos + i + 1;
+    et_gap += len;
+    return 1;
+}
+
+uint8_t editor_text_delete(uint32_t pos, uint32_t len) {
+    uint32_t total = editor_text_length();
+    if(pos >= total) return 1;
+    if(len > total - pos) len = total - pos;
+    scan_to(pos + len);
+    if(!take_in(pos, pos + len)) return 0;
+    move_gap(pos);
+    // Drop the lines whose '\n' is going
+    while(et_lgap_end < et_starts_cap && total - et_starts[et_lgap_end] <= pos + len) et_lgap_end++;
+    et_gap_end += len;
+    return 1;
+}
+
+uint8_t editor_text_open(const char * filename) {
+    int32_t fs = file_size(filename);
+    if(fs < EDITOR_TEXT_LAZY_SIZE) {
+        if(!editor_text_init(fs > 0 ? fs : 0)) return 0;
+        if(fs <= 0) return 1;
+        // Read straight into the buffer, in front of the gap
+        et_gap = read_file(filename, (uint8_t*)et_text, fs, 0);
+        uint32_t found = 0;
+        for(uint32_t i=0;i<et_gap;i++) if(et_text[i] == '\n') found++;
+        if(!grow_lines(found)) return 0;
+        for(uint32_t i=0;i<et_gap;i++) if(et_text[i] == '\n') et_starts[et_lgap++] = i + 1;
+        return 1;
+    }
+    if(strlen(filename) >= EDITOR_TEXT_PATH_LEN || !editor_text_init(0)) return 0;
+    strcpy(et_path, filename);
+    MP_STATE_VM(editor_text_file) = tulip_fopen(filename, "rb");
+    et_lazy = 1;
+    et_file_len = fs;
+    // Enough for the first screen, the rest is indexed as it is looked at
+    scan_more();
+    return 1;
+}
+
+// Writes the document out in spans, without putting it together first. Returns 0 if a write comes up
+// short or part of the backing file couldn't be read
+static uint8_t write_spans(mp_obj_t file) {
+    uint32_t total = editor_text_length();
+    uint32_t pos = 0;
+    et_read_failed = 0;
+    while(pos < total) {
+        const char * s;
+        uint32_t n = editor_text_span(pos, &s);
+        if(n == 0 || et_read_failed) return 0;
+        uint32_t done = 0;
+        while(done < n) {
+            uint32_t wrote = tulip_fwrite(file, (uint8_t*)s + done, n - done);
+            if(wrote == 0 || wrote > n - done) return 0;
+            done += wrote;
+        }
+        pos += n;
+    }
+    return 1;
+}
+
+uint8_t editor_text_save(const char * filename, uint8_t final_newline) {
+    uint32_t total = editor_text_length();
+    // Only in the file: putting it in the document would pull a lazy file's tail into memory
+    uint8_t add_newline = final_newline && total && editor_text_at(total - 1) != '\n';
+    // Always to a new file first, so a failed save leaves the old one as it was
+    if(strlen(filename) >= EDITOR_TEXT_PATH_LEN) return 0;
+    char tmp[EDITOR_TEXT_PATH_LEN + 4];
+    strcpy(tmp, filename);
+    strcat(tmp, ".tmp");
+    mp_obj_t tmp_obj = mp_obj_new_str(tmp, strlen(tmp));
+    mp_obj_t file_obj = mp_obj_new_str(filename, strlen(filename));
+    mp_obj_t file = tulip_fopen(tmp, "w");
+    uint8_t ok = write_spans(file);
+    if(ok && add_newline) ok = tulip_fwrite(file, (uint8_t*)"\n", 1) == 1;
+    tulip_fclose(file);
+    if(!ok) {
+        mp_vfs_remove(tmp_obj);
+        return 0;
+    }
+    uint8_t reopen = et_lazy && strcmp(filename, et_path) == 0;
+    // The file we are saving over may be the one we are reading from, so let go of it before the swap
+    uint32_t scanned = reopen ? indexed_end() : 0;
+    if(reopen) close_backing();
+    if(file_exists(filename)) mp_vfs_remove(file_obj);
+    mp_vfs_rename(tmp_obj, file_obj);
+    if(!reopen) return 1;
+
+    // Now the whole document is on disk again. Its length and line starts are unchanged, and an added
+    // newline stays past the end of it, as it isn't in the document
+    MP_STATE_VM(editor_text_file) = tulip_fopen(filename, "rb");
+    et_lazy = 1;
+    et_file_len = total;
+    et_scanned = scanned;
+    et_head = et_tail = 0;
+    et_gap = 0;
+    et_gap_end = et_cap;
+    move_line_gap(0);
+    // Give back what the edits took
+    char * t = (char*)realloc_caps_tag(et_text, EDITOR_TEXT_GAP, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_EDITOR);
+    if(t) {
+        et_text = t;
+        et_cap = et_gap_end = EDITOR_TEXT_GAP;
+    }
+    return 1;
+}
@@ -0,0 +1,57 @@
+// editor_text.h
+// The editor's document: one gap buffer of text plus a gap buffer of line starts
+#ifndef EDITOR_TEXT_H
+#define EDITOR_TEXT_H
+
+#include <stdint.h>
+
+// Room left for typing when a buffer is (re)allocated, and the smallest line index
+#define EDITOR_TEXT_GAP 4096
+#define EDITOR_TEXT_LINE_GAP 256
+
+// Files this big or bigger stay on disk and are paged in as they are shown
+#ifdef __EMSCRIPTEN__
+// No seeking on web, so always read the whole file
+#define EDITOR_TEXT_LAZY_SIZE INT32_MAX
+#else
+#define EDITOR_TEXT_LAZY_SIZE (256*1024)
+#endif
+#define EDITOR_TEXT_PAGES 8
+#define EDITOR_TEXT_PAGE_SIZE 4096
+// How much of the file is read at a time to find lines
+#define EDITOR_TEXT_SCAN_SIZE (64*1024)
+#define EDITOR_TEXT_PATH_LEN 256
+
+// Empties the document, keeping room for at least cap bytes. Returns 0 if out of memory.
+uint8_t editor_text_init(uint32_t cap);
+// Makes the document the contents of filename, lazily if it is big. Returns 0 if out of memory.
+uint8_t editor_text_open(const char * filename);
+void editor_text_free();
+
+uint32_t editor_text_length();
+// Lines known so far. All of them once editor_text_complete() is 1
+uint32_t editor_text_lines();
+uint8_t editor_text_complete();
+// Indexes as far as needed to know if line exists
+uint8_t editor_text_has_line(uint32_t line);
+// Offset of the first character of line, and its length without the '\n'
+uint32_t editor_text_line_start(uint32_t line);
+uint32_t editor_text_line_len(uint32_t line);
+// The line an offset is on
+uint32_t editor_text_line_of(uint32_t pos);
+char editor_text_at(uint32_t pos);
+// Copies len bytes from pos to out (no terminator). Returns how many were copied.
+uint32_t editor_text_copy(uint32_t pos, uint32_t len, char * out);
+// Points out at the run of bytes that starts at pos and returns its length, 0 at the end
+uint32_t editor_text_span(uint32_t pos, const char ** out);
+
+// Both return 0 if out of memory, leaving the document as it was
+uint8_t editor_text_insert(uint32_t pos, const char * s, uint32_t len);
+uint8_t editor_text_delete(uint32_t pos, uint32_t len);
+
+// Writes the document to filename a span at a time, through filename.tmp, adding a last '\n' if
+// final_newline and missing. Returns 0, with filename untouched and the .tmp gone, if any of it
+// can't be read or written
+uint8_t editor_text_save(const char * filename, uint8_t final_newline);
+
+#endif
@@ -78,7 +78,7 @@ static void* lodepng_malloc(size_t size) {
 //  if(size > LODEPNG_MAX_ALLOC) return 0;
 //#endif
   if(size==0) return NULL; 
-  void* thing = malloc_caps(size,  MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  void* thing = malloc_caps_tag(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_PNG);
   if(thing==NULL) {
     printf("lodepng problem with malloc sz %" PRIu32 "\n", (uint32_t)size);
   } else {
@@ -90,7 +90,7 @@ static void* lodepng_malloc(size_t size) {
 
 /* NOTE: when realloc returns NULL, it leaves the original memory untouched */
 static void* lodepng_realloc(void* ptr, size_t new_size) {
-  return realloc_caps(ptr, new_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  return realloc_caps_tag(ptr, new_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_PNG);
 }
 
 static void lodepng_free(void* ptr) {
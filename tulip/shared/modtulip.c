@@ -10,11 +10,20 @@
 #include "bresenham.h"
 #include "extmod/vfs.h"
 #include "py/stream.h"
+#include "py/objlist.h"
 #ifndef __EMSCRIPTEN__
 #include "alles.h"
+#include "audio_stats.h"
+#include "alles_peers.h"
+#include "alles_reliable.h"
+#endif
+#ifdef TULIP_DESKTOP
+#include "alles_sim.h"
+#include "mmap_file.h"
 #endif
 #include "midi.h"
 #include "tsequencer.h"
+#include "async_load.h"
 #include "ui.h"
 #include "keyscan.h"
 #include "genhdr/mpversion.h"
@@ -25,6 +34,22 @@
 #endif
 
 
+// Raw data passed in as bytes, or on desktop a tulip.mmap, which is used where it is with no copy
+STATIC uint8_t get_data_buffer(mp_obj_t obj, mp_buffer_info_t *bufinfo) {
+    const mp_obj_type_t *type = mp_obj_get_type(obj);
+    #ifdef TULIP_DESKTOP
+    if(type == &tulip_mmap_type) {
+        mp_get_buffer_raise(obj, bufinfo, MP_BUFFER_READ);
+        return 1;
+    }
+    #endif
+    if(type == &mp_type_bytes) {
+        mp_get_buffer(obj, bufinfo, MP_BUFFER_READ);
+        return 1;
+    }
+    return 0;
+}
+
 // Graphics
 
 // tulip.display_clock(18)
@@ -188,8 +213,7 @@ STATIC mp_obj_t tulip_bg_bitmap(size_t n_args, const mp_obj_t *args) {
     if(n_args == 5) {
         // Set the rect with bitmap pixels
         mp_buffer_info_t bufinfo;
-        if (mp_obj_get_type(args[4]) == &mp_type_bytes) {
-            mp_get_buffer(args[4], &bufinfo, MP_BUFFER_READ);
+        if (get_data_buffer(args[4], &bufinfo)) {
             display_set_bg_bitmap_raw(x, y, w, h, (uint8_t*)bufinfo.buf);
         }
         return mp_const_none; 
@@ -235,13 +259,11 @@ STATIC mp_obj_t tulip_bg_png(size_t n_args, const mp_obj_t *args) {
 
     mp_buffer_info_t bufinfo;
     uint8_t file = 0;
-    if (mp_obj_get_type(args[0]) == &mp_type_bytes) {
-        mp_get_buffer(args[0], &bufinfo, MP_BUFFER_READ);
-    } else {
-        uint32_t fs = file_size(mp_obj_str_get_str(args[0]));
-        bufinfo.buf = malloc_caps(fs, MALLOC_CAP_SPIRAM);
+    if (!get_data_buffer(args[0], &bufinfo)) {
+        uint32_t fs;
+        bufinfo.buf = read_file_alloc(mp_obj_str_get_str(args[0]), &fs, MALLOC_CAP_SPIRAM);
+        if(bufinfo.buf == NULL) mp_raise_OSError(MP_ENOMEM);
         bufinfo.len = fs;
-        read_file(mp_obj_str_get_str(args[0]), (uint8_t *)bufinfo.buf, -1, 1);
         file = 1;
     }
     error = lodepng_decode_memory(&image, &width, &height, (uint8_t*)bufinfo.buf, bufinfo.len, LCT_RGBA, 8);
@@ -455,70 +477,87 @@ STATIC mp_obj_t tulip_midi_callback(size_t n_args, const mp_obj_t *args) {
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_midi_callback_obj, 1, 1, tulip_midi_callback);
 
 
+// handle = tulip.defer(cb, arg, ms)
 STATIC mp_obj_t tulip_defer(size_t n_args, const mp_obj_t *args) {
-    int8_t index = -1;
-    for(uint8_t slot=0;slot<DEFER_SLOTS;slot++) {
-        if(defer_callbacks[slot]==NULL) {
-            index = slot; slot = DEFER_SLOTS+1;
-        }
-    }
-    if(index>=0) {
-        defer_callbacks[index] = args[0];
-        defer_args[index] = args[1];
-        defer_sysclock[index] = get_ticks_ms() + mp_obj_get_int(args[2]);
-
-    } else {
+    int32_t handle = tsequencer_add_defer(args[0], args[1], mp_obj_get_int(args[2]));
+    if(handle < 0) {
         mp_raise_ValueError(MP_ERROR_TEXT("No more defer slots available"));
     }
-    return mp_const_none;
+    return mp_obj_new_int(handle);
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_defer_obj, 3, 3, tulip_defer);
 
 
-
+// handle = tulip.seq_add_callback(cb, [divider], [phase])
 STATIC mp_obj_t tulip_seq_add_callback(size_t n_args, const mp_obj_t *args) {
-    int8_t index = -1;
-    for(uint8_t slot=0;slot<SEQUENCER_SLOTS;slot++) {
-        if(sequencer_callbacks[slot]==NULL) {
-            index = slot; slot = SEQUENCER_SLOTS+1;
-        }
+    uint32_t divider = AMY_SEQUENCER_PPQ;
+    uint32_t phase = 0;
+    if(n_args > 1) divider = mp_obj_get_int(args[1]);
+    if(n_args > 2) phase = mp_obj_get_int(args[2]);
+    return mp_obj_new_int(tsequencer_add_periodic(args[0], divider, phase));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_add_callback_obj, 1, 3, tulip_seq_add_callback);
+
+// handle = tulip.seq_defer(cb, arg, ticks) -- one-shot, `ticks` sequencer ticks from now
+STATIC mp_obj_t tulip_seq_defer(size_t n_args, const mp_obj_t *args) {
+    int32_t handle = tsequencer_add_oneshot(args[0], args[1], mp_obj_get_int(args[2]));
+    if(handle < 0) {
+        mp_raise_ValueError(MP_ERROR_TEXT("No more sequencer slots available"));
     }
-    if(index>=0) {
-        sequencer_callbacks[index] = args[0];
-        if(n_args == 2) {
-            sequencer_dividers[index] = mp_obj_get_int(args[1]);
-        } else {
-            sequencer_dividers[index] = AMY_SEQUENCER_PPQ;            
-        }
-    } else {
-        index = -1;
-    }
-    return mp_obj_new_int(index);
+    return mp_obj_new_int(handle);
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_add_callback_obj, 1, 2, tulip_seq_add_callback);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_defer_obj, 3, 3, tulip_seq_defer);
 
+// tulip.seq_remove_callback(handle) / tulip.cancel(handle) -- works for any seq or defer handle
 STATIC mp_obj_t tulip_seq_remove_callback(size_t n_args, const mp_obj_t *args) {
-    int8_t index = mp_obj_get_int(args[0]);
-    if(index>=0 && index <SEQUENCER_SLOTS) {
-        sequencer_callbacks[index] = NULL;
-        sequencer_dividers[index] = 0;
-    }
-    return mp_const_none;
+    return mp_obj_new_bool(tsequencer_cancel(mp_obj_get_int(args[0])));
 }
 
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_remove_callback_obj, 1, 1, tulip_seq_remove_callback);
 
 STATIC mp_obj_t tulip_seq_remove_callbacks(size_t n_args, const mp_obj_t *args) {
-    for(uint8_t i=0;i<SEQUENCER_SLOTS;i++) {
-        sequencer_callbacks[i] = NULL;
-        sequencer_dividers[i] = 0;
-    }
+    tsequencer_cancel_ticks();
     return mp_const_none;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_remove_callbacks_obj, 0, 0, tulip_seq_remove_callbacks);
 
 
 
+#ifndef AMY_IS_EXTERNAL
+extern uint8_t mesh_flag;
+#define SEQ_TRACK_MESH_WARNING "Warning: pattern tracks play on this Tulip only and are silent in mesh mode\n"
+
+// tulip.seq_track(track, length, divider) -- create or resize a C-side pattern track
+STATIC mp_obj_t tulip_seq_track(size_t n_args, const mp_obj_t *args) {
+    if(mesh_flag) mp_printf(&mp_plat_print, SEQ_TRACK_MESH_WARNING);
+    uint16_t divider = AMY_SEQUENCER_PPQ / 4;
+    if(n_args > 2) divider = mp_obj_get_int(args[2]);
+    if(tsequencer_track_set(mp_obj_get_int(args[0]), mp_obj_get_int(args[1]), divider) < 0) {
+        mp_raise_ValueError(MP_ERROR_TEXT("Bad track, length or divider"));
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_track_obj, 2, 3, tulip_seq_track);
+
+// tulip.seq_track_step(track, step, "v0n60l1") / tulip.seq_track_step(track, step, None) for a rest
+STATIC mp_obj_t tulip_seq_track_step(size_t n_args, const mp_obj_t *args) {
+    char * message = NULL;
+    if(args[2] != mp_const_none) message = (char*)mp_obj_str_get_str(args[2]);
+    if(tsequencer_track_step(mp_obj_get_int(args[0]), mp_obj_get_int(args[1]), message) < 0) {
+        mp_raise_ValueError(MP_ERROR_TEXT("Bad track or step"));
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_track_step_obj, 3, 3, tulip_seq_track_step);
+
+// tulip.seq_track_clear(track)
+STATIC mp_obj_t tulip_seq_track_clear(size_t n_args, const mp_obj_t *args) {
+    tsequencer_track_clear(mp_obj_get_int(args[0]));
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_seq_track_clear_obj, 1, 1, tulip_seq_track_clear);
+#endif
+
 STATIC mp_obj_t tulip_seq_ticks(size_t n_args, const mp_obj_t *args) {
     return mp_obj_new_int(sequencer_tick_count);
 }
@@ -604,15 +643,14 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_midi_in_obj, 0, 0, tulip_midi_i
 
 
 STATIC mp_obj_t tulip_midi_out(size_t n_args, const mp_obj_t *args) {
-    if(mp_obj_get_type(args[0]) == &mp_type_bytes) {
-        mp_buffer_info_t bufinfo;
-        mp_get_buffer(args[0], &bufinfo, MP_BUFFER_READ);
+    mp_buffer_info_t bufinfo;
+    if(get_data_buffer(args[0], &bufinfo)) {
         midi_out((uint8_t*)bufinfo.buf, bufinfo.len);
     } else {
         mp_obj_t *items;
         size_t len;
         mp_obj_get_array(args[0], &len, &items);
-        uint8_t *b = malloc_caps(len, MALLOC_CAP_INTERNAL);
+        uint8_t *b = malloc_caps_tag(len, MALLOC_CAP_INTERNAL, MEM_TAG_MIDI);
         for(uint16_t i=0;i<(uint16_t)len;i++) {
             b[i] = mp_obj_get_int(items[i]);
         }
@@ -627,15 +665,14 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_midi_out_obj, 1, 1, tulip_midi_
 
 // Send a message on the "local bus", as if it was received from physical midi in
 STATIC mp_obj_t tulip_midi_local(size_t n_args, const mp_obj_t *args) {
-    if(mp_obj_get_type(args[0]) == &mp_type_bytes) {
-        mp_buffer_info_t bufinfo;
-        mp_get_buffer(args[0], &bufinfo, MP_BUFFER_READ);
+    mp_buffer_info_t bufinfo;
+    if(get_data_buffer(args[0], &bufinfo)) {
         midi_local((uint8_t*)bufinfo.buf, bufinfo.len);
     } else {
         mp_obj_t *items;
         size_t len;
         mp_obj_get_array(args[0], &len, &items);
-        uint8_t *b = malloc_caps(len, MALLOC_CAP_INTERNAL);
+        uint8_t *b = malloc_caps_tag(len, MALLOC_CAP_INTERNAL, MEM_TAG_MIDI);
         for(uint16_t i=0;i<(uint16_t)len;i++) {
             b[i] = mp_obj_get_int(items[i]);
         }
@@ -657,13 +694,11 @@ STATIC mp_obj_t tulip_sprite_png(size_t n_args, const mp_obj_t *args) {
     uint16_t mem_pos = mp_obj_get_int(args[1]);
     mp_buffer_info_t bufinfo;
     uint8_t file = 0;
-    if (mp_obj_get_type(args[0]) == &mp_type_bytes) {
-        mp_get_buffer(args[0], &bufinfo, MP_BUFFER_READ);
-    } else {
-        uint32_t fs = file_size(mp_obj_str_get_str(args[0]));
-        bufinfo.buf = malloc_caps(fs, MALLOC_CAP_SPIRAM);
+    if (!get_data_buffer(args[0], &bufinfo)) {
+        uint32_t fs;
+        bufinfo.buf = read_file_alloc(mp_obj_str_get_str(args[0]), &fs, MALLOC_CAP_SPIRAM);
+        if(bufinfo.buf == NULL) mp_raise_OSError(MP_ENOMEM);
         bufinfo.len = fs;
-        read_file(mp_obj_str_get_str(args[0]), (uint8_t *)bufinfo.buf, -1, 1);
         file = 1;
     }
     error = lodepng_decode_memory(&image, &width, &height, (uint8_t*)bufinfo.buf, bufinfo.len, LCT_RGBA, 8);
@@ -680,14 +715,74 @@ STATIC mp_obj_t tulip_sprite_png(size_t n_args, const mp_obj_t *args) {
 
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_sprite_png_obj, 2, 2, tulip_sprite_png);
 
+// tulip.read_lines(filename, [count]) gives the file's lines as a list of str, without their \n or \r\n.
+// Only the first count if given. Lines can be any length.
+STATIC mp_obj_t tulip_read_lines(size_t n_args, const mp_obj_t *args) {
+    const char *filename = mp_obj_str_get_str(args[0]);
+    int32_t count = n_args > 1 ? mp_obj_get_int(args[1]) : -1;
+    tulip_reader_t r;
+    if(!tulip_reader_open(&r, filename)) mp_raise_OSError(file_exists(filename) ? MP_ENOMEM : MP_ENOENT);
+    mp_obj_t list = mp_const_none;
+    nlr_buf_t nlr;
+    // The reader's buffers are ours to free, even if making the list runs out of heap
+    if(nlr_push(&nlr) == 0) {
+        list = mp_obj_new_list(0, NULL);
+        char *line;
+        int32_t len = 0;
+        while(count != 0 && (len = tulip_reader_line(&r, &line)) >= 0) {
+            mp_obj_list_append(list, mp_obj_new_str(line, len));
+            if(count > 0) count--;
+        }
+        if(len == -2) mp_raise_OSError(MP_ENOMEM);
+        nlr_pop();
+    } else {
+        tulip_reader_close(&r);
+        nlr_jump(nlr.ret_val);
+    }
+    tulip_reader_close(&r);
+    return list;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_read_lines_obj, 1, 2, tulip_read_lines);
+
+// tulip.load_async(path, kind, callback) reads and decodes in the background, then calls callback(result).
+// kind "bytes" gives the file, "png" gives (w, h, bitmap), "wav" gives (rate, channels, pcm16). None if it fails
+STATIC mp_obj_t tulip_load_async(size_t n_args, const mp_obj_t *args) {
+    const char *kind_name = mp_obj_str_get_str(args[1]);
+    uint8_t kind;
+    if(!strcmp(kind_name, "bytes")) {
+        kind = ASYNC_LOAD_BYTES;
+    } else if(!strcmp(kind_name, "png")) {
+        kind = ASYNC_LOAD_PNG;
+    } else if(!strcmp(kind_name, "wav")) {
+        kind = ASYNC_LOAD_WAV;
+    } else {
+        mp_raise_ValueError(MP_ERROR_TEXT("kind must be bytes, png or wav"));
+    }
+    if(!async_load_start(mp_obj_str_get_str(args[0]), kind, args[2])) {
+        mp_raise_ValueError(MP_ERROR_TEXT("No more load slots available"));
+    }
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_load_async_obj, 3, 3, tulip_load_async);
+
+#ifdef TULIP_DESKTOP
+// m = tulip.mmap("samples.wav") maps a file read-only. Pass it anywhere bytes go, m.close() when done
+STATIC mp_obj_t tulip_mmap(size_t n_args, const mp_obj_t *args) {
+    return mmap_file_open(mp_obj_str_get_str(args[0]));
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_mmap_obj, 1, 1, tulip_mmap);
+#endif
+
 
 //bytes = sprite_bitmap(bitmap, mem_pos) 
 //buffer_of_bytes = sprite_bitmap(mem_pos, length)
 STATIC mp_obj_t tulip_sprite_bitmap(size_t n_args, const mp_obj_t *args) {
-    if (mp_obj_get_type(args[0]) == &mp_type_bytes) {
+    mp_buffer_info_t bufinfo;
+    if (get_data_buffer(args[0], &bufinfo)) {
         uint16_t mem_pos = mp_obj_get_int(args[1]);
-        mp_buffer_info_t bufinfo;
-        mp_get_buffer(args[0], &bufinfo, MP_BUFFER_READ);
         display_load_sprite_raw(mem_pos, bufinfo.len, bufinfo.buf);
         return mp_obj_new_int(bufinfo.len);
     } 
@@ -791,19 +886,21 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_collisions_obj, 0, 0, tulip_col
 
 
 
-extern void editor_start(const char * filename);
+extern uint8_t editor_start(const char * filename);
 extern void editor_activate();
 extern void editor_key(int c); 
 extern void editor_deinit();
 
 
+// Returns False if the editor couldn't start (out of memory), and there's nothing to edit
 STATIC mp_obj_t tulip_run_editor(size_t n_args, const mp_obj_t *args) {
+    uint8_t ok;
     if(n_args) {
-        editor_start(mp_obj_str_get_str(args[0]));
+        ok = editor_start(mp_obj_str_get_str(args[0]));
     } else {
-        editor_start(NULL);
+        ok = editor_start(NULL);
     }
-    return mp_const_none;
+    return mp_obj_new_bool(ok);
 }
 
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_run_editor_obj, 0, 1, tulip_run_editor);
@@ -862,10 +959,59 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_int_screenshot_obj, 1, 1, tulip
 
 extern void mcast_send(char*, uint16_t len);
 #ifndef __EMSCRIPTEN__
+// Sends everything queued for the mesh now, rather than on the next sequencer tick
+STATIC mp_obj_t tulip_alles_flush(size_t n_args, const mp_obj_t *args) {
+    alles_mesh_flush();
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_flush_obj, 0, 1, tulip_alles_flush);
+
+// Runs while reliable messages are outstanding, resending and retiring them
+STATIC mp_obj_t tulip_alles_retransmit(size_t n_args, const mp_obj_t *args) {
+    uint32_t ms = alles_reliable_service();
+    if(ms) tsequencer_add_defer(args[0], args[0], ms);
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_retransmit_obj, 1, 1, tulip_alles_retransmit);
+
+// (pending, retransmits, failures) for the reliable mesh channel
+STATIC mp_obj_t tulip_alles_reliable(size_t n_args, const mp_obj_t *args) {
+    mp_obj_t tuple[3];
+    tuple[0] = mp_obj_new_int(alles_reliable_pending());
+    tuple[1] = mp_obj_new_int(alles_reliable_retransmits);
+    tuple[2] = mp_obj_new_int(alles_reliable_failures);
+    return mp_obj_new_tuple(3, tuple);
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_reliable_obj, 0, 0, tulip_alles_reliable);
+
+// tulip.alles_send(message, mesh, [tries], [idempotent]). More than one try on the mesh goes over the
+// reliable channel. idempotent lets it be repeated blind to nodes that can't ack.
 STATIC mp_obj_t tulip_alles_send(size_t n_args, const mp_obj_t *args) {
     if(n_args > 1) {
+        if(mp_obj_get_int(args[1]) && n_args > 2 && mp_obj_get_int(args[2]) > 1) {
+            const char * message = mp_obj_str_get_str(args[0]);
+            uint8_t idempotent = (n_args > 3) ? mp_obj_is_true(args[3]) : 0;
+            // Keep it in order with anything already queued
+            alles_mesh_flush();
+            int8_t r = alles_reliable_send((char*)message, strlen(message), mp_obj_get_int(args[2]), idempotent);
+            if(r < 0) {
+                // Retire whatever has been acked since the last timer and try once more
+                alles_reliable_service();
+                r = alles_reliable_send((char*)message, strlen(message), mp_obj_get_int(args[2]), idempotent);
+            }
+            if(r < 0) mp_raise_ValueError(MP_ERROR_TEXT("Reliable mesh window is full"));
+            if(r == 1) {
+                mp_obj_t retransmit = MP_OBJ_FROM_PTR(&tulip_alles_retransmit_obj);
+                tsequencer_add_defer(retransmit, retransmit, ALLES_RELIABLE_MIN_RTO_MS);
+            }
+            return mp_const_none;
+        }
         if(mp_obj_get_int(args[1])) { // mesh
-            mcast_send( (char*)mp_obj_str_get_str(args[0]), strlen(mp_obj_str_get_str(args[0])));
+            // Messages sent in the same tick go out together on the next one
+            alles_mesh_queue((char*)mp_obj_str_get_str(args[0]), strlen(mp_obj_str_get_str(args[0])));
             return mp_const_none;
         }
     }
@@ -873,7 +1019,7 @@ STATIC mp_obj_t tulip_alles_send(size_t n_args, const mp_obj_t *args) {
     return mp_const_none;
 }
 
-STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_send_obj, 1, 2, tulip_alles_send);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_send_obj, 1, 4, tulip_alles_send);
 
 extern char * alles_local_ip;
 STATIC mp_obj_t tulip_multicast_start(size_t n_args, const mp_obj_t *args) {
@@ -882,6 +1028,9 @@ STATIC mp_obj_t tulip_multicast_start(size_t n_args, const mp_obj_t *args) {
         strcpy(alles_local_ip, local_ip);
     }
     alles_init_multicast();
+    #ifndef AMY_IS_EXTERNAL
+    if(tsequencer_tracks_active()) mp_printf(&mp_plat_print, SEQ_TRACK_MESH_WARNING);
+    #endif
     return mp_const_none;
 
 }
@@ -889,28 +1038,186 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_multicast_start_obj, 1, 1, tuli
 
 
 
-extern uint8_t alive;
-extern int16_t client_id;
-extern int32_t clocks[255];
-extern int32_t ping_times[255];
+extern uint8_t mesh_wire_version;
+extern uint8_t mesh_wire_wanted;
 
-STATIC mp_obj_t tulip_alles_map(size_t n_args, const mp_obj_t *args) {
+// tulip.alles_wire(1) asks for the binary mesh format, used once every live node advertises it.
+// Returns the version in use right now, 0 is ASCII.
+STATIC mp_obj_t tulip_alles_wire(size_t n_args, const mp_obj_t *args) {
+    if(n_args > 0) {
+        mesh_wire_wanted = mp_obj_get_int(args[0]) ? 1 : 0;
+        if(!mesh_wire_wanted) mesh_wire_version = 0;
+    }
+    return mp_obj_new_int(mesh_wire_version);
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_wire_obj, 0, 1, tulip_alles_wire);
+
+// Sends a sync request, every node answers and refines our estimate of its clock
+STATIC mp_obj_t tulip_alles_sync(size_t n_args, const mp_obj_t *args) {
+    alles_sync_request();
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_sync_obj, 0, 1, tulip_alles_sync);
+
+// Smallest safe mesh latency in ms, or 0 if some live node isn't synced yet
+STATIC mp_obj_t tulip_alles_latency(size_t n_args, const mp_obj_t *args) {
+    return mp_obj_new_int(alles_sync_latency_ms());
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_latency_obj, 0, 0, tulip_alles_latency);
+
+// tulip.alles_node_time(client, ms) -> ms, our clock converted to that node's
+STATIC mp_obj_t tulip_alles_node_time(size_t n_args, const mp_obj_t *args) {
+    return mp_obj_new_int(alles_sync_node_time(mp_obj_get_int(args[0]), mp_obj_get_int(args[1])));
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_node_time_obj, 2, 2, tulip_alles_node_time);
+
+// Live peers, oldest node first, or NULL if there are none. Sized to the peers there are now, not
+// ALLES_MAX_PEERS. Free with m_del(alles_peer_info_t, peers, *allocated).
+STATIC alles_peer_info_t * alles_peers_get(uint8_t *count, uint8_t *allocated) {
+    alles_peers_expire(amy_sysclock());
+    *count = 0;
+    *allocated = alles_peer_count;
+    if(!*allocated) return NULL;
+    alles_peer_info_t *peers = m_new(alles_peer_info_t, *allocated);
+    // Peers that turned up since are left for next time
+    *count = alles_peers_snapshot(peers, *allocated);
+    return peers;
+}
+
+// [(ipv4, client, offset_ms, drift_ppm, rtt_ms, jitter_ms), ...] for every node we've synced with
+STATIC mp_obj_t tulip_alles_clocks(size_t n_args, const mp_obj_t *args) {
+    uint8_t count, allocated;
+    alles_peer_info_t *peers = alles_peers_get(&count, &allocated);
     mp_obj_t list = mp_obj_new_list(0, NULL);
-    for(uint8_t i=0;i<255;i++) {
-        mp_obj_t tuple[3];
-        if(clocks[i]>0) {
-            tuple[0] = mp_obj_new_int(i);
-            tuple[1] = mp_obj_new_int(clocks[i]);
-            tuple[2] = mp_obj_new_int(ping_times[i]);
-            mp_obj_list_append(list, mp_obj_new_tuple(3, tuple));
-        }
+    for(uint8_t i=0;i<count;i++) {
+        alles_peer_info_t *p = &peers[i];
+        if(!p->samples) continue;
+        mp_obj_t tuple[6];
+        tuple[0] = mp_obj_new_int(p->ipv4);
+        tuple[1] = mp_obj_new_int(p->client);
+        tuple[2] = mp_obj_new_float_from_f(p->offset_ms);
+        tuple[3] = mp_obj_new_float_from_f(p->drift * 1000000.0f);
+        tuple[4] = mp_obj_new_float_from_f(p->rtt_ms);
+        tuple[5] = mp_obj_new_float_from_f(p->jitter_ms);
+        mp_obj_list_append(list, mp_obj_new_tuple(6, tuple));
     }
-    // TODO - sort this so that client 0 is the earliest, etc. Maybe do the sort in python 
+    if(peers) m_del(alles_peer_info_t, peers, allocated);
     return list;
 }
 
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_clocks_obj, 0, 0, tulip_alles_clocks);
+
+// [(ipv4, clock, ping_time), ...] already sorted with the longest running node (client 0) first
+STATIC mp_obj_t tulip_alles_map(size_t n_args, const mp_obj_t *args) {
+    uint8_t count, allocated;
+    alles_peer_info_t *peers = alles_peers_get(&count, &allocated);
+    mp_obj_list_t *list = MP_OBJ_TO_PTR(mp_obj_new_list(count, NULL));
+    for(uint8_t i=0;i<count;i++) {
+        mp_obj_t tuple[3];
+        tuple[0] = mp_obj_new_int(peers[i].ipv4);
+        tuple[1] = mp_obj_new_int(peers[i].clock);
+        tuple[2] = mp_obj_new_int(peers[i].ping_time);
+        list->items[i] = mp_obj_new_tuple(3, tuple);
+    }
+    if(peers) m_del(alles_peer_info_t, peers, allocated);
+    return MP_OBJ_FROM_PTR(list);
+}
+
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_map_obj, 0, 0, tulip_alles_map);
 
+#ifdef TULIP_DESKTOP
+extern uint8_t mesh_flag;
+// tulip.alles_sim(nodes, latency_ms, jitter_ms, loss, [seed]) runs the mesh over virtual nodes instead of
+// the network. Has to come before the mesh starts. Returns False if the mesh is already running or the
+// simulator couldn't start.
+STATIC mp_obj_t tulip_alles_sim(size_t n_args, const mp_obj_t *args) {
+    if(mesh_flag) return mp_const_false;
+    alles_sim_config.nodes = mp_obj_get_int(args[0]);
+    alles_sim_config.latency_ms = mp_obj_get_int(args[1]);
+    alles_sim_config.jitter_ms = mp_obj_get_int(args[2]);
+    alles_sim_config.loss = mp_obj_get_float(args[3]);
+    if(n_args > 4) alles_sim_config.seed = mp_obj_get_int(args[4]);
+    if(alles_sim_config.nodes < 1) alles_sim_config.nodes = 1;
+    alles_init_multicast();
+    return mp_obj_new_bool(mesh_flag);
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_sim_obj, 4, 5, tulip_alles_sim);
+
+// tulip.alles_stop() leaves the mesh, real or simulated, and closes its socket
+STATIC mp_obj_t tulip_alles_stop(size_t n_args, const mp_obj_t *args) {
+    alles_stop_multicast();
+    return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_stop_obj, 0, 0, tulip_alles_stop);
+
+// What the virtual nodes saw: datagrams sent, dropped and delivered, event latency, reliable
+// deliveries and repeats, and how far our clock estimates are from their real clocks
+STATIC mp_obj_t tulip_alles_sim_stats(size_t n_args, const mp_obj_t *args) {
+    alles_sim_stats_t stats;
+    alles_sim_get_stats(&stats);
+    mp_obj_t dict = mp_obj_new_dict(0);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_sent), mp_obj_new_int(stats.sent));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_dropped), mp_obj_new_int(stats.dropped));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_delivered), mp_obj_new_int(stats.delivered));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_events), mp_obj_new_int(stats.events));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_latency_ms), mp_obj_new_float_from_f(stats.latency_ms));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_max_latency_ms), mp_obj_new_float_from_f(stats.max_latency_ms));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_reliable), mp_obj_new_int(stats.reliable));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_duplicates), mp_obj_new_int(stats.duplicates));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_synced), mp_obj_new_int(stats.synced));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_sync_error_ms), mp_obj_new_float_from_f(stats.sync_error_ms));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_max_sync_error_ms), mp_obj_new_float_from_f(stats.max_sync_error_ms));
+    return dict;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_alles_sim_stats_obj, 0, 0, tulip_alles_sim_stats);
+#endif
+
+STATIC mp_obj_t audio_stats_hist(const uint32_t *hist) {
+    mp_obj_t items[AUDIO_STATS_HIST_BUCKETS];
+    for(uint8_t i=0;i<AUDIO_STATS_HIST_BUCKETS;i++) items[i] = mp_obj_new_int(hist[i]);
+    return mp_obj_new_list(AUDIO_STATS_HIST_BUCKETS, items);
+}
+
+// Render time, utilization, under/overruns and voice counts for the AMY audio path
+// stats = tulip.audio_stats()
+// stats = tulip.audio_stats(1) # and reset the counters after reading
+STATIC mp_obj_t tulip_audio_stats(size_t n_args, const mp_obj_t *args) {
+    float elapsed_us = (float)(get_time_us() - audio_stats.since_us);
+    if(elapsed_us <= 0) elapsed_us = 1;
+    mp_obj_t dict = mp_obj_new_dict(0);
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_blocks), mp_obj_new_int(audio_stats.block.blocks));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_budget_us), mp_obj_new_int(audio_stats.budget_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_render_us), mp_obj_new_int(audio_stats.block.last_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_max_us), mp_obj_new_int(audio_stats.block.max_us));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_hist), audio_stats_hist(audio_stats.block.hist));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_underruns), mp_obj_new_int(audio_stats.underruns));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_overruns), mp_obj_new_int(audio_stats.overruns));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_voices), mp_obj_new_int(audio_stats.voices));
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_max_voices), mp_obj_new_int(audio_stats.max_voices));
+    mp_obj_t cores = mp_obj_new_list(0, NULL);
+    for(uint8_t i=0;i<audio_stats.ncores;i++) {
+        audio_stats_core_t *c = &audio_stats.cores[i];
+        mp_obj_t core = mp_obj_new_dict(0);
+        mp_obj_dict_store(core, MP_OBJ_NEW_QSTR(MP_QSTR_utilization), mp_obj_new_float_from_f((float)c->busy_us / elapsed_us));
+        mp_obj_dict_store(core, MP_OBJ_NEW_QSTR(MP_QSTR_render_us), mp_obj_new_int(c->last_us));
+        mp_obj_dict_store(core, MP_OBJ_NEW_QSTR(MP_QSTR_max_us), mp_obj_new_int(c->max_us));
+        mp_obj_dict_store(core, MP_OBJ_NEW_QSTR(MP_QSTR_hist), audio_stats_hist(c->hist));
+        mp_obj_list_append(cores, core);
+    }
+    mp_obj_dict_store(dict, MP_OBJ_NEW_QSTR(MP_QSTR_cores), cores);
+    if(n_args > 0 && mp_obj_is_true(args[0])) audio_stats_reset();
+    return dict;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_audio_stats_obj, 0, 1, tulip_audio_stats);
+
 extern uint8_t ipv4_quartet;
 STATIC mp_obj_t tulip_set_quartet(size_t n_args, const mp_obj_t *args) {
     ipv4_quartet = mp_obj_get_int(args[0]);
@@ -1080,6 +1387,32 @@ STATIC mp_obj_t tulip_cpu(size_t n_args, const mp_obj_t *args) {
 
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_cpu_obj, 0, 1, tulip_cpu);
 
+STATIC mp_obj_t mem_stats_tuple(mem_tag_stats_t *st, uint8_t where) {
+    mp_obj_t items[3] = {
+        mp_obj_new_int(st->bytes[where]),
+        mp_obj_new_int(st->peak[where]),
+        mp_obj_new_int(st->count[where]),
+    };
+    return mp_obj_new_tuple(3, items);
+}
+
+// {tag: {"spiram": (bytes, peak, blocks), "internal": (bytes, peak, blocks)}}
+STATIC mp_obj_t tulip_mem_stats(size_t n_args, const mp_obj_t *args) {
+    mp_obj_t dict = mp_obj_new_dict(0);
+    for(uint8_t tag=0;tag<MEM_TAGS;tag++) {
+        mem_tag_stats_t st;
+        mem_tag_stats(tag, &st);
+        mp_obj_t entry = mp_obj_new_dict(0);
+        mp_obj_dict_store(entry, MP_OBJ_NEW_QSTR(MP_QSTR_spiram), mem_stats_tuple(&st, MEM_SPIRAM));
+        mp_obj_dict_store(entry, MP_OBJ_NEW_QSTR(MP_QSTR_internal), mem_stats_tuple(&st, MEM_INTERNAL));
+        const char *name = mem_tag_name(tag);
+        mp_obj_dict_store(dict, mp_obj_new_str(name, strlen(name)), entry);
+    }
+    return dict;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(tulip_mem_stats_obj, 0, 0, tulip_mem_stats);
+
 #ifndef ESP_PLATFORM
 #ifndef __linux__
 #ifndef __EMSCRIPTEN__
@@ -1292,6 +1625,13 @@ STATIC const mp_rom_map_elem_t tulip_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_seq_add_callback), MP_ROM_PTR(&tulip_seq_add_callback_obj) },
     { MP_ROM_QSTR(MP_QSTR_seq_remove_callback), MP_ROM_PTR(&tulip_seq_remove_callback_obj) },
     { MP_ROM_QSTR(MP_QSTR_seq_remove_callbacks), MP_ROM_PTR(&tulip_seq_remove_callbacks_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seq_defer), MP_ROM_PTR(&tulip_seq_defer_obj) },
+    { MP_ROM_QSTR(MP_QSTR_cancel), MP_ROM_PTR(&tulip_seq_remove_callback_obj) },
+#ifndef AMY_IS_EXTERNAL
+    { MP_ROM_QSTR(MP_QSTR_seq_track), MP_ROM_PTR(&tulip_seq_track_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seq_track_step), MP_ROM_PTR(&tulip_seq_track_step_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seq_track_clear), MP_ROM_PTR(&tulip_seq_track_clear_obj) },
+#endif
     { MP_ROM_QSTR(MP_QSTR_midi_callback), MP_ROM_PTR(&tulip_midi_callback_obj) },
     { MP_ROM_QSTR(MP_QSTR_seq_ticks), MP_ROM_PTR(&tulip_seq_ticks_obj) },
     { MP_ROM_QSTR(MP_QSTR_midi_in), MP_ROM_PTR(&tulip_midi_in_obj) },
@@ -1300,6 +1640,11 @@ STATIC const mp_rom_map_elem_t tulip_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_bg_bitmap), MP_ROM_PTR(&tulip_bg_bitmap_obj) },
     { MP_ROM_QSTR(MP_QSTR_bg_blit), MP_ROM_PTR(&tulip_bg_blit_obj) },
     { MP_ROM_QSTR(MP_QSTR_sprite_png), MP_ROM_PTR(&tulip_sprite_png_obj) },
+    { MP_ROM_QSTR(MP_QSTR_load_async), MP_ROM_PTR(&tulip_load_async_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read_lines), MP_ROM_PTR(&tulip_read_lines_obj) },
+#ifdef TULIP_DESKTOP
+    { MP_ROM_QSTR(MP_QSTR_mmap), MP_ROM_PTR(&tulip_mmap_obj) },
+#endif
     { MP_ROM_QSTR(MP_QSTR_sprite_bitmap), MP_ROM_PTR(&tulip_sprite_bitmap_obj) },
     { MP_ROM_QSTR(MP_QSTR_sprite_register), MP_ROM_PTR(&tulip_sprite_register_obj) },
     { MP_ROM_QSTR(MP_QSTR_sprite_move), MP_ROM_PTR(&tulip_sprite_move_obj) },
@@ -1315,8 +1660,21 @@ STATIC const mp_rom_map_elem_t tulip_module_globals_table[] = {
 #ifndef __EMSCRIPTEN__
     { MP_ROM_QSTR(MP_QSTR_multicast_start), MP_ROM_PTR(&tulip_multicast_start_obj) },
     { MP_ROM_QSTR(MP_QSTR_alles_send), MP_ROM_PTR(&tulip_alles_send_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_flush), MP_ROM_PTR(&tulip_alles_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_reliable), MP_ROM_PTR(&tulip_alles_reliable_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_wire), MP_ROM_PTR(&tulip_alles_wire_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_sync), MP_ROM_PTR(&tulip_alles_sync_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_latency), MP_ROM_PTR(&tulip_alles_latency_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_node_time), MP_ROM_PTR(&tulip_alles_node_time_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_clocks), MP_ROM_PTR(&tulip_alles_clocks_obj) },
     { MP_ROM_QSTR(MP_QSTR_alles_map), MP_ROM_PTR(&tulip_alles_map_obj) },
+#ifdef TULIP_DESKTOP
+    { MP_ROM_QSTR(MP_QSTR_alles_sim), MP_ROM_PTR(&tulip_alles_sim_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_sim_stats), MP_ROM_PTR(&tulip_alles_sim_stats_obj) },
+    { MP_ROM_QSTR(MP_QSTR_alles_stop), MP_ROM_PTR(&tulip_alles_stop_obj) },
+#endif
     { MP_ROM_QSTR(MP_QSTR_set_quartet), MP_ROM_PTR(&tulip_set_quartet_obj) },
+    { MP_ROM_QSTR(MP_QSTR_audio_stats), MP_ROM_PTR(&tulip_audio_stats_obj) },
 #endif
     { MP_ROM_QSTR(MP_QSTR_brightness), MP_ROM_PTR(&tulip_brightness_obj) },
     { MP_ROM_QSTR(MP_QSTR_rgb332_565), MP_ROM_PTR(&tulip_rgb332_565_obj) },
@@ -1330,6 +1688,7 @@ STATIC const mp_rom_map_elem_t tulip_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_key_scan), MP_ROM_PTR(&tulip_key_scan_obj) },
     { MP_ROM_QSTR(MP_QSTR_key_send), MP_ROM_PTR(&tulip_key_send_obj) },
     { MP_ROM_QSTR(MP_QSTR_cpu), MP_ROM_PTR(&tulip_cpu_obj) },
+    { MP_ROM_QSTR(MP_QSTR_mem_stats), MP_ROM_PTR(&tulip_mem_stats_obj) },
     { MP_ROM_QSTR(MP_QSTR_gpu_reset), MP_ROM_PTR(&tulip_gpu_reset_obj) },
     { MP_ROM_QSTR(MP_QSTR_bg_circle), MP_ROM_PTR(&tulip_bg_circle_obj) },
     { MP_ROM_QSTR(MP_QSTR_bg_bezier), MP_ROM_PTR(&tulip_bg_bezier_obj) },
@@ -90,25 +90,274 @@ int32_t get_ticks_ms() {
 #endif
 }
 
-void *calloc_caps(uint32_t align, uint32_t count, uint32_t size, uint32_t flags) {
+// Allocation tracking. Each tagged block is in an open addressing table keyed by its pointer, so
+// free_caps can find what to take off, even for blocks freed by a different subsystem.
+#if defined ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+static portMUX_TYPE mem_mux = portMUX_INITIALIZER_UNLOCKED;
+#define MEM_LOCK() portENTER_CRITICAL_SAFE(&mem_mux)
+#define MEM_UNLOCK() portEXIT_CRITICAL_SAFE(&mem_mux)
+#elif defined __EMSCRIPTEN__
+#define MEM_LOCK()
+#define MEM_UNLOCK()
+#else
+#include <pthread.h>
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define MEM_LOCK() pthread_mutex_lock(&mem_mutex)
+#define MEM_UNLOCK() pthread_mutex_unlock(&mem_mutex)
+#endif
+
+typedef struct {
+    uintptr_t ptr; // 0 when empty
+    uint32_t size;
+    uint8_t tag;
+    uint8_t where;
+} mem_entry_t;
+
+static mem_entry_t *mem_table = NULL;
+static uint32_t mem_cap = 0;
+static uint32_t mem_used = 0;
+// While the table doubles, the previous one, and how far through it the move has got.
+// Slots before mem_old_pos are all empty.
+static mem_entry_t *mem_old = NULL;
+static uint32_t mem_old_cap = 0;
+static uint32_t mem_old_pos = 0;
+static mem_tag_stats_t mem_stats[MEM_TAGS];
+static const char *mem_tag_names[MEM_TAGS] = {"other", "display", "editor", "png", "midi", "sequencer", "alles", "files"};
+
+// The table itself isn't counted. Heap calls can't be made while holding the lock on the ESP
+static mem_entry_t *mem_table_alloc(uint32_t cap) {
+#ifdef ESP_PLATFORM
+    return heap_caps_calloc(cap, sizeof(mem_entry_t), MALLOC_CAP_SPIRAM);
+#else
+    return calloc(cap, sizeof(mem_entry_t));
+#endif
+}
+
+static void mem_table_free(mem_entry_t *table) {
+#ifdef ESP_PLATFORM
+    heap_caps_free(table);
+#else
+    free(table);
+#endif
+}
+
+static inline uint32_t mem_slot(uintptr_t ptr, uint32_t cap) {
+    return (uint32_t)((ptr >> 3) * 2654435761u) & (cap - 1);
+}
+
+// With the lock held: the slot ptr is in, or the empty one it would go in
+static uint32_t mem_find(mem_entry_t *table, uint32_t cap, uintptr_t ptr) {
+    uint32_t i = mem_slot(ptr, cap);
+    while(table[i].ptr && table[i].ptr != ptr) i = (i + 1) & (cap - 1);
+    return i;
+}
+
+// With the lock held: empties slot i, shifting back any entries that probed past it
+static void mem_unlink(mem_entry_t *table, uint32_t cap, uint32_t i) {
+    uint32_t j = i;
+    while(1) {
+        table[i].ptr = 0;
+        while(1) {
+            j = (j + 1) & (cap - 1);
+            if(table[j].ptr == 0) return;
+            uint32_t home = mem_slot(table[j].ptr, cap);
+            // Stays put if its home is cyclically in (i, j]
+            if((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) continue;
+            break;
+        }
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+// With the lock held: stops counting the entry at slot i
+static void mem_remove_at(mem_entry_t *table, uint32_t cap, uint32_t i) {
+    mem_entry_t *e = &table[i];
+    mem_tag_stats_t *st = &mem_stats[e->tag];
+    st->bytes[e->where] -= e->size;
+    st->count[e->where]--;
+    mem_used--;
+    mem_unlink(table, cap, i);
+}
+
+// With the lock held: finds ptr in either table. Returns its table, or NULL with *i where it would go
+static mem_entry_t *mem_lookup(uintptr_t ptr, uint32_t *i, uint32_t *cap) {
+    if(mem_old) {
+        uint32_t j = mem_find(mem_old, mem_old_cap, ptr);
+        if(mem_old[j].ptr) {
+            *i = j;
+            *cap = mem_old_cap;
+            return mem_old;
+        }
+    }
+    *i = mem_find(mem_table, mem_cap, ptr);
+    *cap = mem_cap;
+    return mem_table[*i].ptr ? mem_table : NULL;
+}
+
+// With the lock held: moves up to slots slots of the old table into the new one. Returns the old
+// table once it's empty, for freeing after the lock is let go
+static mem_entry_t *mem_move(uint32_t slots) {
+    while(mem_old && slots--) {
+        if(mem_old_pos == mem_old_cap) {
+            mem_entry_t *done = mem_old;
+            mem_old = NULL;
+            mem_old_cap = mem_old_pos = 0;
+            return done;
+        }
+        mem_entry_t *e = &mem_old[mem_old_pos];
+        if(!e->ptr) {
+            mem_old_pos++;
+            continue;
+        }
+        // The unlink can shift another entry into this slot, so it's looked at again
+        mem_table[mem_find(mem_table, mem_cap, e->ptr)] = *e;
+        mem_unlink(mem_old, mem_old_cap, mem_old_pos);
+    }
+    return NULL;
+}
+
+static void mem_track(void *ptr, uint32_t size, uint8_t tag) {
+    if(ptr == NULL) return;
+    mem_entry_t *spare = NULL;
+    while(1) {
+        MEM_LOCK();
+        mem_entry_t *done = mem_move(MEM_TABLE_MOVE_STEP);
+        if(done) spare = done;
+        if(mem_used + 1 <= mem_cap / 2) break;
+        // Full again before the last move was done. At this step it can't be, but finish it if so
+        if(mem_old) {
+            spare = mem_move(UINT32_MAX);
+            break;
+        }
+        uint32_t cap = mem_cap ? mem_cap * 2 : MEM_TABLE_INITIAL;
+        MEM_UNLOCK();
+        if(spare) mem_table_free(spare);
+        mem_entry_t *grown = mem_table_alloc(cap);
+        // Out of memory: this one just isn't counted
+        if(grown == NULL) return;
+        MEM_LOCK();
+        spare = grown;
+        if(cap > mem_cap && mem_old == NULL) {
+            // Entries move over a few at a time from here on, rather than all at once with the lock held
+            mem_old = mem_table;
+            mem_old_cap = mem_cap;
+            mem_old_pos = 0;
+            mem_table = grown;
+            mem_cap = cap;
+            spare = NULL;
+        }
+        MEM_UNLOCK();
+        if(spare) mem_table_free(spare);
+        spare = NULL;
+    }
+    uint32_t i, cap;
+    mem_entry_t *table = mem_lookup((uintptr_t)ptr, &i, &cap);
+    // Still here if it was let go some other way and the address came round again
+    if(table) {
+        mem_remove_at(table, cap, i);
+        i = mem_find(mem_table, mem_cap, (uintptr_t)ptr);
+    }
+    mem_entry_t *e = &mem_table[i];
+    e->ptr = (uintptr_t)ptr;
+    e->size = size;
+    e->tag = (tag < MEM_TAGS) ? tag : MEM_TAG_OTHER;
+#ifdef ESP_PLATFORM
+    e->where = esp_ptr_external_ram(ptr) ? MEM_SPIRAM : MEM_INTERNAL;
+#else
+    e->where = MEM_INTERNAL;
+#endif
+    mem_used++;
+    mem_tag_stats_t *st = &mem_stats[e->tag];
+    st->bytes[e->where] += size;
+    st->count[e->where]++;
+    if(st->bytes[e->where] > st->peak[e->where]) st->peak[e->where] = st->bytes[e->where];
+    MEM_UNLOCK();
+    if(spare) mem_table_free(spare);
+}
+
+// Stops counting ptr, returning the tag (and size) it had, or -1 if it wasn't tracked
+static int16_t mem_untrack(void *ptr, uint32_t *size) {
+    if(ptr == NULL) return -1;
+    int16_t tag = -1;
+    MEM_LOCK();
+    if(mem_cap) {
+        uint32_t i, cap;
+        mem_entry_t *table = mem_lookup((uintptr_t)ptr, &i, &cap);
+        if(table) {
+            tag = table[i].tag;
+            if(size) *size = table[i].size;
+            mem_remove_at(table, cap, i);
+        }
+    }
+    MEM_UNLOCK();
+    return tag;
+}
+
+void mem_tag_stats(uint8_t tag, mem_tag_stats_t *out) {
+    MEM_LOCK();
+    *out = mem_stats[tag];
+    MEM_UNLOCK();
+}
+
+const char * mem_tag_name(uint8_t tag) {
+    return mem_tag_names[tag];
+}
+
+void * malloc_caps_tag(uint32_t size, uint32_t flags, uint8_t tag) {
+#ifdef ESP_PLATFORM
+    void *ptr = heap_caps_malloc(size, flags);
+#else
+    void *ptr = malloc(size);
+#endif
+    mem_track(ptr, size, tag);
+    return ptr;
+}
+
+void *calloc_caps_tag(uint32_t align, uint32_t count, uint32_t size, uint32_t flags, uint8_t tag) {
 #ifdef ESP_PLATFORM
     //if(flags & MALLOC_CAP_SPIRAM) fprintf(stderr, "spiram callocing count %ld size %ld flags %ld\n", count, size, flags);
-    return heap_caps_aligned_calloc(align, count, size, flags); 
+    void *ptr = heap_caps_aligned_calloc(align, count, size, flags); 
 #else
-    return (void*)malloc(size*count);
+    void *ptr = (void*)malloc(size*count);
 #endif
+    mem_track(ptr, size*count, tag);
+    return ptr;
 }
 
-void *realloc_caps(void* ptr, uint32_t size, uint32_t caps) {
+void *realloc_caps_tag(void* ptr, uint32_t size, uint32_t caps, uint8_t tag) {
+  // Taken off first, since once it's freed another thread can be handed the same address
+  uint32_t old_size = 0;
+  int16_t had = mem_untrack(ptr, &old_size);
+  if(had >= 0) tag = had;
 #ifdef ESP_PLATFORM
   //fprintf(stderr, "re-allocing size %ld flags %ld\n", size, caps);
-  return heap_caps_realloc(ptr, size, caps);
+  void *moved = heap_caps_realloc(ptr, size, caps);
 #else
-  return (void*)realloc(ptr, size);
+  void *moved = (void*)realloc(ptr, size);
 #endif
+  if(moved) {
+    mem_track(moved, size, tag);
+  } else if(size && had >= 0) {
+    // A failed realloc leaves the old block where it was
+    mem_track(ptr, old_size, tag);
+  }
+  return moved;
+}
+
+void *calloc_caps(uint32_t align, uint32_t count, uint32_t size, uint32_t flags) {
+    return calloc_caps_tag(align, count, size, flags, MEM_TAG_OTHER);
+}
+
+void *realloc_caps(void* ptr, uint32_t size, uint32_t caps) {
+    return realloc_caps_tag(ptr, size, caps, MEM_TAG_OTHER);
 }
 
 void free_caps(void *ptr) {
+    mem_untrack(ptr, NULL);
 #ifdef ESP_PLATFORM
     heap_caps_free(ptr);
 #else
@@ -27,6 +27,37 @@ void * malloc_caps(uint32_t size, uint32_t flags);
 void *calloc_caps(uint32_t align, uint32_t count, uint32_t size, uint32_t flags);
 void *realloc_caps(void* ptr, uint32_t size, uint32_t caps);
 void free_caps(void *ptr);
+
+// Tagged allocations are counted per subsystem, for tulip.mem_stats(). free_caps and realloc_caps
+// find the tag again from the pointer, and a realloc keeps the tag the block already had.
+#define MEM_TAG_OTHER 0
+#define MEM_TAG_DISPLAY 1
+#define MEM_TAG_EDITOR 2
+#define MEM_TAG_PNG 3
+#define MEM_TAG_MIDI 4
+#define MEM_TAG_SEQUENCER 5
+#define MEM_TAG_ALLES 6
+#define MEM_TAG_FILES 7
+#define MEM_TAGS 8
+// Where blocks ended up. Everything is internal off the ESP
+#define MEM_SPIRAM 0
+#define MEM_INTERNAL 1
+// Starting size of the table of tracked blocks, which doubles as it fills
+#define MEM_TABLE_INITIAL 256
+// Slots of the old table moved over per tracked allocation while it doubles, so the lock is never held for long
+#define MEM_TABLE_MOVE_STEP 16
+
+typedef struct {
+    uint32_t bytes[2]; // by MEM_SPIRAM / MEM_INTERNAL
+    uint32_t peak[2];
+    uint32_t count[2]; // blocks
+} mem_tag_stats_t;
+
+void * malloc_caps_tag(uint32_t size, uint32_t flags, uint8_t tag);
+void * calloc_caps_tag(uint32_t align, uint32_t count, uint32_t size, uint32_t flags, uint8_t tag);
+void * realloc_caps_tag(void *ptr, uint32_t size, uint32_t flags, uint8_t tag);
+void mem_tag_stats(uint8_t tag, mem_tag_stats_t *out);
+const char * mem_tag_name(uint8_t tag);
 float compute_cpu_usage(uint8_t debug);
 void delay_ms(uint32_t ms);
 void display_start();
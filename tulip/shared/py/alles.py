@@ -3,40 +3,103 @@ import struct, os, time, tulip, amy
 
 amy.insert_time = None
 mesh_flag = 0
+latency_ms = 1000
+sync_handle = None
 
-def send(retries=1, **kwargs):
+# retries > 1 sends over the reliable channel: acked by every node, resent up to retries times if not.
+# Use it for patch loads, resets and tempo changes, and leave notes on the fast unreliable path.
+# Nodes too old to ack can't drop repeats either, so they only get it once unless idempotent=True
+# says running it twice is harmless (a tempo or volume setting, not a reset or a note on).
+def send(retries=1, idempotent=False, **kwargs):
     global mesh_flag
+    if mesh_flag and kwargs.get('client') is not None:
+        # Sent to one node, so we can put the time on that node's own clock. alles_node_time leaves it
+        # on ours for nodes that convert it themselves.
+        if kwargs.get('time') is None and amy.insert_time is not None:
+            kwargs['time'] = amy.insert_time()
+        if kwargs.get('time') is not None:
+            kwargs['time'] = tulip.alles_node_time(kwargs['client'], kwargs['time'])
     m = amy.message(**kwargs)
-    tulip.alles_send(m, mesh_flag)
+    tulip.alles_send(m, mesh_flag, retries, idempotent)
 
 def map():
     if mesh_flag:
-        tmap = tulip.alles_map()
-        # Sort it by clock descending to get client #
-        tmap.sort(key=lambda x:x[1], reverse=True)
-        return tmap
+        # Already sorted longest running first, so the index is the client #
+        return tulip.alles_map()
     print("Need to be on wifi and mesh().")
     return None
 
-def mesh(local_ip=None):
-    global mesh_flag
-    if(tulip.ip() is None):
-        print("Need to be on wifi. Use tulip.wifi('ssid', 'password').")
+# Sync with every node, quickly at first so the clock estimates settle, then every couple of seconds
+# until stop_sync(). Once every live node is synced, drop the mesh latency to what the network needs.
+def sync(n=0):
+    global latency_ms, sync_handle
+    sync_handle = None
+    if not mesh_flag:
         return
-    amy.send(latency_ms=1000)
+    tulip.alles_sync()
+    l = tulip.alles_latency()
+    if l and abs(l - latency_ms) > 10:
+        latency_ms = l
+        amy.send(latency_ms=latency_ms)
+    sync_handle = tulip.defer(sync, n+1, 250 if n < 16 else 2000)
+
+def stop_sync():
+    global sync_handle
+    if sync_handle is not None:
+        tulip.cancel(sync_handle)
+        sync_handle = None
+
+def clocks():
+    return tulip.alles_clocks()
+
+def start_mesh(binary):
+    global mesh_flag
+    amy.send(latency_ms=latency_ms)
     # Explicitly send insert_time arg when using Alles.
     amy.insert_time = tulip.ticks_ms 
     mesh_flag = 1
+    # Binary only kicks in once every node on the mesh has said it understands it
+    tulip.alles_wire(1 if binary else 0)
+
+def mesh(local_ip=None, binary=False):
+    if(tulip.ip() is None):
+        print("Need to be on wifi. Use tulip.wifi('ssid', 'password').")
+        return
+    start_mesh(binary)
     if(local_ip is not None):
         tulip.multicast_start(local_ip)
     else:
         tulip.multicast_start("")
+    if sync_handle is None:
+        sync(0)
 
+# Tulip Desktop only: a mesh of virtual nodes with their own clocks, over a fake network with the
+# latency, jitter and loss you ask for. Everything else (send, sync, map, clocks) works as with mesh().
+# Use instead of mesh(), not after it. sim_stats() says how it's going.
+def simulate(nodes=8, latency_ms=5, jitter_ms=2, loss=0.0, binary=False, seed=1):
+    if tulip.board() != "DESKTOP":
+        print("Simulated meshes are only on Tulip Desktop.")
+        return
+    if mesh_flag:
+        print("The mesh is already running. alles.stop() first.")
+        return
+    start_mesh(binary)
+    if not tulip.alles_sim(nodes, latency_ms, jitter_ms, loss, seed):
+        print("Couldn't start the simulated mesh.")
+        stop()
+        return
+    if sync_handle is None:
+        sync(0)
 
+def sim_stats():
+    return tulip.alles_sim_stats()
 
-
-
-
-
-
-
+# Leave the mesh and go back to playing locally. On Tulip Desktop this also closes the mesh socket and
+# shuts down a simulated mesh, so mesh() or simulate() can start a fresh one.
+def stop():
+    global mesh_flag
+    stop_sync()
+    mesh_flag = 0
+    amy.insert_time = None
+    if tulip.board() == "DESKTOP":
+        tulip.alles_stop()
@@ -37,9 +37,13 @@ class Editor(tulip.UIScreen):
         if(self.first_run):
             self.first_run = False
             if(self.filename is None):
-                tulip.run_editor()
+                ok = tulip.run_editor()
             else:
-                tulip.run_editor(self.filename)
+                ok = tulip.run_editor(self.filename)
+            if not ok:
+                # Once present() is done setting us up
+                tulip.defer(self.quit_after_fail, None, 0)
+                return
 
         tulip.keyboard_callback(tulip.key_editor)
         # The TFB switches over, but the REPL will print >>> after this runs, 
@@ -48,6 +52,11 @@ class Editor(tulip.UIScreen):
         # And because of the TFB clearing, the buttons may get destroyed, so re-draw them
         tulip.defer(draw, None, 100)
 
+    def quit_after_fail(self, x):
+        self.quit()
+        # Back on the REPL's TFB, so this stays up
+        print("Not enough memory to edit %s." % (self.filename or "a new file"))
+
 # Launch the tulip editor as a UIScreen
 def edit(filename=None):
     global editor
@@ -574,10 +574,38 @@ def run(module_string):
         # Clean up the screen
         if(screen): screen.screen_quit_callback(None)
 
-def url_save(url, filename, mode="wb", headers={"User-Agent":"TulipCC/4.0"}):
-    import urequests
-    d = urequests.get(url, headers = headers).save(filename,mode)
-    return d
+# Streams url to filename in chunk_size pieces. progress(bytes_so_far, total_or_None) is called as it goes.
+# With resume=True, a partial filename is picked up where it left off with a Range request.
+# Returns the number of bytes written this time.
+def url_save(url, filename, mode="wb", headers={"User-Agent":"TulipCC/4.0"}, progress=None, resume=False, chunk_size=4096):
+    import urequests, os
+    start = 0
+    if resume:
+        try:
+            start = os.stat(filename)[6]
+        except OSError:
+            start = 0
+    if start:
+        headers = dict(headers)
+        headers["Range"] = "bytes=%d-" % (start)
+    r = urequests.get(url, headers = headers)
+    if start and r.status_code == 416:
+        # Nothing past what we already have
+        r.close()
+        return 0
+    if start and r.status_code == 206:
+        mode = "ab"
+    elif r.status_code == 200:
+        # The server sent the whole thing, start over
+        start = 0
+    else:
+        # An error page isn't the file. Leave what we have alone
+        r.close()
+        raise OSError("%s: status %d" % (url, r.status_code))
+    report = progress
+    if progress is not None and start:
+        report = lambda n, total: progress(start + n, None if total is None else start + total)
+    return r.save(filename, mode, chunk_size, report)
 
 def url_get(url, headers={"User-Agent":"TulipCC/4.0"}):
     import urequests
@@ -668,29 +696,51 @@ def tar_create(directory):
     t.add(directory)
     t.close()
 
+def _tar_ignored(name):
+    return name.startswith(".") or "._" in name
+
 def tar_extract(file_name, show_progress=True):
     import os
     import utarfile
-    tar = utarfile.TarFile(file_name, 'r')
     if(show_progress): print("extracting", file_name)
+    # First pass reads only the headers, so every directory can be made up front, parents first
+    tar = utarfile.TarFile(file_name, 'r')
+    dirs = set()
+    total = 0
     for i in tar:
         if i.type == utarfile.DIRTYPE:
-            if i.name != './':
-                try:
-                    os.mkdir(i.name.strip('/'))
-                except OSError as error:
-                    if(show_progress): print("Warning: directory",i.name,"already exists")
-            if(show_progress): print("making:", i.name)
+            d = i.name.strip('/')
+        elif _tar_ignored(i.name):
+            continue
         else:
-            if i.name.startswith(".") or "._" in i.name:
-                if(show_progress): print("ignoring", i.name)
-            else:
-                if(show_progress): print("extracting:", i.name)
-                sub_file = tar.extractfile(i)
-                data = sub_file.read()
-                try:
-                    with open(i.name, "wb") as dest:
-                        dest.write(data)
-                        dest.close()
-                except OSError as error:
-                    if(show_progress): print("borked on:", i.name)
+            total += i.size
+            d = i.name.rsplit('/', 1)[0] if '/' in i.name else ''
+        while d not in ('', '.') and d not in dirs:
+            dirs.add(d)
+            d = d.rsplit('/', 1)[0] if '/' in d else ''
+    tar.close()
+    for d in sorted(dirs):
+        try:
+            os.mkdir(d)
+        except OSError as error:
+            pass # already there
+    # Then stream each file's contents straight to disk
+    tar = utarfile.TarFile(file_name, 'r')
+    done = 0
+    shown = 0
+    for i in tar:
+        if i.type == utarfile.DIRTYPE:
+            continue
+        if _tar_ignored(i.name):
+            if(show_progress): print("ignoring", i.name)
+            continue
+        try:
+            with open(i.name, "wb") as dest:
+                done += tar.extractfile(i).copyto(dest)
+        except OSError as error:
+            if(show_progress): print("borked on:", i.name)
+        if(show_progress and total and done * 10 // total > shown):
+            shown = done * 10 // total
+            print("extracted %d%%" % (shown * 10))
+    tar.close()
+    if(show_progress): print("made %d directories, wrote %d bytes" % (len(dirs), done))
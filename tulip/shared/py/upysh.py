@@ -44,18 +44,21 @@ class CLEAR:
 
 
 def head(f, n=10):
+    import tulip
+    for l in tulip.read_lines(f, n):
+        print(l)
+
+
+def cat(f):
+    # A line at a time, read_lines would hold the whole file
     with open(f) as f:
-        for i in range(n):
+        while True:
             l = f.readline()
             if not l:
                 break
             print(l, end='')
 
 
-def cat(f):
-    head(f, 1 << 30)
-
-
 def cp(s, t):
     try:
         if os.stat(t)[0] & 0x4000:  # is directory
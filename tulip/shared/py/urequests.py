@@ -6,6 +6,7 @@ class Response:
         self.raw = f
         self.encoding = "utf-8"
         self._cached = None
+        self._json = None
 
     def close(self):
         if self.raw:
@@ -21,20 +22,35 @@ class Response:
                 break
             yield data
 
-    def save(self, filename, mode="wb", chunk_size=4096):
-        # Directly save a file from the response socket without putting all of it in RAM
+    # Body length from the headers, or None if the server didn't say
+    def content_length(self):
+        for k in getattr(self, "headers", {}):
+            if k.lower() == "content-length":
+                return int(self.headers[k])
+        return None
+
+    def save(self, filename, mode="wb", chunk_size=4096, progress=None, buf=None):
+        # Directly save a file from the response socket without putting all of it in RAM.
+        # Every chunk is read into the same buffer, so a big download doesn't churn the heap.
+        # progress(bytes_so_far, total_or_None) is called after each chunk.
+        if buf is None:
+            buf = bytearray(chunk_size)
+        mv = memoryview(buf)
+        total = self.content_length()
         f = open(filename, mode)
         b = 0
-        while True:
-            chunk = self.raw.read(chunk_size)
-            b = b + len(chunk)
-            if len(chunk)==0:
-                break # EOF
-            f.write(chunk)
-        f.close()
-        self.raw.close()
-        self.raw = None
-        self._cached = None
+        try:
+            while True:
+                n = self.raw.readinto(mv)
+                if not n:
+                    break # EOF
+                f.write(mv[:n])
+                b = b + n
+                if progress is not None:
+                    progress(b, total)
+        finally:
+            f.close()
+            self.close()
         return b # number of bytes saved
 
     @property
@@ -52,9 +68,11 @@ class Response:
         return str(self.content, self.encoding)
 
     def json(self):
-        import ujson
-
-        return ujson.loads(self.content)
+        # Parsed once, however many times it's asked for
+        if self._json is None:
+            import ujson
+            self._json = ujson.loads(self.content)
+        return self._json
 
 
 def request(
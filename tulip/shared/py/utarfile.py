@@ -20,6 +20,8 @@ REGTYPE = "file"
 NUL = b"\0"  # the null character
 BLOCKSIZE = 512  # length of processing blocks
 RECORDSIZE = BLOCKSIZE * 20  # length of records
+# Scratch buffer for copying file contents, reused for every entry
+BUFSIZE = BLOCKSIZE * 32
 
 
 def roundup(val, align):
@@ -27,10 +29,11 @@ def roundup(val, align):
 
 
 class FileSection:
-    def __init__(self, f, content_len, aligned_len):
+    def __init__(self, f, content_len, aligned_len, scratch):
         self.f = f
         self.content_len = content_len
         self.align = aligned_len - content_len
+        self.scratch = scratch
 
     def read(self, sz=65536):
         if self.content_len == 0:
@@ -51,14 +54,29 @@ class FileSection:
         self.content_len -= sz
         return sz
 
+    def copyto(self, dest):
+        # Stream the rest of this entry to dest in BUFSIZE pieces, without holding it all in RAM
+        mv = memoryview(self.scratch)
+        n = 0
+        while self.content_len:
+            sz = self.readinto(mv)
+            if not sz:
+                break  # truncated archive
+            dest.write(mv[:sz])
+            n += sz
+        return n
+
     def skip(self):
         sz = self.content_len + self.align
+        self.content_len = self.align = 0
         if sz:
-            buf = bytearray(16)
-            while sz:
-                s = min(sz, 16)
-                self.f.readinto(buf, s)
-                sz -= s
+            try:
+                self.f.seek(sz, 1)
+            except (AttributeError, OSError):
+                while sz:
+                    s = min(sz, len(self.scratch))
+                    self.f.readinto(self.scratch, s)
+                    sz -= s
 
 
 class TarInfo:
@@ -97,14 +115,17 @@ class TarFile:
         self.subf = None
         self.mode = mode
         self.offset = 0
+        self.hdr = bytearray(BLOCKSIZE)
+        self.scratch = bytearray(BUFSIZE)
 
     def next(self):
         if self.subf:
             self.subf.skip()
-        buf = self.f.read(BLOCKSIZE)
-        if not buf:
+        buf = self.hdr
+        n = self.f.readinto(buf)
+        if not n:
             return None
-        self.offset += len(buf)
+        self.offset += n
 
         h = uctypes.struct(uctypes.addressof(buf), TAR_HEADER, uctypes.LITTLE_ENDIAN)
 
@@ -116,7 +137,7 @@ class TarFile:
         d.name = str(h.name, "utf-8").rstrip("\0")
         d.size = int(bytes(h.size), 8)
         d.type = [REGTYPE, DIRTYPE][d.name[-1] == "/"]
-        self.subf = d.subf = FileSection(self.f, d.size, roundup(d.size, BLOCKSIZE))
+        self.subf = d.subf = FileSection(self.f, d.size, roundup(d.size, BLOCKSIZE), self.scratch)
         self.offset += roundup(d.size, BLOCKSIZE)
         return d
 
@@ -161,7 +182,13 @@ class TarFile:
 
         # Copy the file contents, if any.
         if fileobj:
-            n_bytes = self.f.write(fileobj.read())
+            n_bytes = 0
+            mv = memoryview(self.scratch)
+            while True:
+                sz = fileobj.readinto(mv)
+                if not sz:
+                    break
+                n_bytes += self.f.write(mv[:sz])
             self.offset += n_bytes
             remains = -n_bytes & (BLOCKSIZE - 1)  # == 0b111111111
             if remains:
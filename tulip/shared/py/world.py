@@ -58,74 +58,213 @@ headers = { "Authorization":"Bot {}".format(ta+'.'+tb),
 
 discord_epoch = 1420070400000
 
-# get the last n messages
-def messages(n=500, chunk_size = 100, mtype='text'):
-    ret = []
-    before = None
-
-    base_url = files_base_url
-    if(mtype == 'text'): base_url = text_base_url
+# Listings are cached on disk, newest first, keyed by Discord message id. Each call asks the server only
+# for what's newer than the cache (after=), and pages further back only when asked for more than it holds.
+CACHE_MAX = 5000
+_caches = {}
+server_time_ms = 0
+
+def _cache_filename(mtype):
+    return tulip.root_dir() + "user/.world_%s.json" % (mtype)
+
+def _load_cache(mtype):
+    c = _caches.get(mtype)
+    if c is None:
+        try:
+            c = json.load(open(_cache_filename(mtype), 'r'))
+        except (OSError, ValueError):
+            c = None
+        if c is None or c.get('version') != 2:
+            # scanned counts server messages, records only the valid ones for this channel
+            c = {'version':2, 'records':[], 'newest':None, 'oldest':None, 'scanned':0, 'complete':False}
+        _caches[mtype] = c
+    return c
+
+def _save_cache(mtype):
+    try:
+        f = open(_cache_filename(mtype), 'w')
+        json.dump(_caches[mtype], f)
+        f.close()
+    except OSError:
+        pass
+
+def clear_cache():
+    global _caches
+    _caches = {}
+    for mtype in ('text', 'files'):
+        try:
+            os.remove(_cache_filename(mtype))
+        except OSError:
+            pass
 
-    # First one is the newest
-    # https://discord.com/developers/docs/resources/channel#get-channel-messages
-    if(n<chunk_size): chunk_size = n
-    response = requests.get(base_url+"messages?limit=%d" % (chunk_size), headers = headers)
+def _get_page(base_url, limit, query=""):
+    global server_time_ms
+    response = requests.get(base_url+"messages?limit=%d%s" % (limit, query), headers = headers)
     # We get a x-ratelimit-reset from the headers here, we can use that to know what time it is
     # We have to do it this way because (1) micropython does not have datetime/dateutil
     # and (2) we often do not know what time it is on Tulip 
     server_time_ms = (int(response.headers['x-ratelimit-reset'])-1)*1000
+    page = response.json()
+    # Newest first, whichever way we paged
+    page.sort(key=lambda i: int(i['id']), reverse=True)
+    return page
+
+# A Discord message as a cache record, or None if it isn't a valid TW message / file
+def _record(i, mtype):
+    try:
+        # Discord trims spaces at the end of content
+        if(i['content'].endswith('#')): i['content']=i['content']+' '
+        (username, content) = i['content'].split(" ### ")
+    except ValueError: # not a valid TW message / file
+        return None
+    r = {
+        'id':i['id'],
+        # Discord IDs have epoch ms (since 2015) encoded in them
+        'time':((int(i['id']) >> 22) + discord_epoch),
+        'username':username,
+        'content':content
+    }
+    if mtype=='text' and len(i['attachments']) == 0:
+        return r
+    if mtype=='files' and len(i['attachments']) > 0:
+        a = i['attachments'][0]
+        # Attachment urls expire. download() fetches a fresh one when this one has
+        r.update({
+            'filename':a['filename'], 
+            'size':a['size'], 
+            'content_type':a['content_type'],
+            'url':a['url']
+        })
+        return r
+    return None
+
+def _add(c, page, mtype, at_end):
+    records = [r for r in (_record(i, mtype) for i in page) if r is not None]
+    if at_end:
+        c['records'].extend(records)
+    else:
+        c['records'] = records + c['records']
+    c['scanned'] += len(page)
 
-    # Pull up to n messages from discord, using paging
-    all_responses = response.json()
-    while(len(all_responses)<n and len(response.json())==chunk_size):
-        oldest_id = response.json()[-1]['id']
-        response = requests.get(base_url+"messages?limit=%d&before=%s" % (chunk_size, oldest_id), headers=headers)
-        all_responses = all_responses + response.json()
-
+# Brings the cache for mtype up to date, going back at least n messages if the channel has them
+def sync(n=500, chunk_size=100, mtype='text'):
+    base_url = files_base_url
+    if(mtype == 'text'): base_url = text_base_url
+    c = _load_cache(mtype)
+    if(n > CACHE_MAX): n = CACHE_MAX
+    if c['newest'] is None:
+        if(n<chunk_size): chunk_size = n
+        page = _get_page(base_url, chunk_size)
+        if len(page):
+            c['newest'] = page[0]['id']
+            c['oldest'] = page[-1]['id']
+        c['complete'] = len(page) < chunk_size
+        _add(c, page, mtype, True)
+    else:
+        # Everything since the newest we know about, usually one short page
+        while True:
+            page = _get_page(base_url, chunk_size, "&after=%s" % (c['newest']))
+            if len(page) == 0:
+                break
+            c['newest'] = page[0]['id']
+            _add(c, page, mtype, False)
+            if len(page) < chunk_size:
+                break
+    # Older messages, if the cache doesn't go back far enough yet
+    while c['scanned'] < n and not c['complete']:
+        page = _get_page(base_url, chunk_size, "&before=%s" % (c['oldest']))
+        if len(page):
+            c['oldest'] = page[-1]['id']
+        c['complete'] = len(page) < chunk_size
+        _add(c, page, mtype, True)
+    if len(c['records']) > CACHE_MAX:
+        c['records'] = c['records'][:CACHE_MAX]
+        c['oldest'] = c['records'][-1]['id']
+        c['scanned'] = CACHE_MAX
+        c['complete'] = False
+    _save_cache(mtype)
+    return c
 
-    for i in all_responses[:n]:
-        try:
-            # Discord trims spaces at the end of content
-            if(i['content'].endswith('#')): i['content']=i['content']+' '
-            (username, content) = i['content'].split(" ### ")
-        except ValueError: # not a valid TW message / file
-            continue
-        r = {
-            # Discord IDs have epoch ms (since 2015) encoded in them
-            'age_ms':server_time_ms - ((int(i['id']) >> 22) + discord_epoch), 
-            'time':((int(i['id']) >> 22) + discord_epoch),
-            'username':username,
-            'content':content
-        }
-        if mtype=='text' and len(i['attachments']) == 0:
-            ret.append(r)
-
-        if mtype=='files' and len(i['attachments']) > 0:
-            a = i['attachments'][0]
-            r.update({
-                'filename':a['filename'], 
-                'size':a['size'], 
-                'url':a['url'], 
-                'content_type':a['content_type']
-            })
-            ret.append(r)
+# get the last n messages
+def messages(n=500, chunk_size = 100, mtype='text'):
+    ret = []
+    for i in sync(n, chunk_size, mtype)['records'][:n]:
+        r = dict(i)
+        r['age_ms'] = server_time_ms - i['time']
+        ret.append(r)
     return ret
 
-def download(filename, username=None, limit=5000, chunk_size=4096):
+# The newest file called filename (by username, if given), from the cache. Doesn't ask the server.
+def find(filename, username=None):
+    for r in _load_cache('files')['records']:
+        if r['filename'] == filename and (username is None or username == r['username']):
+            r = dict(r)
+            r['age_ms'] = server_time_ms - r['time']
+            return r
+    return None
+
+# Discord attachment urls carry their expiry as ex=<hex unix seconds>. No ex=, assume it has expired.
+def _url_expired(url):
+    try:
+        ex = url.split('ex=')[1].split('&')[0]
+        return int(ex, 16) * 1000 <= server_time_ms
+    except (IndexError, ValueError):
+        return True
+
+def _evict(r, mtype='files'):
+    c = _load_cache(mtype)
+    c['records'] = [i for i in c['records'] if i['id'] != r['id']]
+    _save_cache(mtype)
+
+# Download url for a file record, asking the server for a fresh one if the cached one has expired.
+# Returns None if the server won't give one. A message that's gone (404) or has lost its attachment
+# is dropped from the cache for good. Anything else (rate limits, server errors) may pass, so the
+# record stays for next time.
+def _file_url(r):
+    if r.get('url') and not _url_expired(r['url']):
+        return r['url']
+    response = requests.get(files_base_url+"messages/%s" % (r['id']), headers = headers)
+    if response.status_code != 200 and response.status_code != 404:
+        print("Can't get %s from Tulip World right now (status %d), try again later" % (r['filename'], response.status_code))
+        return None
+    try:
+        if response.status_code == 404:
+            raise ValueError("it has been deleted")
+        url = response.json()['attachments'][0]['url']
+        if not url:
+            raise ValueError("no attachment")
+    except (IndexError, KeyError, TypeError, ValueError) as e:
+        print("Can't get %s from Tulip World (%s)" % (r['filename'], e))
+        _evict(r)
+        return None
+    for i in _load_cache('files')['records']:
+        if i['id'] == r['id']:
+            i['url'] = url
+    _save_cache('files')
+    return url
+
+def download(filename, username=None, limit=5000, chunk_size=4096, progress=None, retries=3):
     got = None
     # Check for an extension
     if('.' not in filename[-5:]):
         filename = filename + ".tar"
-    for file in messages(n=limit, mtype='files'):
-        if(file["filename"] == filename):
-            if username is None or username==file['username']:
-                got = file
-                break
+    sync(n=limit, mtype='files')
+    got = find(filename, username)
     if got is not None:
         age_nice = nice_time(got["age_ms"])
-        grab_url = got["url"] # Will get the latest (most recent) file with that name
-
-        r = tulip.url_save(got['url'], filename)
+        got['url'] = _file_url(got) # Will get the latest (most recent) file with that name
+        if got['url'] is None:
+            return
+
+        # Streamed to disk. If the connection drops, pick up from where it got to.
+        for attempt in range(retries):
+            try:
+                tulip.url_save(got['url'], filename, progress=progress, resume=(attempt > 0), chunk_size=chunk_size)
+                break
+            except OSError as e:
+                if attempt == retries - 1:
+                    raise
+                print("Download of %s interrupted (%s), resuming" % (filename, e))
 
         print("Downloaded %s by %s [%d bytes, last updated %s] from Tulip World." % (filename,got['username'], got['size'], age_nice.lstrip()))
         if(filename.endswith('.tar')):
@@ -0,0 +1,61 @@
+// render_split.c
+// amy_render() takes a contiguous oscillator range per core. Rather than always giving each core half the
+// oscillators, we time every oscillator as it renders (from the render hook), keep a smoothed cost per
+// oscillator, and after each block move the range boundaries so each core gets about the same total cost.
+// Patches that cluster on low oscillator numbers (like the Juno voices) then spread across every core.
+
+#include "render_split.h"
+
+uint16_t render_split_bounds[RENDER_SPLIT_MAX_PARTS + 1];
+uint8_t render_split_parts = 1;
+
+// Cost of each oscillator in the last block, and smoothed over blocks, in us
+float osc_cost_block[AMY_OSCS];
+float osc_cost[AMY_OSCS];
+
+// Every render thread times its own oscillators
+static __thread int64_t render_split_last_us;
+
+// Oscillators that didn't render still cost a little to skip over
+#define RENDER_SPLIT_IDLE_COST 0.05f
+#define RENDER_SPLIT_SMOOTHING 0.25f
+
+void render_split_init(uint8_t parts) {
+    if(parts < 1) parts = 1;
+    if(parts > RENDER_SPLIT_MAX_PARTS) parts = RENDER_SPLIT_MAX_PARTS;
+    render_split_parts = parts;
+    for(uint16_t i=0;i<AMY_OSCS;i++) { osc_cost_block[i] = 0; osc_cost[i] = 0; }
+    for(uint8_t p=0;p<=parts;p++) render_split_bounds[p] = (uint16_t)(((uint32_t)AMY_OSCS * p) / parts);
+}
+
+void render_split_part_start() {
+    render_split_last_us = get_time_us();
+}
+
+void render_split_osc(uint16_t osc) {
+    int64_t now = get_time_us();
+    if(osc < AMY_OSCS) osc_cost_block[osc] = (float)(now - render_split_last_us);
+    render_split_last_us = now;
+}
+
+void render_split_update() {
+    if(render_split_parts < 2) return;
+    float total = 0;
+    for(uint16_t i=0;i<AMY_OSCS;i++) {
+        osc_cost[i] += (osc_cost_block[i] - osc_cost[i]) * RENDER_SPLIT_SMOOTHING;
+        osc_cost_block[i] = 0;
+        total += osc_cost[i] + RENDER_SPLIT_IDLE_COST;
+    }
+    // Walk the prefix sum, cutting whenever we pass the next 1/parts of the total
+    float running = 0;
+    uint8_t p = 1;
+    for(uint16_t i=0;i<AMY_OSCS && p<render_split_parts;i++) {
+        running += osc_cost[i] + RENDER_SPLIT_IDLE_COST;
+        while(p < render_split_parts && running >= total * p / render_split_parts) {
+            render_split_bounds[p++] = i + 1;
+        }
+    }
+    while(p < render_split_parts) render_split_bounds[p++] = AMY_OSCS;
+    render_split_bounds[0] = 0;
+    render_split_bounds[render_split_parts] = AMY_OSCS;
+}
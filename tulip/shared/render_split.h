@@ -0,0 +1,21 @@
+// render_split.h
+// Splits AMY's oscillators across render cores by measured cost instead of a fixed half/half.
+#ifndef RENDER_SPLIT_H
+#define RENDER_SPLIT_H
+
+#include "polyfills.h"
+
+#define RENDER_SPLIT_MAX_PARTS 8
+
+// Part p renders oscillators render_split_bounds[p] .. render_split_bounds[p+1]
+extern uint16_t render_split_bounds[RENDER_SPLIT_MAX_PARTS + 1];
+
+void render_split_init(uint8_t parts);
+// Call on each render thread right before its amy_render()
+void render_split_part_start();
+// Call from amy_external_render_hook, once per oscillator rendered
+void render_split_osc(uint16_t osc);
+// Call once all parts have finished a block, moves the bounds for the next one
+void render_split_update();
+
+#endif
@@ -1,44 +1,420 @@
-
 #include "tsequencer.h"
 #include <inttypes.h>
+#include <string.h>
 
-mp_obj_t sequencer_callbacks[SEQUENCER_SLOTS];
-uint8_t sequencer_dividers[SEQUENCER_SLOTS];
-
-mp_obj_t defer_callbacks[DEFER_SLOTS];
-mp_obj_t defer_args[DEFER_SLOTS];
-uint32_t defer_sysclock[DEFER_SLOTS];
 #ifdef AMY_IS_EXTERNAL
 uint32_t sequencer_tick_count = 0;
 #endif
 
+// The hook runs on the audio / sequencer thread while Python adds and cancels from the MP task.
+#if defined ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+static portMUX_TYPE tseq_mux = portMUX_INITIALIZER_UNLOCKED;
+#define TSEQ_LOCK() portENTER_CRITICAL_SAFE(&tseq_mux)
+#define TSEQ_UNLOCK() portEXIT_CRITICAL_SAFE(&tseq_mux)
+#elif defined __EMSCRIPTEN__
+#define TSEQ_LOCK()
+#define TSEQ_UNLOCK()
+#else
+#include <pthread.h>
+static pthread_mutex_t tseq_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define TSEQ_LOCK() pthread_mutex_lock(&tseq_mutex)
+#define TSEQ_UNLOCK() pthread_mutex_unlock(&tseq_mutex)
+#endif
+
+#define TSEQ_NO_SLOT 0xFFFFFFFF
+
+typedef struct {
+    uint16_t *items; // slot indexes, ordered as a binary min-heap on slot.due
+    uint32_t count;
+} tseq_heap_t;
+
+tseq_entry_t *tseq_slots = NULL;
+uint32_t tseq_capacity = 0;
+uint32_t tseq_free_head = TSEQ_NO_SLOT;
+tseq_heap_t tseq_tick_heap = {NULL, 0};
+tseq_heap_t tseq_ms_heap = {NULL, 0};
+
+// The slot table is malloc_caps memory the GC doesn't scan, so each slot's callback and arg are
+// mirrored here (at slot*2 and slot*2+1) to keep them alive until the slot is freed.
+MP_REGISTER_ROOT_POINTER(mp_obj_t *tsequencer_roots);
+
+// Wraparound-safe "a comes before b"
+static inline uint8_t tseq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static inline void heap_set(tseq_heap_t *h, uint32_t pos, uint16_t slot) {
+    h->items[pos] = slot;
+    tseq_slots[slot].heap_pos = pos;
+}
+
+static void heap_sift_up(tseq_heap_t *h, uint32_t pos) {
+    uint16_t slot = h->items[pos];
+    while(pos > 0) {
+        uint32_t parent = (pos - 1) >> 1;
+        if(!tseq_before(tseq_slots[slot].due, tseq_slots[h->items[parent]].due)) break;
+        heap_set(h, pos, h->items[parent]);
+        pos = parent;
+    }
+    heap_set(h, pos, slot);
+}
+
+static void heap_sift_down(tseq_heap_t *h, uint32_t pos) {
+    uint16_t slot = h->items[pos];
+    while(1) {
+        uint32_t child = (pos << 1) + 1;
+        if(child >= h->count) break;
+        if(child + 1 < h->count && tseq_before(tseq_slots[h->items[child+1]].due, tseq_slots[h->items[child]].due)) child++;
+        if(!tseq_before(tseq_slots[h->items[child]].due, tseq_slots[slot].due)) break;
+        heap_set(h, pos, h->items[child]);
+        pos = child;
+    }
+    heap_set(h, pos, slot);
+}
+
+static void heap_push(tseq_heap_t *h, uint16_t slot) {
+    h->items[h->count] = slot;
+    tseq_slots[slot].heap_pos = h->count;
+    h->count++;
+    heap_sift_up(h, h->count - 1);
+}
+
+static void heap_remove(tseq_heap_t *h, uint32_t pos) {
+    h->count--;
+    if(pos == h->count) return;
+    heap_set(h, pos, h->items[h->count]);
+    if(pos > 0 && tseq_before(tseq_slots[h->items[pos]].due, tseq_slots[h->items[(pos-1)>>1]].due)) {
+        heap_sift_up(h, pos);
+    } else {
+        heap_sift_down(h, pos);
+    }
+}
+
+static void slot_free(uint16_t slot) {
+    tseq_entry_t *e = &tseq_slots[slot];
+    e->callback = NULL;
+    e->arg = NULL;
+    MP_STATE_VM(tsequencer_roots)[slot*2] = MP_OBJ_NULL;
+    MP_STATE_VM(tsequencer_roots)[slot*2+1] = MP_OBJ_NULL;
+    e->queue = TSEQ_QUEUE_FREE;
+    e->generation = (e->generation + 1) & 0x7FFF;
+    e->heap_pos = tseq_free_head;
+    tseq_free_head = slot;
+}
+
+static tseq_heap_t * heap_for(uint8_t queue) {
+    return (queue == TSEQ_QUEUE_MS) ? &tseq_ms_heap : &tseq_tick_heap;
+}
+
+// Doubles the slot table. Allocation happens outside the lock; only the copy + swap is locked.
+// Only called from the MicroPython task, as the roots come from the GC heap.
+static uint8_t tseq_grow() {
+    uint32_t new_capacity = tseq_capacity ? tseq_capacity * 2 : TSEQ_INITIAL_SLOTS;
+    if(new_capacity > TSEQ_MAX_SLOTS) new_capacity = TSEQ_MAX_SLOTS;
+    if(new_capacity <= tseq_capacity) return 0;
+
+    tseq_entry_t *slots = malloc_caps_tag(sizeof(tseq_entry_t) * new_capacity, MALLOC_CAP_INTERNAL, MEM_TAG_SEQUENCER);
+    uint16_t *tick_items = malloc_caps_tag(sizeof(uint16_t) * new_capacity, MALLOC_CAP_INTERNAL, MEM_TAG_SEQUENCER);
+    uint16_t *ms_items = malloc_caps_tag(sizeof(uint16_t) * new_capacity, MALLOC_CAP_INTERNAL, MEM_TAG_SEQUENCER);
+    mp_obj_t *roots = m_new_maybe(mp_obj_t, new_capacity * 2);
+    if(slots == NULL || tick_items == NULL || ms_items == NULL || roots == NULL) {
+        if(roots) m_del(mp_obj_t, roots, new_capacity * 2);
+        if(slots) free_caps(slots);
+        if(tick_items) free_caps(tick_items);
+        if(ms_items) free_caps(ms_items);
+        return 0;
+    }
+
+    TSEQ_LOCK();
+    tseq_entry_t *old_slots = tseq_slots;
+    uint16_t *old_tick_items = tseq_tick_heap.items;
+    uint16_t *old_ms_items = tseq_ms_heap.items;
+    mp_obj_t *old_roots = MP_STATE_VM(tsequencer_roots);
+    uint32_t old_capacity = tseq_capacity;
+    memset(roots, 0, sizeof(mp_obj_t) * new_capacity * 2);
+    if(tseq_capacity) {
+        memcpy(roots, old_roots, sizeof(mp_obj_t) * tseq_capacity * 2);
+        memcpy(slots, tseq_slots, sizeof(tseq_entry_t) * tseq_capacity);
+        memcpy(tick_items, tseq_tick_heap.items, sizeof(uint16_t) * tseq_tick_heap.count);
+        memcpy(ms_items, tseq_ms_heap.items, sizeof(uint16_t) * tseq_ms_heap.count);
+    }
+    tseq_slots = slots;
+    MP_STATE_VM(tsequencer_roots) = roots;
+    tseq_tick_heap.items = tick_items;
+    tseq_ms_heap.items = ms_items;
+    // Chain the new slots onto the free list, lowest index first
+    for(uint32_t i=new_capacity;i>tseq_capacity;i--) {
+        tseq_slots[i-1].callback = NULL;
+        tseq_slots[i-1].arg = NULL;
+        tseq_slots[i-1].generation = 0;
+        tseq_slots[i-1].queue = TSEQ_QUEUE_FREE;
+        tseq_slots[i-1].heap_pos = tseq_free_head;
+        tseq_free_head = i-1;
+    }
+    tseq_capacity = new_capacity;
+    TSEQ_UNLOCK();
+
+    if(old_slots) free_caps(old_slots);
+    if(old_tick_items) free_caps(old_tick_items);
+    if(old_ms_items) free_caps(old_ms_items);
+    if(old_roots) m_del(mp_obj_t, old_roots, old_capacity * 2);
+    return 1;
+}
+
+static int32_t tseq_add(uint8_t queue, mp_obj_t callback, mp_obj_t arg, uint32_t due, uint32_t period) {
+    if(tseq_free_head == TSEQ_NO_SLOT) {
+        if(!tseq_grow()) return -1;
+    }
+    TSEQ_LOCK();
+    uint16_t slot = tseq_free_head;
+    tseq_entry_t *e = &tseq_slots[slot];
+    tseq_free_head = e->heap_pos;
+    e->callback = callback;
+    e->arg = arg;
+    MP_STATE_VM(tsequencer_roots)[slot*2] = callback;
+    MP_STATE_VM(tsequencer_roots)[slot*2+1] = arg;
+    e->period = period;
+    e->queue = queue;
+    // Ticks are stamped under the lock so a hook can't run between reading the clock and pushing
+    if(queue == TSEQ_QUEUE_MS) {
+        e->due = get_ticks_ms() + due;
+    } else if(period) {
+        // Next tick t > now where t % period == phase
+        uint32_t next = sequencer_tick_count + 1;
+        e->due = next + ((due % period) + period - (next % period)) % period;
+    } else {
+        e->due = sequencer_tick_count + due;
+    }
+    heap_push(heap_for(queue), slot);
+    int32_t handle = ((int32_t)e->generation << 16) | slot;
+    TSEQ_UNLOCK();
+    return handle;
+}
+
+int32_t tsequencer_add_periodic(mp_obj_t callback, uint32_t divider, uint32_t phase) {
+    if(divider == 0) divider = AMY_SEQUENCER_PPQ;
+    return tseq_add(TSEQ_QUEUE_TICKS, callback, NULL, phase, divider);
+}
+
+int32_t tsequencer_add_oneshot(mp_obj_t callback, mp_obj_t arg, uint32_t ticks) {
+    if(ticks == 0) ticks = 1;
+    return tseq_add(TSEQ_QUEUE_TICKS, callback, arg, ticks, 0);
+}
+
+int32_t tsequencer_add_defer(mp_obj_t callback, mp_obj_t arg, uint32_t ms) {
+    return tseq_add(TSEQ_QUEUE_MS, callback, arg, ms, 0);
+}
+
+uint8_t tsequencer_cancel(int32_t handle) {
+    if(handle < 0) return 0;
+    uint32_t slot = handle & 0xFFFF;
+    uint16_t generation = (handle >> 16) & 0x7FFF;
+    uint8_t cancelled = 0;
+    TSEQ_LOCK();
+    if(slot < tseq_capacity) {
+        tseq_entry_t *e = &tseq_slots[slot];
+        if(e->queue != TSEQ_QUEUE_FREE && e->generation == generation) {
+            heap_remove(heap_for(e->queue), e->heap_pos);
+            slot_free(slot);
+            cancelled = 1;
+        }
+    }
+    TSEQ_UNLOCK();
+    return cancelled;
+}
+
+void tsequencer_cancel_ticks() {
+    TSEQ_LOCK();
+    while(tseq_tick_heap.count) {
+        uint16_t slot = tseq_tick_heap.items[tseq_tick_heap.count-1];
+        tseq_tick_heap.count--;
+        slot_free(slot);
+    }
+    TSEQ_UNLOCK();
+}
+
+uint32_t tsequencer_pending() {
+    return tseq_tick_heap.count + tseq_ms_heap.count;
+}
+
+
+#ifndef AMY_IS_EXTERNAL
+extern uint8_t mesh_flag;
+extern void alles_mesh_try_flush();
+tseq_track_t tseq_tracks[TSEQ_TRACKS];
+
+// A small PLL that follows the sysclock time of each sequencer tick. The hook itself can be
+// late by a few ms, so we stamp events from the smoothed estimate rather than "now".
+double tick_clock_ms = 0;      // smoothed ms per tick
+double tick_clock_time = 0;    // estimated sysclock of tick_clock_last_tick
+uint32_t tick_clock_last_tick = 0;
+int32_t tick_clock_last_now = 0;
+
+static void tick_clock_update(uint32_t tick, int32_t now) {
+    uint32_t dt = tick - tick_clock_last_tick;
+    if(tick_clock_ms <= 0 || dt == 0 || dt > AMY_SEQUENCER_PPQ) {
+        if(tick_clock_ms <= 0) tick_clock_ms = 60000.0 / (120.0 * AMY_SEQUENCER_PPQ);
+        tick_clock_time = now;
+    } else {
+        double predicted = tick_clock_time + tick_clock_ms * dt;
+        double err = (double)now - predicted;
+        if(err > tick_clock_ms * 4.0 || err < -tick_clock_ms * 4.0) {
+            // Tempo change or a stall -- reseed from the raw measurement
+            tick_clock_ms = (double)(now - tick_clock_last_now) / dt;
+            tick_clock_time = now;
+        } else {
+            tick_clock_time = predicted + err * 0.25;
+            tick_clock_ms += err * 0.05 / dt;
+        }
+    }
+    tick_clock_last_tick = tick;
+    tick_clock_last_now = now;
+}
+
+// Steps due this tick are copied out under the lock and handed to AMY after it's released,
+// as amy_add_event takes its own queue mutex.
+struct event tseq_track_staging[TSEQ_TRACKS];
+
+// Called with the lock held, returns the number of staged events
+static uint8_t tseq_tracks_stage(uint32_t tick_count) {
+    uint8_t staged = 0;
+    uint32_t tick = tick_count + TSEQ_TRACK_LOOKAHEAD_TICKS;
+    uint32_t time = (uint32_t)(tick_clock_time + tick_clock_ms * TSEQ_TRACK_LOOKAHEAD_TICKS + 0.5);
+    for(uint8_t i=0;i<TSEQ_TRACKS;i++) {
+        tseq_track_t *t = &tseq_tracks[i];
+        if(t->length == 0 || (tick % t->divider) != 0) continue;
+        uint16_t step = (tick / t->divider) % t->length;
+        if(t->has_event[step]) {
+            tseq_track_staging[staged] = t->events[step];
+            tseq_track_staging[staged].time = time;
+            staged++;
+        }
+    }
+    return staged;
+}
+
+int8_t tsequencer_track_set(uint8_t track, uint16_t length, uint16_t divider) {
+    if(track >= TSEQ_TRACKS || length == 0 || length > TSEQ_TRACK_MAX_STEPS || divider == 0) return -1;
+    struct event *events = malloc_caps_tag(sizeof(struct event) * length, MALLOC_CAP_SPIRAM, MEM_TAG_SEQUENCER);
+    uint8_t *has_event = malloc_caps_tag(length, MALLOC_CAP_INTERNAL, MEM_TAG_SEQUENCER);
+    if(events == NULL || has_event == NULL) {
+        if(events) free_caps(events);
+        if(has_event) free_caps(has_event);
+        return -1;
+    }
+    TSEQ_LOCK();
+    tseq_track_t *t = &tseq_tracks[track];
+    struct event *old_events = t->events;
+    uint8_t *old_has_event = t->has_event;
+    // Keep whatever steps survive the resize
+    for(uint16_t i=0;i<length;i++) {
+        has_event[i] = (i < t->length) ? t->has_event[i] : 0;
+        if(has_event[i]) events[i] = t->events[i];
+    }
+    t->events = events;
+    t->has_event = has_event;
+    t->length = length;
+    t->divider = divider;
+    TSEQ_UNLOCK();
+    if(old_events) free_caps(old_events);
+    if(old_has_event) free_caps(old_has_event);
+    return 0;
+}
+
+// message NULL or "" clears the step
+int8_t tsequencer_track_step(uint8_t track, uint16_t step, char * message) {
+    if(track >= TSEQ_TRACKS || step >= tseq_tracks[track].length) return -1;
+    struct event e = amy_default_event();
+    uint8_t has = 0;
+    if(message != NULL && message[0] != 0) {
+        // Parse here, in the caller's thread, so the hook only ever copies structs
+        e = amy_parse_message(message);
+        if(e.status == EVENT_TRANSFER_DATA) return -1;
+        has = 1;
+    }
+    TSEQ_LOCK();
+    if(step < tseq_tracks[track].length) {
+        if(has) tseq_tracks[track].events[step] = e;
+        tseq_tracks[track].has_event[step] = has;
+    }
+    TSEQ_UNLOCK();
+    return 0;
+}
+
+void tsequencer_track_clear(uint8_t track) {
+    if(track >= TSEQ_TRACKS) return;
+    TSEQ_LOCK();
+    tseq_track_t *t = &tseq_tracks[track];
+    struct event *old_events = t->events;
+    uint8_t *old_has_event = t->has_event;
+    t->events = NULL;
+    t->has_event = NULL;
+    t->length = 0;
+    TSEQ_UNLOCK();
+    if(old_events) free_caps(old_events);
+    if(old_has_event) free_caps(old_has_event);
+}
+
+uint8_t tsequencer_tracks_active() {
+    for(uint8_t i=0;i<TSEQ_TRACKS;i++) if(tseq_tracks[i].length) return 1;
+    return 0;
+}
+#endif
+
 void tulip_amy_sequencer_hook(uint32_t tick_count) {
     #ifdef AMY_IS_EXTERNAL
         sequencer_tick_count = tick_count;
     #endif
-    for(uint8_t i=0;i<DEFER_SLOTS;i++) {
-        if(defer_callbacks[i] != NULL && get_ticks_ms() > defer_sysclock[i]) {
-            //fprintf(stderr, "calling defer with sysclock %" PRIu32 " and actual %" PRIu32"\n", defer_sysclock[i], get_ticks_ms() );
-            mp_sched_schedule(defer_callbacks[i], defer_args[i]);
-            defer_callbacks[i] = NULL; defer_sysclock[i] = 0; defer_args[i] = NULL;
+    TSEQ_LOCK();
+    #ifndef AMY_IS_EXTERNAL
+    tick_clock_update(tick_count, get_ticks_ms());
+    // In mesh mode AMY messages go out to the mesh, not this AMY, so tracks don't play (modtulip warns)
+    uint8_t staged = mesh_flag ? 0 : tseq_tracks_stage(tick_count);
+    #endif
+    if(tseq_ms_heap.count) {
+        uint32_t now = get_ticks_ms();
+        while(tseq_ms_heap.count) {
+            uint16_t slot = tseq_ms_heap.items[0];
+            tseq_entry_t *e = &tseq_slots[slot];
+            if(!tseq_before(e->due, now)) break;
+            //fprintf(stderr, "calling defer with sysclock %" PRIu32 " and actual %" PRIu32"\n", e->due, now);
+            mp_sched_schedule(e->callback, e->arg);
+            heap_remove(&tseq_ms_heap, 0);
+            slot_free(slot);
         }
     }
 
-    for(uint8_t i=0;i<SEQUENCER_SLOTS;i++) {
-        if(sequencer_dividers[i]!=0) {
-            if(tick_count % sequencer_dividers[i] == 0) {
-                //fprintf(stderr, "scheduling cb with time %" PRIu64 ", lag %" PRIi32 " tick %" PRIu32 "\n",(next_amy_tick_us/1000)+sequencer_latency_ms, lag, sequencer_tick_count );
-                mp_sched_schedule(sequencer_callbacks[i], mp_obj_new_int(tick_count));
-            }
+    while(tseq_tick_heap.count) {
+        uint16_t slot = tseq_tick_heap.items[0];
+        tseq_entry_t *e = &tseq_slots[slot];
+        if(tseq_before(tick_count, e->due)) break;
+        mp_sched_schedule(e->callback, e->arg ? e->arg : mp_obj_new_int(tick_count));
+        if(e->period) {
+            // If ticks were skipped, fire once and realign rather than bursting
+            do { e->due += e->period; } while(!tseq_before(tick_count, e->due));
+            heap_sift_down(&tseq_tick_heap, 0);
+        } else {
+            heap_remove(&tseq_tick_heap, 0);
+            slot_free(slot);
         }
     }
+    TSEQ_UNLOCK();
+    #ifndef AMY_IS_EXTERNAL
+    for(uint8_t i=0;i<staged;i++) amy_add_event(tseq_track_staging[i]);
+    // Send whatever Python queued for the mesh since the last tick, whether or not the VM is busy
+    if(mesh_flag) alles_mesh_try_flush();
+    #endif
 }
 
 
 void tsequencer_init() {
-    for(uint8_t i=0;i<SEQUENCER_SLOTS;i++) { sequencer_callbacks[i] = NULL; sequencer_dividers[i] = 0; }
-    for(uint8_t i=0;i<DEFER_SLOTS;i++) { defer_callbacks[i] = NULL; defer_sysclock[i] = 0; }
+    TSEQ_LOCK();
+    while(tseq_tick_heap.count) slot_free(tseq_tick_heap.items[--tseq_tick_heap.count]);
+    while(tseq_ms_heap.count) slot_free(tseq_ms_heap.items[--tseq_ms_heap.count]);
+    TSEQ_UNLOCK();
     #ifndef AMY_IS_EXTERNAL
+    for(uint8_t i=0;i<TSEQ_TRACKS;i++) tsequencer_track_clear(i);
     amy_external_sequencer_hook = tulip_amy_sequencer_hook;
     #endif
 }
@@ -2,27 +2,71 @@
 #ifndef __TSEQUENCERH
 #define __TSEQUENCERH
 
-#define SEQUENCER_SLOTS 8
-#define DEFER_SLOTS 32
+// Scheduled callbacks live in a growable slot table, indexed by two min-heaps:
+// one ordered by sequencer tick (periodic callbacks + one-shot tick events), one by sysclock ms (defers).
+// The hook only ever looks at the top of each heap, so a tick costs O(due events * log n).
+#define TSEQ_INITIAL_SLOTS 16
+#define TSEQ_MAX_SLOTS 65535
+
+#define TSEQ_QUEUE_FREE 0
+#define TSEQ_QUEUE_TICKS 1
+#define TSEQ_QUEUE_MS 2
+
+// C-side pattern tracks. Steps are parsed AMY events, stamped with a sysclock time
+// TSEQ_TRACK_LOOKAHEAD_TICKS ahead of when they sound, so Python / GC pauses can't move them.
+#define TSEQ_TRACKS 16
+#define TSEQ_TRACK_MAX_STEPS 256
+#define TSEQ_TRACK_LOOKAHEAD_TICKS 2
+
 #include "py/mphal.h"
 #include "py/runtime.h"
 #include <stdio.h>
 #include "polyfills.h"
 #ifndef AMY_IS_EXTERNAL
-#include "sequencer.h" 
+#include "sequencer.h"
 #else
 extern uint32_t sequencer_tick_count;
 #define AMY_SEQUENCER_PPQ 48
 #endif
-extern mp_obj_t sequencer_callbacks[SEQUENCER_SLOTS];
-extern uint8_t sequencer_dividers[SEQUENCER_SLOTS];
 
-extern mp_obj_t defer_callbacks[DEFER_SLOTS];
-extern uint32_t defer_sysclock[DEFER_SLOTS];
-extern mp_obj_t defer_args[DEFER_SLOTS];
+typedef struct {
+    mp_obj_t callback;
+    mp_obj_t arg;        // NULL means pass the current tick count
+    uint32_t due;        // tick (or sysclock ms for defers) of the next firing
+    uint32_t period;     // in ticks, 0 for one-shot events
+    uint32_t heap_pos;   // position in its heap, or next free slot when unused
+    uint16_t generation; // bumped on free so stale handles can't cancel a reused slot
+    uint8_t queue;       // TSEQ_QUEUE_*
+} tseq_entry_t;
 
+#ifndef AMY_IS_EXTERNAL
+typedef struct {
+    struct event *events; // length events, only valid where has_event is set
+    uint8_t *has_event;
+    uint16_t length;
+    uint16_t divider;     // ticks per step
+} tseq_track_t;
+
+// Patterns are aligned to tick 0, so every track of the same length*divider shares a downbeat
+int8_t tsequencer_track_set(uint8_t track, uint16_t length, uint16_t divider);
+int8_t tsequencer_track_step(uint8_t track, uint16_t step, char * message);
+void tsequencer_track_clear(uint8_t track);
+// 1 if any track has a pattern. Tracks play on this Tulip's AMY only, so they're held silent in mesh mode
+uint8_t tsequencer_tracks_active();
+#endif
 
 void tsequencer_init();
 void tulip_amy_sequencer_hook(uint32_t tick_count);
 
-#endif
\ No newline at end of file
+// All of these return a handle >= 0, or -1 if no slot could be allocated.
+int32_t tsequencer_add_periodic(mp_obj_t callback, uint32_t divider, uint32_t phase);
+int32_t tsequencer_add_oneshot(mp_obj_t callback, mp_obj_t arg, uint32_t ticks);
+int32_t tsequencer_add_defer(mp_obj_t callback, mp_obj_t arg, uint32_t ms);
+
+// Returns 1 if the handle was live and is now cancelled.
+uint8_t tsequencer_cancel(int32_t handle);
+// Cancels every tick-based callback and event (defers are left alone)
+void tsequencer_cancel_ticks();
+uint32_t tsequencer_pending();
+
+#endif
@@ -29,13 +29,22 @@ EXTMOD_SRC_C += $(addprefix $(TULIP_EXTMOD_DIR)/, \
 	ui.c \
 	help.c \
 	tulip_helpers.c \
+	async_load.c \
 	editor.c \
+	editor_text.c \
+	editor_search.c \
 	keyscan.c \
 	midi.c \
 	alles.c \
+	alles_wire.c \
+	alles_sync.c \
+	alles_peers.c \
+	alles_reliable.c \
 	sounds.c \
 	lodepng.c \
 	tsequencer.c \
+	audio_stats.c \
+	render_split.c \
 	lvgl_u8g2.c \
 	)
 
@@ -2,6 +2,14 @@
 
 #include "tulip_helpers.h"
 #include "ui.h"
+#include "polyfills.h"
+#ifdef TULIP_DESKTOP
+#include "extmod/vfs_posix.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 extern uint8_t keyboard_send_keys_to_micropython;
 extern int8_t keyboard_grab_ui_focus;
 #ifdef __EMSCRIPTEN__
@@ -28,7 +36,58 @@ uint8_t file_exists(const char *filename) {
     return response;
 }
 
+#ifdef TULIP_DESKTOP
+// The host filesystem is mounted at / on desktop, so paths that land there can go straight to the OS
+// and skip making MicroPython string and file objects
+uint8_t file_on_host(const char *filename) {
+    const char *path_out;
+    mp_vfs_mount_t *vfs = mp_vfs_lookup_path(filename, &path_out);
+    if(vfs == MP_VFS_NONE || vfs == MP_VFS_ROOT) return 0;
+    return vfs->len == 1 && mp_obj_get_type(vfs->obj) == &mp_type_vfs_posix;
+}
+
+// Reads up to len bytes from fd, or the whole file if len < 0. Returns how many were read
+static uint32_t host_read(int fd, uint8_t *buf, int32_t len) {
+    uint32_t total = 0;
+    while(len < 0 || total < (uint32_t)len) {
+        ssize_t n = read(fd, buf + total, (len < 0) ? 65536 : (uint32_t)len - total);
+        if(n <= 0) break;
+        total += n;
+    }
+    return total;
+}
+
+int host_read_alloc(const char *filename, uint8_t **buf, uint32_t *len, uint32_t caps) {
+    *buf = NULL;
+    *len = 0;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return errno;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    *buf = (uint8_t*)malloc_caps_tag(st.st_size + 1, caps, MEM_TAG_FILES);
+    if(*buf == NULL) {
+        close(fd);
+        return ENOMEM;
+    }
+    *len = host_read(fd, *buf, st.st_size);
+    (*buf)[*len] = 0;
+    close(fd);
+    return 0;
+}
+#endif
+
 int32_t file_size(const char *filename) {
+    #ifdef TULIP_DESKTOP
+    if(file_on_host(filename)) {
+        struct stat st;
+        if(stat(filename, &st) != 0) return -1;
+        return st.st_size;
+    }
+    #endif
     if(file_exists(filename)) { 
         mp_obj_t m_args[1];
         m_args[0] = mp_obj_new_str(filename, strlen(filename));
@@ -42,13 +101,32 @@ int32_t file_size(const char *filename) {
     }
 }
 
-
+// Size of a file that's already open, so reading it all takes one path lookup, not three
+static int32_t open_file_size(mp_obj_t file, const char *filename) {
+    #ifdef __EMSCRIPTEN__
+    // No seeking on web
+    return file_size(filename);
+    #else
+    int32_t size = mp_stream_posix_lseek(MP_OBJ_TO_PTR(file), 0, SEEK_END);
+    if(size < 0) return file_size(filename);
+    mp_stream_posix_lseek(MP_OBJ_TO_PTR(file), 0, SEEK_SET);
+    return size;
+    #endif
+}
 
 // if len < 0, read the whole thing
 uint32_t read_file(const char *filename, uint8_t *buf, int32_t len, uint8_t binary) {
-    if(len<0) {
-    	len = file_size(filename);
+    #ifdef TULIP_DESKTOP
+    if(file_on_host(filename)) {
+        int fd = open(filename, O_RDONLY);
+        if(fd >= 0) {
+            uint32_t bytes_read = host_read(fd, buf, len);
+            close(fd);
+            return bytes_read;
+        }
+        // Let the VFS raise the error
     }
+    #endif
     mp_obj_t m_args[2];
     m_args[0] = mp_obj_new_str(filename, strlen(filename));
     if(binary) {
@@ -57,12 +135,38 @@ uint32_t read_file(const char *filename, uint8_t *buf, int32_t len, uint8_t bina
 	    m_args[1] = mp_obj_new_str("r",1);		
 	}
     mp_obj_t file = mp_vfs_open(2, &m_args[0], (mp_map_t *)&mp_const_empty_map);
+    if(len<0) {
+    	len = open_file_size(file, filename);
+    }
     int errcode;
     size_t bytes_read = mp_stream_rw(file, buf, len, &errcode, MP_STREAM_RW_READ | MP_STREAM_RW_ONCE);
     mp_stream_close(file);
     return bytes_read;
 }
 
+// Reads all of filename into a new buffer from malloc_caps(caps), with a 0 after the end.
+// Sets *len to its size. Returns NULL if out of memory, free it with free_caps.
+uint8_t * read_file_alloc(const char *filename, uint32_t *len, uint32_t caps) {
+    *len = 0;
+    uint8_t *buf = NULL;
+    #ifdef TULIP_DESKTOP
+    if(file_on_host(filename)) {
+        int err = host_read_alloc(filename, &buf, len, caps);
+        if(err == 0 || err == ENOMEM) return buf;
+        // Let the VFS raise the error
+    }
+    #endif
+    mp_obj_t file = tulip_fopen(filename, "rb");
+    int32_t size = open_file_size(file, filename);
+    if(size >= 0) buf = (uint8_t*)malloc_caps_tag(size + 1, caps, MEM_TAG_FILES);
+    if(buf) {
+        *len = tulip_fread(file, buf, size);
+        buf[*len] = 0;
+    }
+    tulip_fclose(file);
+    return buf;
+}
+
 // overwrites if exists
 uint32_t write_file(const char *filename, uint8_t *buf, uint32_t len, uint8_t binary) {
     mp_obj_t m_args[2];
@@ -118,26 +222,61 @@ uint32_t tulip_fseek(mp_obj_t file, uint32_t seekpoint, int32_t whence) {
     #endif
 }
 
-int32_t tulip_getline(char * line, uint32_t * len, mp_obj_t file ) {
-    // tulip_fread a char at a time until a \n
-    uint8_t buf[1];
-    int32_t rbytes = 0;
-    for(uint8_t i=0;i<255;i++) {
-        uint32_t bytes = tulip_fread(file, buf, 1);
-        rbytes += bytes;
-        if(bytes == 0) { // eof
-            line[i] = 0;
-            return rbytes;
+uint8_t tulip_reader_open(tulip_reader_t * r, const char *filename) {
+    memset(r, 0, sizeof(tulip_reader_t));
+    if(!file_exists(filename)) return 0;
+    // Opened first, as it raises for a directory or a file we can't read, and nothing is ours yet
+    r->file = tulip_fopen(filename, "rb");
+    r->block = (uint8_t*)malloc_caps_tag(TULIP_READER_BLOCK, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_FILES);
+    r->line_cap = 256;
+    r->line = (char*)malloc_caps_tag(r->line_cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_FILES);
+    if(r->block == NULL || r->line == NULL) {
+        tulip_reader_close(r);
+        return 0;
+    }
+    return 1;
+}
+
+int32_t tulip_reader_line(tulip_reader_t * r, char ** line) {
+    uint32_t n = 0;
+    uint8_t got = 0;
+    while(1) {
+        if(r->pos == r->len) {
+            r->pos = 0;
+            r->len = tulip_fread(r->file, r->block, TULIP_READER_BLOCK);
+            if(r->len == 0) break; // eof
+        }
+        got = 1;
+        // Copy up to the next \n in one go
+        uint8_t * start = r->block + r->pos;
+        uint8_t * nl = memchr(start, '\n', r->len - r->pos);
+        uint32_t take = nl ? (uint32_t)(nl - start) : r->len - r->pos;
+        if(n + take + 1 > r->line_cap) {
+            uint32_t cap = r->line_cap * 2;
+            while(cap < n + take + 1) cap *= 2;
+            char * grown = (char*)realloc_caps_tag(r->line, cap, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, MEM_TAG_FILES);
+            if(grown == NULL) return -2;
+            r->line = grown;
+            r->line_cap = cap;
         }
-        if(buf[0] == '\n') {
-            line[i] = 0;
-            return rbytes;
+        memcpy(r->line + n, start, take);
+        n += take;
+        r->pos += take;
+        if(nl) {
+            r->pos++;
+            break;
         }
-        line[i] = buf[0];
-        *len = *len + 1;
     }
-    line[254] = 0;
-    return rbytes;
+    if(!got) return -1;
+    if(n && r->line[n-1] == '\r') n--;
+    r->line[n] = 0;
+    *line = r->line;
+    return n;
 }
 
-
+void tulip_reader_close(tulip_reader_t * r) {
+    if(r->file) tulip_fclose(r->file);
+    if(r->block) free_caps(r->block);
+    if(r->line) free_caps(r->line);
+    memset(r, 0, sizeof(tulip_reader_t));
+}
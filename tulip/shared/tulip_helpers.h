@@ -16,12 +16,38 @@ extern ringbuf_t stdin_ringbuf;
 uint8_t file_exists(const char *filename);
 int32_t file_size(const char *filename);
 uint32_t read_file(const char *filename, uint8_t *buf, int32_t len, uint8_t binary);
+uint8_t * read_file_alloc(const char *filename, uint32_t *len, uint32_t caps);
+#ifdef TULIP_DESKTOP
+// 1 if filename is on the host filesystem, so the OS can open it by the same path
+uint8_t file_on_host(const char *filename);
+// Reads all of a host file with open/fstat/read into a malloc_caps buffer with a 0 after the end.
+// Touches no MicroPython objects, so it's safe off the MicroPython thread. Returns 0 or an errno.
+int host_read_alloc(const char *filename, uint8_t **buf, uint32_t *len, uint32_t caps);
+#endif
 uint32_t write_file(const char *filename, uint8_t *buf, uint32_t len, uint8_t binary);
 int check_rx_char();
 void tx_char(int c);
 mp_obj_t tulip_fopen(const char *filename, const char *mode);
 uint32_t tulip_fwrite(mp_obj_t file, uint8_t * buf, uint32_t len);
+uint32_t tulip_fread(mp_obj_t file, uint8_t * buf, uint32_t len);
 void tulip_fclose(mp_obj_t file);
 uint32_t tulip_fseek(mp_obj_t file, uint32_t seekpoint, int32_t whence);
-int32_t tulip_getline(char * line, uint32_t * len, mp_obj_t file );
+
+// Reads a text file a line at a time through a block buffer. Lines can be any length.
+// Keep the reader somewhere the GC looks (like the C stack) while it's open, it holds the file.
+#define TULIP_READER_BLOCK 4096
+typedef struct {
+    mp_obj_t file;
+    uint8_t * block;
+    uint32_t pos;
+    uint32_t len;
+    char * line;
+    uint32_t line_cap;
+} tulip_reader_t;
+// Returns 0 if the file doesn't exist or there's no memory. Raises like open() for other errors
+uint8_t tulip_reader_open(tulip_reader_t * r, const char *filename);
+// Points *line at the next line, without its \n (or \r\n) and 0 terminated. Returns its length, -1 at the end,
+// or -2 if the line is too long for the memory left. The line stays good until the next call.
+int32_t tulip_reader_line(tulip_reader_t * r, char ** line);
+void tulip_reader_close(tulip_reader_t * r);
 #endif
@@ -0,0 +1,45 @@
+# Checks the Alles mesh end to end against simulated nodes, on Tulip Desktop.
+# Copy it to Tulip Desktop, e.g. /user, and run it with execfile("alles_sim_check.py")
+import tulip, alles, amy, time
+
+NODES = 4
+failed = 0
+
+def check(name, ok, detail=""):
+    global failed
+    if not ok:
+        failed += 1
+    print("%s  %s %s" % ("PASS" if ok else "FAIL", name, detail))
+
+def wait_for(cond, ms):
+    while ms > 0 and not cond():
+        time.sleep_ms(100)
+        ms -= 100
+    return cond()
+
+if tulip.board() != "DESKTOP":
+    print("alles_sim_check needs Tulip Desktop")
+else:
+    alles.stop()
+    alles.simulate(nodes=NODES, latency_ms=5, jitter_ms=2, loss=0.0, binary=True)
+    # Nodes ping as they come up, and sync settles in 16 quick rounds
+    check("nodes found", wait_for(lambda: len(alles.map() or []) == NODES, 5000), str(alles.map()))
+    check("binary wire", wait_for(lambda: tulip.alles_wire() == 1, 2000))
+    check("clocks synced", wait_for(lambda: alles.sim_stats()['synced'] == NODES, 8000), str(alles.clocks()))
+
+    before = alles.sim_stats()
+    for i in range(10):
+        alles.send(osc=0, note=60+i, vel=0.5)
+        tulip.alles_flush()
+    alles.send(retries=4, volume=1)
+    wait_for(lambda: alles.sim_stats()['reliable'] - before['reliable'] >= NODES, 3000)
+    after = alles.sim_stats()
+    check("notes delivered", after['events'] - before['events'] >= 11 * NODES,
+        "%d events" % (after['events'] - before['events']))
+    check("reliable delivered", after['reliable'] - before['reliable'] == NODES,
+        "%d deliveries, %d repeats" % (after['reliable'] - before['reliable'], after['duplicates'] - before['duplicates']))
+    check("sync error", after['sync_error_ms'] < 10, "%.2fms" % after['sync_error_ms'])
+
+    alles.stop()
+    check("stopped", not alles.mesh_flag and not alles.sim_stats()['synced'])
+    print("alles_sim_check: %s" % ("all passed" if not failed else "%d failed" % failed))
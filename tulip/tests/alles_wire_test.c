@@ -0,0 +1,42 @@
+// alles_wire_test.c
+// Round trips ASCII AMY messages through the binary wire format, on the host.
+// Build and run from tulip/tests: cc -o /tmp/alles_wire_test alles_wire_test.c -lm && /tmp/alles_wire_test
+
+// Stand in for alles_reliable.h, which pulls in the firmware headers. Reliable frames aren't tested here.
+#define ALLES_RELIABLE_H
+#define ALLES_RELIABLE_MAGIC 0xE0
+#include <stdint.h>
+void alles_reliable_receive(char *data, uint16_t len, void (*handle)(char *message, uint16_t length)) {}
+#include "../shared/alles_wire.c"
+
+static int failed = 0;
+static char got[512];
+
+static void keep(char *message, uint16_t length) {
+    memcpy(got, message, length);
+    got[length] = 0;
+}
+
+static void check(const char *message, const char *want) {
+    uint8_t out[ALLES_WIRE_MAX_LEN];
+    got[0] = 0;
+    uint16_t n = alles_wire_encode(message, strlen(message), out, 0, sizeof(out));
+    if(n) alles_wire_split((char *)out, n, keep);
+    uint8_t ok = n && !strcmp(got, want);
+    if(!ok) failed++;
+    printf("%s  %s -> %s\n", ok ? "PASS" : "FAIL", message, n ? got : "(not encoded)");
+}
+
+int main() {
+    check("v0n60l0.5", "v0n60l0.5");
+    check("v1f-440.25t123456789", "v1f-440.25t123456789");
+    check("v2L1,2,3", "v2L1,2,3");
+    // These came out as 1e-05 and 1.5e+07 with %g, and the 'e' reads as the next field
+    check("v0a0.00001", "v0a0.00001");
+    check("v0b15000000.0", "v0b15000000");
+    check("v0a0.00000000000000000000000001", "v0a0.00000000000000000000000001");
+    check("v0l1.0", "v0l1");
+    check("v0l-0.0", "v0l-0");
+    printf("alles_wire_test: %s\n", failed ? "FAILED" : "all passed");
+    return failed != 0;
+}
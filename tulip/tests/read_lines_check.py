@@ -0,0 +1,38 @@
+# Checks tulip.read_lines on long lines, \r\n endings and the edges of its 4KB read block.
+# Copy it to Tulip, e.g. /user, and run it with execfile("read_lines_check.py")
+import tulip, os
+
+failed = 0
+
+def check(name, ok, detail=""):
+    global failed
+    if not ok:
+        failed += 1
+    print("%s  %s %s" % ("PASS" if ok else "FAIL", name, detail))
+
+fn = tulip.root_dir() + "user/.read_lines_check.txt"
+lines = [("a" * 300, "\r\n"), ("", "\r\n"), ("b" * 5000, "\n")]
+# A \r\n across the second block boundary: the \r as byte 8191, the \n first in the next block
+edge = 8191 - sum([len(l) + len(e) for (l, e) in lines])
+lines += [("c" * edge, "\r\n"), ("dos", "\r\n"), ("no newline at the end", "")]
+want = [l for (l, e) in lines]
+text = "".join([l + e for (l, e) in lines])
+
+f = open(fn, "w")
+f.write(text)
+f.close()
+
+got = tulip.read_lines(fn)
+check("line count", len(got) == len(want), "%d vs %d" % (len(got), len(want)))
+for i in range(min(len(got), len(want))):
+    check("line %d" % (i), got[i] == want[i], "%d bytes" % (len(got[i])))
+check("count", tulip.read_lines(fn, 2) == want[:2])
+open(fn, "w").close()
+check("empty file", tulip.read_lines(fn) == [])
+try:
+    tulip.read_lines(fn + ".missing")
+    check("missing file raises", False)
+except OSError:
+    check("missing file raises", True)
+os.remove(fn)
+print("read_lines_check: %s" % ("all passed" if not failed else "%d failed" % failed))
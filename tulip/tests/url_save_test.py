@@ -0,0 +1,83 @@
+# url_save_test.py
+# Checks tulip.url_save's handling of HTTP statuses, above all when resuming a partial download.
+# Runs on the host under CPython, with urequests stubbed: python3 url_save_test.py
+import sys, os, types, tempfile, ast
+
+# tulip.py needs the whole firmware to import, so just url_save is lifted out of it
+here = os.path.dirname(os.path.abspath(__file__))
+with open(os.path.join(here, "..", "shared", "py", "tulip.py")) as f:
+    source = ast.parse(f.read())
+tulip = types.ModuleType("tulip")
+for node in source.body:
+    if isinstance(node, ast.FunctionDef) and node.name == "url_save":
+        exec(compile(ast.Module(body=[node], type_ignores=[]), "tulip.py", "exec"), tulip.__dict__)
+
+class Response:
+    def __init__(self, status_code, body):
+        self.status_code = status_code
+        self.body = body
+        self.closed = False
+    def close(self):
+        self.closed = True
+    def save(self, filename, mode="wb", chunk_size=4096, progress=None):
+        with open(filename, mode) as f:
+            f.write(self.body)
+        self.close()
+        return len(self.body)
+
+served = []
+urequests = types.ModuleType("urequests")
+def get(url, headers={}):
+    served[0].headers = headers
+    return served[0]
+urequests.get = get
+sys.modules["urequests"] = urequests
+
+
+failed = 0
+
+def check(name, ok, detail=""):
+    global failed
+    if not ok:
+        failed += 1
+    print("%s  %s %s" % ("PASS" if ok else "FAIL", name, detail))
+
+def contents(fn):
+    if not os.path.exists(fn):
+        return None
+    with open(fn, "rb") as f:
+        return f.read()
+
+fn = os.path.join(tempfile.mkdtemp(), "part.bin")
+
+def run(status_code, body, start, resume=True):
+    if start is None:
+        if os.path.exists(fn):
+            os.remove(fn)
+    else:
+        with open(fn, "wb") as f:
+            f.write(start)
+    served[:] = [Response(status_code, body)]
+    try:
+        return tulip.url_save("http://x/f", fn, resume=resume)
+    except OSError as e:
+        return e
+
+got = run(206, b"rest", b"first ")
+check("206 appends", contents(fn) == b"first rest" and got == 4, repr(contents(fn)))
+check("206 asks for the rest", served[0].headers.get("Range") == "bytes=6-", repr(served[0].headers))
+for code in (403, 404, 500):
+    got = run(code, b"<html>error</html>", b"first ")
+    check("resume after %d raises" % (code), isinstance(got, OSError), repr(got))
+    check("resume after %d leaves the partial file" % (code), contents(fn) == b"first ", repr(contents(fn)))
+    check("resume after %d closes" % (code), served[0].closed)
+got = run(416, b"", b"first ")
+check("416 is done", got == 0 and contents(fn) == b"first ", repr(got))
+got = run(200, b"whole file", b"first ")
+check("200 starts over", got == 10 and contents(fn) == b"whole file", repr(contents(fn)))
+got = run(404, b"<html>error</html>", None, resume=False)
+check("404 raises", isinstance(got, OSError) and contents(fn) is None, repr(got))
+got = run(200, b"new", None, resume=False)
+check("200 saves", got == 3 and contents(fn) == b"new", repr(contents(fn)))
+print("url_save_test: %s" % ("all passed" if not failed else "%d failed" % failed))
+sys.exit(1 if failed else 0)